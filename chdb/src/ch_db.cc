@@ -12,7 +12,10 @@ int view_server::execute(unsigned int query_key, unsigned int proc, const chdb_p
 
     int temp_idx, temp_term;
     auto leader = this->leader();
-    leader->new_command(command, temp_term, temp_idx);
+    // a read only has to be linearizable, ReadIndex saves it a log entry unless the leader cannot confirm itself
+    if (command.cmd_tp != chdb_command::CMD_GET || !leader->read_index(temp_idx)) {
+        leader->new_command(command, temp_term, temp_idx);
+    }
 
     int base_port = this->node->port();
     int shard_offset = this->dispatch(query_key, shard_num());
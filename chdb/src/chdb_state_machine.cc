@@ -88,8 +88,20 @@ unmarshall &operator>>(unmarshall &u, chdb_command &cmd) {
 
 void chdb_state_machine::apply_log(raft_command &cmd) {
     // TODO: Your code here
-    chdb_command command = dynamic_cast<chdb_command &>(cmd);
     mtx.lock();
+    apply_locked(dynamic_cast<chdb_command &>(cmd));
+    mtx.unlock();
+}
+
+void chdb_state_machine::apply_logs(const std::vector<raft_command *> &cmds) {
+    mtx.lock();
+    for (auto cmd : cmds) {
+        apply_locked(dynamic_cast<chdb_command &>(*cmd));
+    }
+    mtx.unlock();
+}
+
+void chdb_state_machine::apply_locked(const chdb_command &command) {
     if (!mp.count(command.tx_id)) {
         mp.insert({command.tx_id,
                    std::vector < std::pair < chdb_command::command_type, std::vector < int>>>()});
@@ -101,5 +113,4 @@ void chdb_state_machine::apply_log(raft_command &cmd) {
     command.res->value = command.value;
     command.res->done = true;
     command.res->cv.notify_all();
-    mtx.unlock();
 }
\ No newline at end of file
@@ -65,6 +65,9 @@ public:
     // TODO: Implement this function.
     virtual void apply_log(raft_command &cmd) override;
 
+    // Apply a batch of logs under one lock.
+    virtual void apply_logs(const std::vector<raft_command *> &cmds) override;
+
     // Generate a snapshot of the current state.
     // In Chdb, you don't need to implement this function
     virtual std::vector<char> snapshot() {
@@ -76,6 +79,8 @@ public:
     virtual void apply_snapshot(const std::vector<char> &) {}
 
 private:
+    // must hold mtx
+    void apply_locked(const chdb_command &command);
 
     std::unordered_map<int, std::vector<std::pair < chdb_command::command_type, std::vector < int>>>>
     mp;
@@ -0,0 +1,217 @@
+#ifndef kv_btree_h
+#define kv_btree_h
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <algorithm>
+
+/**
+ * Ordered string map for kv_state_machine: a B+tree with wide nodes, the keys of a node sit next to each other.
+ *
+ * Copy-on-write by node: copying a tree is O(1) and shares every node, a write on either copy clones only
+ * the nodes on its path. A snapshot view is a copy, it reads on another thread while the original is written.
+ * Nodes are not rebalanced on erase, an emptied one is unlinked.
+ */
+class kv_btree {
+public:
+    kv_btree() : root(std::make_shared<node>(true)), count(0) {}
+
+    size_t size() const { return count; }
+
+    bool get(const std::string &key, std::string &value) const {
+        const node *n = root.get();
+        while (!n->leaf) {
+            n = n->children[child_index(*n, key)].get();
+        }
+        auto it = std::lower_bound(n->keys.begin(), n->keys.end(), key);
+        if (it == n->keys.end() || *it != key) {
+            return false;
+        }
+        value = n->values[it - n->keys.begin()];
+        return true;
+    }
+
+    // insert or replace, true if the key is new
+    bool put(const std::string &key, const std::string &value) {
+        std::string separator;
+        std::shared_ptr<node> right;
+        bool added = insert(root, key, value, separator, right);
+        if (right) {
+            // the root split, the tree grows by one level
+            std::shared_ptr<node> top = std::make_shared<node>(false);
+            top->keys.push_back(std::move(separator));
+            top->children.push_back(root);
+            top->children.push_back(right);
+            root = top;
+        }
+        count += added;
+        return added;
+    }
+
+    bool erase(const std::string &key) {
+        // look before cloning, a miss leaves the shared nodes alone
+        if (!contains(*root, key)) {
+            return false;
+        }
+        remove(root, key);
+        while (!root->leaf && root->children.size() == 1) {
+            root = root->children[0];
+        }
+        if (!root->leaf && root->children.empty()) {
+            root = std::make_shared<node>(true);
+        }
+        --count;
+        return true;
+    }
+
+    // erase [from, to), an empty to is unbounded, returns how many keys went
+    size_t erase_range(const std::string &from, const std::string &to) {
+        std::vector<std::string> keys;
+        scan(from, to, [&](const std::string &key, const std::string &) {
+            keys.push_back(key);
+            return true;
+        });
+        for (auto &key : keys) {
+            erase(key);
+        }
+        return keys.size();
+    }
+
+    // visit [from, to) in key order, an empty to is unbounded, until fn(key, value) returns false
+    template<typename F>
+    void scan(const std::string &from, const std::string &to, F fn) const {
+        scan(*root, from, to, fn);
+    }
+
+private:
+    static const size_t max_keys = 64;
+
+    struct node {
+        bool leaf;
+        // leaf: its keys. inner: keys[i] is the lowest key under children[i + 1]
+        std::vector<std::string> keys;
+        std::vector<std::string> values;                // leaf
+        std::vector<std::shared_ptr<node>> children;    // inner
+
+        explicit node(bool leaf) : leaf(leaf) {}
+    };
+
+    std::shared_ptr<node> root;
+    size_t count;
+
+    static size_t child_index(const node &n, const std::string &key) {
+        return std::upper_bound(n.keys.begin(), n.keys.end(), key) - n.keys.begin();
+    }
+
+    // the node to write, cloned first if another copy of the tree still shares it
+    static node &own(std::shared_ptr<node> &p) {
+        if (p.use_count() > 1) {
+            p = std::make_shared<node>(*p);
+        }
+        return *p;
+    }
+
+    // if p splits, right is its upper half and separator the lowest key under it
+    static bool insert(std::shared_ptr<node> &p, const std::string &key, const std::string &value,
+                       std::string &separator, std::shared_ptr<node> &right) {
+        node &n = own(p);
+        bool added;
+        if (n.leaf) {
+            auto it = std::lower_bound(n.keys.begin(), n.keys.end(), key);
+            size_t i = it - n.keys.begin();
+            added = it == n.keys.end() || *it != key;
+            if (added) {
+                n.keys.insert(it, key);
+                n.values.insert(n.values.begin() + i, value);
+            } else {
+                n.values[i] = value;
+            }
+        } else {
+            size_t i = child_index(n, key);
+            std::string child_separator;
+            std::shared_ptr<node> child_right;
+            added = insert(n.children[i], key, value, child_separator, child_right);
+            if (child_right) {
+                n.keys.insert(n.keys.begin() + i, std::move(child_separator));
+                n.children.insert(n.children.begin() + i + 1, child_right);
+            }
+        }
+        if (n.keys.size() > max_keys) {
+            split(n, separator, right);
+        }
+        return added;
+    }
+
+    static void split(node &n, std::string &separator, std::shared_ptr<node> &right) {
+        size_t half = n.keys.size() / 2;
+        right = std::make_shared<node>(n.leaf);
+        if (n.leaf) {
+            right->keys.assign(n.keys.begin() + half, n.keys.end());
+            right->values.assign(n.values.begin() + half, n.values.end());
+            n.values.resize(half);
+            separator = right->keys[0];
+        } else {
+            // the middle key moves up, it separates the halves
+            separator = n.keys[half];
+            right->keys.assign(n.keys.begin() + half + 1, n.keys.end());
+            right->children.assign(n.children.begin() + half + 1, n.children.end());
+            n.children.resize(half + 1);
+        }
+        n.keys.resize(half);
+    }
+
+    // key is in the tree
+    static void remove(std::shared_ptr<node> &p, const std::string &key) {
+        node &n = own(p);
+        if (n.leaf) {
+            size_t i = std::lower_bound(n.keys.begin(), n.keys.end(), key) - n.keys.begin();
+            n.keys.erase(n.keys.begin() + i);
+            n.values.erase(n.values.begin() + i);
+            return;
+        }
+        size_t i = child_index(n, key);
+        remove(n.children[i], key);
+        const node &child = *n.children[i];
+        if (child.leaf ? child.keys.empty() : child.children.empty()) {
+            n.children.erase(n.children.begin() + i);
+            if (!n.keys.empty()) {
+                n.keys.erase(n.keys.begin() + (i > 0 ? i - 1 : 0));
+            }
+        }
+    }
+
+    static bool contains(const node &n, const std::string &key) {
+        const node *p = &n;
+        while (!p->leaf) {
+            p = p->children[child_index(*p, key)].get();
+        }
+        return std::binary_search(p->keys.begin(), p->keys.end(), key);
+    }
+
+    // false once the scan is over
+    template<typename F>
+    static bool scan(const node &n, const std::string &from, const std::string &to, F &fn) {
+        if (n.leaf) {
+            for (size_t i = std::lower_bound(n.keys.begin(), n.keys.end(), from) - n.keys.begin();
+                 i < n.keys.size(); ++i) {
+                if ((!to.empty() && n.keys[i] >= to) || !fn(n.keys[i], n.values[i])) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        for (size_t i = child_index(n, from); i < n.children.size(); ++i) {
+            if (i > 0 && !to.empty() && n.keys[i - 1] >= to) {
+                return false;
+            }
+            if (!scan(*n.children[i], from, to, fn)) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+#endif // kv_btree_h
@@ -3,18 +3,24 @@
 
 #include <atomic>
 #include <mutex>
+#include <condition_variable>
 #include <chrono>
 #include <thread>
 #include <ctime>
+#include <climits>
 #include <algorithm>
 #include <thread>
 #include <unordered_set>
+#include <map>
+#include <functional>
 #include <stdarg.h>
 
 #include "rpc.h"
 #include "raft_storage.h"
 #include "raft_protocol.h"
+#include "raft_log.h"
 #include "raft_state_machine.h"
+#include "raft_host.h"
 
 using std::chrono::duration_cast;
 using std::chrono::milliseconds;
@@ -52,6 +58,11 @@ public:
             state_machine *state
     );
 
+    // a group of a multi-raft host: the group id tags its RPCs, the host's clients address the nodes,
+    // its thread pool sends the RPCs and its ticker runs the election and heartbeat timers. The commit,
+    // apply and snapshot workers remain threads of the group.
+    raft(raft_host *host, int group, raft_storage<command> *storage, state_machine *state);
+
     ~raft();
 
     // start the raft node.
@@ -67,17 +78,88 @@ public:
     // send a new command to the raft nodes.
     // This method returns true if this raft node is the leader that successfully appends the log.
     // If this node is not the leader, returns false.
+    // The entry is persisted by the storage's group commit, the call returns once it is durable locally.
     bool new_command(command cmd, int &term, int &index);
 
+    // called with true once the entry is applied, with false once it is overwritten, replaced by a snapshot
+    // whose contents are unknown to us, or the node stops. It runs on the applier thread without raft locks.
+    typedef std::function<void(bool applied)> commit_callback;
+
+    // new_command that also registers done for the entry at (term, index), it cannot be missed
+    bool new_command(command cmd, int &term, int &index, const commit_callback &done);
+
+    // send a batch of commands, they take the consecutive indexes first_index..last_index of one term.
+    // One append to the log and to the storage, one wait for durability, however many commands there are.
+    bool new_commands(const std::vector<command> &cmds, int &term, int &first_index, int &last_index);
+
     // returns whether this node is the leader, you should also set the current term;
     bool is_leader(int &term);
 
+    // ReadIndex: serve a linearizable read without a log entry.
+    // Confirms the leadership with one heartbeat round and waits until everything committed before the call
+    // is applied, then returns true and the caller reads the local state machine. Returns false if this
+    // node does not lead, cannot reach a majority or has not committed an entry of its own term yet,
+    // the caller then falls back to new_command.
+    bool read_index(int &index);
+
+    // Lease reads, opt-in and to be enabled on every node of the group: while a majority acknowledged a
+    // heartbeat within the last lease_timeout, read_index skips the heartbeat round. In exchange a follower
+    // refuses to vote for anybody for an election timeout after hearing from its leader.
+    void set_lease_read(bool enable);
+
+    // hand the leadership over to target, e.g. before restarting this node: new_command fails from now on,
+    // the target gets every entry and is told to start an election at once (TimeoutNow).
+    // Returns true once this node no longer leads, false if the target did not catch up or win in time.
+    bool transfer_leadership(int target);
+
+    // Membership, a node is an index into rpc_clients. Until a configuration entry is committed every node votes,
+    // unless set_initial_config names the voters, the same on every node and before start().
+    void set_initial_config(const std::vector<int> &voters);
+
+    // Single-server changes on the leader, one uncommitted change at a time, each returns true once committed.
+    // A learner receives the log (or the snapshot) but does not vote, promote it once it caught up, otherwise
+    // promote_learner fails. A leader that removes itself steps down after the change commits.
+    bool add_learner(int node);
+
+    bool promote_learner(int node);
+
+    bool remove_member(int node);
+
+    // Follower reads with bounded staleness, on any node: waits, without polling, until the local state machine
+    // has applied min_index, e.g. the index new_command returned for the caller's last write, then calls
+    // read on it. applied_index tells how fresh the read was, the state read is at least that new.
+    // Returns false if min_index is not applied within timeout.
+    bool read_applied(int min_index, const std::function<void(state_machine &)> &read, int &applied_index,
+                      std::chrono::milliseconds timeout);
+
+    // block until the entry at index is applied locally
+    bool wait_for_applied(int index, std::chrono::milliseconds timeout);
+
     // save a snapshot of the state machine and compact the log.
+    // Only capturing the state machine view stops the applier, the log is compacted once the file is durable.
     bool save_snapshot();
 
+    // size of the chunks a lagging follower receives the snapshot in
+    void set_snapshot_chunk_size(int bytes);
+
+    // snapshot in the background once so many applied entries or log bytes pile up, 0 turns a trigger off
+    void set_auto_snapshot(int entries, long long bytes);
+
 private:
-    std::mutex mtx;                     // A big lock to protect the whole data structure
+    // Lock order: stage_mtx -> snapshot_mtx -> apply_mtx -> mtx -> progress_mtx -> log_mtx -> waiter_mtx ->
+    // signal_mtx, each may be skipped.
+    std::mutex stage_mtx;               // One received snapshot is staged and verified at a time, without mtx
+    std::mutex snapshot_mtx;            // One snapshot is saved at a time
+    std::mutex mtx;                     // Election state: role, term, vote and the election timer, follower log writes
+    std::mutex apply_mtx;               // Serializes the state machine: batch apply vs. snapshots, taken before mtx
+    std::mutex progress_mtx;            // Leader replication progress, the commit and ping workers
+    std::mutex log_mtx;                 // The log, the snapshot and the order of appends to storage
+    std::mutex waiter_mtx;              // The commit callbacks
+    std::mutex signal_mtx;              // Pairs with apply_cv and snapshot_cv only
     ThrPool *thread_pool;
+    bool owns_pool;
+    raft_host *host;                // null for a stand-alone node
+    int group;
     raft_storage<command> *storage;              // To persist the raft log
     state_machine *state;  // The state machine that applies the raft log, e.g. a kv store
 
@@ -93,43 +175,111 @@ private:
     };
     raft_role role;
     int current_term;
+    // (current_term << 2) | role, written under mtx and log_mtx, lets the hot paths check leadership lock free
+    std::atomic<long long> term_role;
 
-    std::thread *background_election;
+    std::thread *background_election;  // stand-alone only, a host's ticker does their work
     std::thread *background_ping;
-    std::thread *background_commit;
+    std::thread *background_commit;    // per node, with or without a host
     std::thread *background_apply;
+    std::thread *background_snapshot;
+
+    // wake-ups for the background workers
+    std::condition_variable election_cv;   // stop, with mtx
+    std::condition_variable ping_cv;       // becoming leader, stop, with progress_mtx
+    std::condition_variable commit_cv;     // new entries / new leadership to replicate, stop, with progress_mtx
+    std::condition_variable apply_cv;      // commit index advanced, stop, with signal_mtx
+    std::condition_variable snapshot_cv;   // the log outgrew the snapshot thresholds, stop, with signal_mtx
+    std::condition_variable applied_cv;    // last_applied advanced, stop, with signal_mtx
+    std::condition_variable read_cv;       // a follower acknowledged a read round or caught up with a transfer,
+                                           // the leadership was lost, stop, with progress_mtx
+    bool replicate_kicked;
+    bool snapshot_kicked;
+    bool waiters_kicked;                   // some callbacks finished outside the applier, with signal_mtx
+    std::condition_variable jobs_cv;       // the last queued RPC job finished, with signal_mtx
+    std::atomic<int> pending_jobs;         // RPC jobs queued or running, stop waits for them on a shared pool
 
     // Your code here:
     int voted_for; // current term I vote for whom
-    int commit_index;
-    int last_applied;
+    std::atomic<int> commit_index;
+    std::atomic<int> last_applied;
 
-    // reinitialized when elected
+    // reinitialized when elected, guarded by progress_mtx
     std::vector<int> next_index;
     std::vector<int> match_index;
     std::vector<bool> syn_index;
+    std::vector<int> inflight;       // outstanding AppendEntries/InstallSnapshot per follower
+    std::vector<int> window_epoch;   // bumped when the window is given up, older replies no longer free a slot
+    std::vector<std::chrono::milliseconds::rep> window_time; // last progress of the window
+    std::vector<int> commit_sent;    // largest commit index handed to each follower
+    std::vector<int> snapshot_sending; // last_included_index of the snapshot being streamed to each follower
+    std::vector<int> snapshot_offset;  // bytes of it the follower has staged
+    std::vector<int> read_acked;     // latest read round each follower acknowledged in this term
+    std::vector<int> quorum_match;   // scratch for the quorum index
+    std::vector<std::chrono::steady_clock::time_point> ack_time; // send time of the latest RPC each follower acknowledged
+    int read_round;                  // bumped by every read_index, heartbeats carry the round current when sent
 
     std::unordered_set<int> voter_for_self;
+    std::unordered_set<int> pre_voters;  // mtx, would vote for us in the next term
+    bool pre_voting;                     // mtx, a pre-vote round is open
 
-    // basic data
-    std::vector<log_entry<command>> log;
+    // basic data, guarded by log_mtx
+    raft_log<command> log;
 
-    // Added: some time stamp recording
-    std::chrono::milliseconds::rep last_rpc_time;
-    std::chrono::milliseconds::rep last_ping_time;
+    // configurations by the index of their entry, the first one at last_included_index comes from the snapshot,
+    // the last one is active as soon as it is in the log. log_mtx, config_word mirrors the active one lock free.
+    std::map<int, raft_config> configs;
+    std::atomic<unsigned long long> config_word;
 
-    // snapshot part
+    // commit callbacks by index with the term of the entry, and those decided but not run yet, waiter_mtx
+    std::multimap<int, std::pair<int, commit_callback>> commit_waiters;
+    std::vector<std::pair<commit_callback, bool>> finished_waiters;
+
+    // Added: some time stamp recording
+    std::chrono::milliseconds::rep last_rpc_time;   // mtx
+    bool election_round;                // mtx, the host's ticker is timing an election round
+    raft_role election_round_role;      // mtx, the role it started in and its randomized timeout
+    std::chrono::milliseconds election_round_timeout;
+    std::chrono::steady_clock::time_point last_leader_time; // mtx, last RPC accepted from a leader
+    std::chrono::steady_clock::time_point leader_since;     // progress_mtx, when this node took over
+    std::atomic<int> transfer_target;   // the node the leadership is handed to or -1, set under log_mtx
+    int lease_off_term;                 // progress_mtx, a TimeoutNow went out in this term: no more lease reads
+    std::chrono::milliseconds::rep last_ping_time;  // progress_mtx, so is the one below
+    std::chrono::milliseconds::rep last_commit_time;
+
+    // snapshot part, guarded by log_mtx, the snapshot itself only lives in storage
     int last_included_index;
-    std::vector<char> snapshot_data;
 
 private:
     // Added: static threshold
     std::chrono::milliseconds ping_timeout;
+    std::chrono::milliseconds retry_interval; // resend after failed RPCs even without new entries
+    int max_inflight;                // replication window per follower
+    std::chrono::milliseconds window_timeout; // a window without any reply for so long is presumed lost
+    std::chrono::milliseconds commit_notify_delay; // a new commit index waits so long for entries to ride on
+    std::chrono::milliseconds read_timeout;  // read_index gives up after so long without a majority or the apply
+    std::chrono::milliseconds election_timeout; // a follower waits at least so long for its leader
+    std::chrono::milliseconds lease_timeout;    // election_timeout minus the clock drift we tolerate
+    std::atomic_bool lease_read;
+    int max_entries_per_rpc;
+    int max_bytes_per_rpc;
+    std::atomic<int> snapshot_chunk_size; // InstallSnapshot carries the snapshot in chunks of so many bytes
+    std::atomic<int> auto_snapshot_entries;     // applied entries after the snapshot that trigger the next one
+    std::atomic<long long> auto_snapshot_bytes; // log bytes that trigger the next snapshot
 
 private:
+    raft(rpcs *rpc_server, std::vector<rpcc *> rpc_clients, int idx, raft_storage<command> *storage,
+         state_machine *state, raft_host *host, int group);
+
     // RPC handlers
     int request_vote(request_vote_args arg, request_vote_reply &reply);
 
+    int pre_vote(request_vote_args arg, request_vote_reply &reply);
+
+    int timeout_now(timeout_now_args arg, timeout_now_reply &reply);
+
+    append_entries_reply heartbeat(const heartbeat_args &args);
+
     int append_entries(append_entries_args<command> arg, append_entries_reply &reply);
 
     int install_snapshot(install_snapshot_args arg, install_snapshot_reply &reply);
@@ -139,15 +289,37 @@ private:
 
     void handle_request_vote_reply(int target, const request_vote_args &arg, const request_vote_reply &reply);
 
-    void send_append_entries(int target, append_entries_args<command> arg);
+    void send_pre_vote(int target, request_vote_args arg);
+
+    void handle_pre_vote_reply(int target, const request_vote_args &arg, const request_vote_reply &reply);
+
+    void send_timeout_now(int target, timeout_now_args arg);
+
+    void send_append_entries(int target, append_entries_args<command> arg, int epoch);
+
+    void send_heartbeat(int target, append_entries_args<command> arg, int round);
+
+    void handle_heartbeat_reply(int target, const append_entries_args<command> &arg,
+                                const append_entries_reply &reply, int round,
+                                std::chrono::steady_clock::time_point sent);
+
+    void handle_read_ack(int target, int term, int round);
 
     void
-    handle_append_entries_reply(int target, const append_entries_args<command> &arg, const append_entries_reply &reply);
+    handle_append_entries_reply(int target, const append_entries_args<command> &arg, const append_entries_reply &reply,
+                                int epoch, std::chrono::steady_clock::time_point sent);
 
-    void send_install_snapshot(int target, install_snapshot_args arg);
+    int conflict_next_index(const append_entries_args<command> &arg, const append_entries_reply &reply);
+
+    void handle_rpc_failure(int target, int term, int retry_from, int epoch);
+
+    void release_slot(int target, int epoch);
+
+    void send_install_snapshot(int target, install_snapshot_args arg, int epoch);
 
     void
-    handle_install_snapshot_reply(int target, const install_snapshot_args &arg, const install_snapshot_reply &reply);
+    handle_install_snapshot_reply(int target, const install_snapshot_args &arg, const install_snapshot_reply &reply,
+                                  int epoch);
 
     int logic2fact(const int &idx);
 
@@ -167,22 +339,119 @@ private:
 
     void run_background_apply();
 
+    void run_background_snapshot();
+
+    // the host's ticker instead of the election and ping workers
+    void tick(bool beat);
+
+    void tick_election();
+
+    void tick_ping(bool beat);
+
+    std::chrono::milliseconds election_round_length(raft_role r);
+
+    bool commit_notice_pending();
+
+    unsigned int opcode(raft_rpc_opcodes op) { return raft_opcode(op, group); }
+
+    template<typename... Params, typename... Args>
+    void post(void (raft::*job)(Params...), Args... args);
+
+    void run_job(std::function<void()> job);
+
+    void finish_job();
+
     // Your code here:
     request_vote_args get_voter_args();
 
     void set_now(std::chrono::milliseconds::rep &timer);
 
-    int add_to_log(command &command_);
+    int add_to_log(command &command_, int term);
+
+    int add_to_log(const std::vector<command> &commands, int term);
+
+    void wait_appended(int term, int index);
+
+    int last_log_index();
+
+    const log_entry<command> &get_log_entry(int index);
+
+    void start_new_election(bool transfer = false);
+
+    void start_pre_vote();
+
+    void resign(int term);
+
+    void try_commit();
+
+    void replicate(int target);
+
+    void become_leader();
+
+    void kick_replication();
+
+    void broadcast_heartbeat(long long word);
+
+    std::chrono::steady_clock::time_point quorum_ack_time();
+
+    bool lease_valid();
+
+    bool quorum_alive();
+
+    raft_config active_config();
+
+    void publish_config();
+
+    raft_config config_at(int index);
+
+    void compact_configs(int index);
+
+    bool read_snapshot_config(snapshot_reader &snapshot, raft_config &conf);
+
+    bool propose_config(const raft_config &from, const raft_config &to);
+
+    bool removed_self();
+
+    void notify_applied();
 
-    log_entry<command> get_log_entry(int index);
+    void set_term_role(int term, raft_role r);
 
-    void start_new_election();
+    bool leader_of(int term);
+
+    void step_down(int term);
+
+    void advance_commit(int index);
+
+    void notify_apply();
+
+    bool snapshot_due();
+
+    void finish_waiters(int end, const std::function<bool(int index, int term)> &applied);
+
+    void drop_waiters(int index);
+
+    void kick_waiters();
+
+    void run_finished_waiters();
 
 };
 
+template<typename state_machine, typename command>
+raft<state_machine, command>::raft(raft_host *host, int group, raft_storage<command> *storage, state_machine *state) :
+        raft(host->server(), host->clients(), host->id(), storage, state, host, group) {}
+
 template<typename state_machine, typename command>
 raft<state_machine, command>::raft(rpcs *server, std::vector<rpcc *> clients, int idx, raft_storage<command> *storage,
                                    state_machine *state) :
+        raft(server, clients, idx, storage, state, nullptr, 0) {}
+
+template<typename state_machine, typename command>
+raft<state_machine, command>::raft(rpcs *server, std::vector<rpcc *> clients, int idx, raft_storage<command> *storage,
+                                   state_machine *state, raft_host *host, int group) :
+        thread_pool(host ? host->pool() : new ThrPool(32)),
+        owns_pool(host == nullptr),
+        host(host),
+        group(group),
         storage(storage),
         state(state),
         rpc_server(server),
@@ -194,39 +463,80 @@ raft<state_machine, command>::raft(rpcs *server, std::vector<rpcc *> clients, in
         background_election(nullptr),
         background_ping(nullptr),
         background_commit(nullptr),
-        background_apply(nullptr) {
-    thread_pool = new ThrPool(32);
-
+        background_apply(nullptr),
+        background_snapshot(nullptr),
+        replicate_kicked(false),
+        snapshot_kicked(false),
+        waiters_kicked(false),
+        pending_jobs(0),
+        election_round(false) {
     // Register the rpcs.
-    rpc_server->reg(raft_rpc_opcodes::op_request_vote, this, &raft::request_vote);
-    rpc_server->reg(raft_rpc_opcodes::op_append_entries, this, &raft::append_entries);
-    rpc_server->reg(raft_rpc_opcodes::op_install_snapshot, this, &raft::install_snapshot);
+    rpc_server->reg(opcode(raft_rpc_opcodes::op_request_vote), this, &raft::request_vote);
+    rpc_server->reg(opcode(raft_rpc_opcodes::op_pre_vote), this, &raft::pre_vote);
+    rpc_server->reg(opcode(raft_rpc_opcodes::op_timeout_now), this, &raft::timeout_now);
+    rpc_server->reg(opcode(raft_rpc_opcodes::op_append_entries), this, &raft::append_entries);
+    rpc_server->reg(opcode(raft_rpc_opcodes::op_install_snapshot), this, &raft::install_snapshot);
 
     srand((int) (time(NULL)));
     // Your code here:
     // Do the initialization
     voted_for = -1;
+    pre_voting = false;
+    transfer_target = -1;
     last_applied = 1; // Different from paper: NEXT should be applied
     commit_index = 0; // Same to paper, commit to where
     last_included_index = 0; // last snapshot idx
     ping_timeout = (std::chrono::milliseconds(150));
+    retry_interval = (std::chrono::milliseconds(50));
+    max_inflight = 4;
+    window_timeout = (std::chrono::milliseconds(300));
+    commit_notify_delay = (std::chrono::milliseconds(5));
+    read_timeout = (std::chrono::milliseconds(500));
+    election_timeout = (std::chrono::milliseconds(300));
+    lease_timeout = election_timeout - std::chrono::milliseconds(50);
+    lease_read = false;
+    lease_off_term = -1;
+    read_round = 0;
+    max_entries_per_rpc = 64;
+    max_bytes_per_rpc = 64 * 1024;
+    snapshot_chunk_size = 64 * 1024;
+    auto_snapshot_entries = 0;
+    auto_snapshot_bytes = 0;
+    set_now(last_rpc_time);
+    set_now(last_ping_time);
+    set_now(last_commit_time);
+    term_role.store(0);
 
     // A huge change, from now on, start from 1 to n!!
-    log_entry<command> init_cmd;
-    init_cmd.term = -1;
-    log.clear();
-    log.push_back(init_cmd);
-
-    storage->recovery(current_term, voted_for, log);
-    storage->recover_snapshot(last_included_index, log, snapshot_data);
+    std::vector<log_entry<command>> recovered(1);
+    snapshot_reader snapshot;
+    recovered[0].term = -1;
+
+    storage->recover_snapshot(last_included_index, recovered, snapshot);
+    storage->recovery(current_term, voted_for, recovered);
+    log.assign(recovered);
+    assert(num_nodes() <= 32);
+    configs[0] = raft_config(num_nodes() == 32 ? ~0u : (1u << num_nodes()) - 1, 0);
     if (last_included_index != 0) {
         // has sth to restore
         commit_index = last_included_index;
         last_applied = last_included_index + 1;
-        while (!storage->update(current_term, voted_for, log)) {}
-        ((raft_state_machine *) state)->apply_snapshot(snapshot_data);
+        configs.clear();
+        // streamed from the file, only the state itself has to fit in memory
+        if (!read_snapshot_config(snapshot, configs[last_included_index]) ||
+            !((raft_state_machine *) state)->load_snapshot(snapshot)) {
+            RAFT_LOG("Error: cannot load the snapshot ending at %d", last_included_index);
+            assert(0);
+        }
 //        RAFT_LOG("Recover from snap shot, term: %d, last index: %d", log[0].term, last_included_index);
     }
+    for (int i = 1; i < (int) log.size(); ++i) {
+        if (!log[i].conf.empty()) {
+            configs[logic2fact(i)] = log[i].conf;
+        }
+    }
+    publish_config();
+    term_role.store(((long long) current_term << 2) | follower);
 
 }
 
@@ -244,7 +554,12 @@ raft<state_machine, command>::~raft() {
     if (background_apply) {
         delete background_apply;
     }
-    delete thread_pool;
+    if (background_snapshot) {
+        delete background_snapshot;
+    }
+    if (owns_pool) {
+        delete thread_pool;
+    }
 }
 
 /********************************************************** || ********
@@ -256,11 +571,43 @@ raft<state_machine, command>::~raft() {
 template<typename state_machine, typename command>
 void raft<state_machine, command>::stop() {
     stopped.store(true);
-    background_ping->join();
-    background_election->join();
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        election_cv.notify_all();
+    }
+    {
+        std::lock_guard<std::mutex> lock(progress_mtx);
+        ping_cv.notify_all();
+        commit_cv.notify_all();
+        read_cv.notify_all();
+    }
+    {
+        std::lock_guard<std::mutex> lock(signal_mtx);
+        apply_cv.notify_all();
+        snapshot_cv.notify_all();
+        applied_cv.notify_all();
+    }
+    if (host) {
+        // the ticker and the coalesced heartbeats no longer reach us
+        host->remove_group(group);
+    } else {
+        background_ping->join();
+        background_election->join();
+    }
     background_commit->join();
     background_apply->join();
-    thread_pool->destroy();
+    background_snapshot->join();
+    if (owns_pool) {
+        thread_pool->destroy();
+    } else {
+        // the pool is shared, wait for our own jobs only
+        std::unique_lock<std::mutex> lock(signal_mtx);
+        jobs_cv.wait(lock, [this]() { return pending_jobs == 0; });
+    }
+    storage->flush();
+
+    finish_waiters(INT_MAX, [](int, int) { return false; });
+    run_finished_waiters();
 }
 
 template<typename state_machine, typename command>
@@ -270,189 +617,706 @@ bool raft<state_machine, command>::is_stopped() {
 
 template<typename state_machine, typename command>
 bool raft<state_machine, command>::is_leader(int &term) {
-    term = current_term;
-    return role == leader;
+    long long word = term_role.load();
+    term = static_cast<int>(word >> 2);
+    return (word & 3) == leader;
 }
 
 template<typename state_machine, typename command>
-void raft<state_machine, command>::start() {
-    // Your code here:
+bool raft<state_machine, command>::read_index(int &index) {
+    long long word = term_role.load();
+    if ((word & 3) != leader) {
+        return false;
+    }
+    int term = static_cast<int>(word >> 2);
+    std::unique_lock<std::mutex> lock(progress_mtx);
+    {
+        std::lock_guard<std::mutex> log_lock(log_mtx);
+        if (term_role.load() != word) {
+            return false;
+        }
+        index = commit_index;
+        // until an entry of its own term commits, a new leader may not know the latest commit index
+        int commit_term = index > last_included_index ? get_log_entry(index).term : log[0].term;
+        if (commit_term != term) {
+            return false;
+        }
+    }
 
-//    RAFT_LOG("start a new node, my id is %d", my_id);
-    this->background_election = new std::thread(&raft::run_background_election, this);
-    this->background_ping = new std::thread(&raft::run_background_ping, this);
-    this->background_commit = new std::thread(&raft::run_background_commit, this);
-    this->background_apply = new std::thread(&raft::run_background_apply, this);
+    if (lease_read && transfer_target < 0 && lease_off_term != term && lease_valid()) {
+        // nobody else can be elected before the lease runs out
+        lock.unlock();
+        return wait_for_applied(index, read_timeout);
+    }
+
+    // a majority answering a heartbeat sent after the index was taken proves nobody else leads yet
+    int round = ++read_round;
+    broadcast_heartbeat(word);
+    int cluster_size = rpc_clients.size();
+    bool confirmed = read_cv.wait_for(lock, read_timeout, [&]() {
+        if (!leader_of(term) || is_stopped()) {
+            return true;
+        }
+        raft_config conf = active_config();
+        int acks = 0;
+        for (int i = 0; i < cluster_size; ++i) {
+            acks += conf.is_voter(i) && (i == my_id || read_acked[i] >= round);
+        }
+        return acks * 2 > conf.num_voters();
+    });
+    if (!confirmed || !leader_of(term) || is_stopped()) {
+        return false;
+    }
+    lock.unlock();
+
+    return wait_for_applied(index, read_timeout);
 }
 
 /**
- *
- * @tparam state_machine
- * @tparam command
- * @param cmd Leader receive command and
- * @param term return true iff it's leader
- * @param index if true, fill in other 2 params
- * @return
+ * send time of the latest RPC a majority of the voters, counting us, acknowledged, must hold progress_mtx
  */
 template<typename state_machine, typename command>
-bool raft<state_machine, command>::new_command(command cmd, int &term, int &index) {
-    // Your code here:
-    mtx.lock();
-    if (role != leader) {
-        mtx.unlock();
-        return false;
+std::chrono::steady_clock::time_point raft<state_machine, command>::quorum_ack_time() {
+    raft_config conf = active_config();
+    std::vector<std::chrono::steady_clock::time_point> times;
+    for (int i = 0; i < static_cast<int>(ack_time.size()); ++i) {
+        if (conf.is_voter(i)) {
+            times.push_back(i == my_id ? std::chrono::steady_clock::now() : ack_time[i]);
+        }
+    }
+    if (times.empty()) {
+        return std::chrono::steady_clock::time_point();
     }
+    int quorum = static_cast<int>(times.size()) / 2;
+    std::nth_element(times.begin(), times.begin() + quorum, times.end(),
+                     std::greater<std::chrono::steady_clock::time_point>());
+    return times[quorum];
+}
 
-    term = current_term;
-    index = add_to_log(cmd);
+/**
+ * a majority acknowledged RPCs sent within the last lease_timeout, must hold progress_mtx
+ */
+template<typename state_machine, typename command>
+bool raft<state_machine, command>::lease_valid() {
+    return std::chrono::steady_clock::now() < quorum_ack_time() + lease_timeout;
+}
 
-    mtx.unlock();
-    return true;
+/**
+ * check-quorum: a majority answered within an election timeout, or we lead for less, must hold progress_mtx
+ */
+template<typename state_machine, typename command>
+bool raft<state_machine, command>::quorum_alive() {
+    return std::chrono::steady_clock::now() < std::max(quorum_ack_time(), leader_since) + election_timeout;
 }
 
+/**
+ * the latest configuration in the log, lock free
+ */
 template<typename state_machine, typename command>
-bool raft<state_machine, command>::save_snapshot() {
-    // Your code here:
-    mtx.lock();
+raft_config raft<state_machine, command>::active_config() {
+    unsigned long long word = config_word.load();
+    return raft_config(static_cast<unsigned>(word >> 32), static_cast<unsigned>(word));
+}
 
-    int snapshot_end_log = std::min(last_applied, commit_index);
-    if (snapshot_end_log <= last_included_index) {
-        // maybe recovered yet and wait for commit id and applied id recover
-//        RAFT_LOG("Snap shot, ready install to %d, already install to %d",
-//                 snapshot_end_log, last_included_index);
-        goto success_return;
-    }
+/**
+ * must hold log_mtx, after configs changed
+ */
+template<typename state_machine, typename command>
+void raft<state_machine, command>::publish_config() {
+    const raft_config &conf = configs.rbegin()->second;
+    config_word.store(((unsigned long long) conf.voters << 32) | conf.learners);
+}
 
-    // install now!
-    log[0].term = get_log_entry(snapshot_end_log).term;
-    log.erase(log.begin() + 1, log.begin() + 1 + fact2logic(snapshot_end_log));
-    snapshot_data = ((raft_state_machine *) state)->snapshot();
+/**
+ * the configuration in effect at index, must hold log_mtx
+ */
+template<typename state_machine, typename command>
+raft_config raft<state_machine, command>::config_at(int index) {
+    auto it = configs.upper_bound(index);
+    assert(it != configs.begin());
+    return (--it)->second;
+}
 
-    last_included_index = snapshot_end_log;
-    while (!storage->install_snapshot(last_included_index, log, snapshot_data)) {}
-    while (!storage->update(current_term, voted_for, log)) {}
-//    RAFT_LOG("Snap shot, install to %d, already install to %d, term: %d",
-//             snapshot_end_log, last_included_index, log[0].term);
+/**
+ * the log up to index went into a snapshot, keep only the configuration in effect there, must hold log_mtx
+ */
+template<typename state_machine, typename command>
+void raft<state_machine, command>::compact_configs(int index) {
+    raft_config conf = config_at(index);
+    configs.erase(configs.begin(), configs.upper_bound(index));
+    configs[index] = conf;
+}
 
-    success_return:
-    mtx.unlock();
+/**
+ * save_snapshot writes the configuration ahead of the state machine's data
+ */
+template<typename state_machine, typename command>
+bool raft<state_machine, command>::read_snapshot_config(snapshot_reader &snapshot, raft_config &conf) {
+    int voters, learners;
+    if (!snapshot.read_int(voters) || !snapshot.read_int(learners)) {
+        return false;
+    }
+    conf = raft_config((unsigned) voters, (unsigned) learners);
     return true;
 }
 
+/**
+ * append the configuration entry `to` if the active configuration is still `from` and committed,
+ * returns true once the entry is applied here
+ */
+template<typename state_machine, typename command>
+bool raft<state_machine, command>::propose_config(const raft_config &from, const raft_config &to) {
+    int term, index;
+    {
+        std::lock_guard<std::mutex> lock(progress_mtx);
+        std::lock_guard<std::mutex> log_lock(log_mtx);
+        long long word = term_role.load();
+        if ((word & 3) != leader || transfer_target >= 0 || configs.rbegin()->first > commit_index ||
+            !(configs.rbegin()->second == from)) {
+            return false;
+        }
+        term = static_cast<int>(word >> 2);
+        index = last_log_index() + 1;
+        unsigned joined = (to.voters | to.learners) & ~(from.voters | from.learners);
+        for (int i = 0; i < num_nodes(); ++i) {
+            if ((joined >> i) & 1) {
+                // whatever it had when it was a member before, probe for the match point again
+                next_index[i] = index;
+                match_index[i] = 0;
+                syn_index[i] = false;
+                inflight[i] = 0;
+                ++window_epoch[i];
+                commit_sent[i] = 0;
+                ack_time[i] = std::chrono::steady_clock::time_point();
+            }
+        }
 
-/******************************************************************
+        std::shared_ptr<log_entry<command>> ent = std::make_shared<log_entry<command>>();
+        ent->term = term;
+        ent->conf = to;
+        log.push_back(ent);
+        while (!storage->append(index, *ent)) {}
+        // in effect from now on, not only once committed
+        configs[index] = to;
+        publish_config();
+    }
 
-                         RPC Related
+    wait_appended(term, index);
+    if (!wait_for_applied(index, read_timeout)) {
+        return false;
+    }
+    std::lock_guard<std::mutex> log_lock(log_mtx);
+    return index <= last_included_index || get_log_entry(index).term == term;
+}
 
-*******************************************************************/
+/**
+ * a committed configuration no longer counts us as a voter, must hold progress_mtx
+ */
 template<typename state_machine, typename command>
-int raft<state_machine, command>::request_vote(request_vote_args args, request_vote_reply &reply) {
-    // Your code here:
-    mtx.lock();
+bool raft<state_machine, command>::removed_self() {
+    std::lock_guard<std::mutex> log_lock(log_mtx);
+    return configs.rbegin()->first <= commit_index && !configs.rbegin()->second.is_voter(my_id);
+}
 
-    reply.follower_term = current_term;
+template<typename state_machine, typename command>
+void raft<state_machine, command>::set_lease_read(bool enable) {
+    lease_read = enable;
+}
 
-    if (current_term > args.current_term) {
-        // candidates term id not the newest
-        goto reject;
-    } else if (current_term == args.current_term) {
-        if (voted_for == -1 || voted_for == args.candidate_id) { // never vote for a candidate
-            goto check_index;
-        } else {
-            goto reject; // only vote for first candidate
+template<typename state_machine, typename command>
+bool raft<state_machine, command>::transfer_leadership(int target) {
+    if (target < 0 || target >= static_cast<int>(rpc_clients.size()) || target == my_id ||
+        !active_config().is_voter(target)) {
+        return false;
+    }
+    int term, last_index;
+    {
+        // with transfer_target set under log_mtx, the log ends here until the transfer is over
+        std::lock_guard<std::mutex> log_lock(log_mtx);
+        long long word = term_role.load();
+        int idle = -1;
+        if ((word & 3) != leader || !transfer_target.compare_exchange_strong(idle, target)) {
+            return false;
         }
-    } else {
-        // seen a larger term, convert to follower
-        // and update term id
-        // persist first
-        role = follower;
-        current_term = args.current_term;
-        voted_for = -1;
-        while (!storage->update(current_term, voted_for, log)) {}
-//        RAFT_LOG("Term update to %d", current_term);
-        goto check_index;
+        term = static_cast<int>(word >> 2);
+        last_index = last_log_index();
     }
 
-    check_index:
-    if (logic2fact(log.size()) == 1 || args.last_log_term > log.back().term ||
-        (args.last_log_term == log.back().term &&
-         args.last_log_index >= logic2fact(static_cast<int>(log.size() - 1)))) {
-        reply.vote_granted = true;
-        voted_for = args.candidate_id;
-        while (!storage->update(current_term, voted_for, log)) {}
-        set_now(last_rpc_time);
-        mtx.unlock();
-        return 0;
-    } else {
-        goto reject;
+    std::unique_lock<std::mutex> lock(progress_mtx);
+    kick_replication();
+    bool caught_up = read_cv.wait_for(lock, election_timeout, [&]() {
+        return !leader_of(term) || is_stopped() || match_index[target] >= last_index;
+    });
+    bool sent = caught_up && leader_of(term) && !is_stopped();
+    if (sent) {
+        // voters skip the lease check for the target's RequestVote, and a late TimeoutNow may still elect it:
+        // the lease proves nothing for the rest of this term
+        lease_off_term = term;
+        timeout_now_args args;
+        args.leader_term = term;
+        args.leader_id = my_id;
+        post(&raft::send_timeout_now, target, args);
+        // the target's RequestVote carries the next term, one round trip and we are deposed
+        read_cv.wait_for(lock, election_timeout, [&]() { return !leader_of(term) || is_stopped(); });
+        // not yet, keep new commands off until the lease we held when sending it ran out
+        read_cv.wait_for(lock, lease_timeout, [&]() { return !leader_of(term) || is_stopped(); });
     }
+    bool transferred = !leader_of(term) && !is_stopped();
+    lock.unlock();
 
-    reject:
-    reply.vote_granted = false;
-    set_now(last_rpc_time);
-    mtx.unlock();
-    return 0;
+    transfer_target = -1;
+    return transferred;
 }
 
+template<typename state_machine, typename command>
+void raft<state_machine, command>::set_initial_config(const std::vector<int> &voters) {
+    unsigned mask = 0;
+    for (int node : voters) {
+        assert(node >= 0 && node < num_nodes());
+        mask |= 1u << node;
+    }
+    std::lock_guard<std::mutex> log_lock(log_mtx);
+    if (last_included_index == 0 && mask != 0) {
+        // a snapshot brings its own configuration, so do the entries after it
+        configs[0] = raft_config(mask, 0);
+        publish_config();
+    }
+}
 
 template<typename state_machine, typename command>
-void raft<state_machine, command>::handle_request_vote_reply(int target, const request_vote_args &arg,
-                                                             const request_vote_reply &reply) {
-    // Your code here:
-    mtx.lock();
-    if (reply.follower_term > current_term) {
-        current_term = reply.follower_term;
-        voted_for = -1;
-        while (!storage->update(current_term, voted_for, log)) {}
-//        RAFT_LOG("Term update to %d", current_term);
-        role = follower;
+bool raft<state_machine, command>::add_learner(int node) {
+    raft_config from = active_config();
+    if (node < 0 || node >= num_nodes() || from.is_member(node)) {
+        return false;
     }
-    if (role == candidate && reply.vote_granted) {
-        voter_for_self.insert(target);
-        size_t cluster_size = rpc_clients.size();
-        if (voter_for_self.size() * 2 > cluster_size) {
-            // I'm leader!!!
-//            RAFT_LOG("Successful become leader: %d", static_cast<int>(voter_for_self.size()));
-            role = leader;
-//            auto current_time = duration_cast<std::chrono::milliseconds>(
-//                    system_clock::now().time_since_epoch()).count();
-//            last_ping_time = (current_time - ping_timeout.count());
-            set_now(last_ping_time);
-            int index_size = logic2fact(log.size());
-            next_index.resize(cluster_size, index_size);
-            match_index.resize(cluster_size, 0);
-            syn_index.resize(cluster_size, false);
+    raft_config to = from;
+    to.learners |= 1u << node;
+    return propose_config(from, to);
+}
+
+template<typename state_machine, typename command>
+bool raft<state_machine, command>::promote_learner(int node) {
+    raft_config from = active_config();
+    if (node < 0 || node >= num_nodes() || !from.is_learner(node)) {
+        return false;
+    }
+    {
+        // a voter that lags far behind could stall the commits, it has to have everything committed so far
+        std::lock_guard<std::mutex> lock(progress_mtx);
+        if ((term_role.load() & 3) != leader || match_index[node] < commit_index) {
+            return false;
         }
     }
-    set_now(last_rpc_time);
-    mtx.unlock();
-    return;
+    raft_config to = from;
+    to.learners &= ~(1u << node);
+    to.voters |= 1u << node;
+    return propose_config(from, to);
 }
 
+template<typename state_machine, typename command>
+bool raft<state_machine, command>::remove_member(int node) {
+    raft_config from = active_config();
+    if (node < 0 || node >= num_nodes() || !from.is_member(node)) {
+        return false;
+    }
+    raft_config to = from;
+    to.voters &= ~(1u << node);
+    to.learners &= ~(1u << node);
+    if (to.empty() || !propose_config(from, to)) {
+        return false;
+    }
+    int term;
+    if (node == my_id && is_leader(term)) {
+        // the others elect a leader among them
+        resign(term);
+    }
+    return true;
+}
 
-/**
- * follower or leader itself or candidate
- * receive REAL Request or heart beat, handler
- * @tparam state_machine
- * @tparam command
- * @param arg
- * @param reply
- * @return
- */
+template<typename state_machine, typename command>
+bool raft<state_machine, command>::read_applied(int min_index, const std::function<void(state_machine &)> &read,
+                                                int &applied_index, std::chrono::milliseconds timeout) {
+    if (!wait_for_applied(min_index, timeout)) {
+        return false;
+    }
+    // last_applied only grows, the state machine holds at least what it says when read runs
+    applied_index = last_applied - 1;
+    read(*state);
+    return true;
+}
+
+template<typename state_machine, typename command>
+void raft<state_machine, command>::start() {
+    // Your code here:
+
+//    RAFT_LOG("start a new node, my id is %d", my_id);
+    // a host shares only the timers, the commit, apply and snapshot workers are this group's own
+    if (host) {
+        host->add_group(group, [this](bool beat) { tick(beat); },
+                        [this](const heartbeat_args &args) { return heartbeat(args); });
+    } else {
+        this->background_election = new std::thread(&raft::run_background_election, this);
+        this->background_ping = new std::thread(&raft::run_background_ping, this);
+    }
+    this->background_commit = new std::thread(&raft::run_background_commit, this);
+    this->background_apply = new std::thread(&raft::run_background_apply, this);
+    this->background_snapshot = new std::thread(&raft::run_background_snapshot, this);
+}
+
+/**
+ *
+ * @tparam state_machine
+ * @tparam command
+ * @param cmd Leader receive command and
+ * @param term return true iff it's leader
+ * @param index if true, fill in other 2 params
+ * @return
+ */
+template<typename state_machine, typename command>
+bool raft<state_machine, command>::new_command(command cmd, int &term, int &index) {
+    // Your code here:
+    // appending only needs the log, elections and replication keep running meanwhile
+    log_mtx.lock();
+    long long word = term_role.load();
+    if ((word & 3) != leader || transfer_target >= 0) {
+        log_mtx.unlock();
+        return false;
+    }
+
+    term = static_cast<int>(word >> 2);
+    index = add_to_log(cmd, term);
+    log_mtx.unlock();
+
+    wait_appended(term, index);
+    return true;
+}
+
+template<typename state_machine, typename command>
+bool raft<state_machine, command>::new_command(command cmd, int &term, int &index, const commit_callback &done) {
+    log_mtx.lock();
+    long long word = term_role.load();
+    if ((word & 3) != leader || transfer_target >= 0) {
+        log_mtx.unlock();
+        return false;
+    }
+
+    term = static_cast<int>(word >> 2);
+    index = add_to_log(cmd, term);
+    {
+        // registered before the entry can be replicated, so before it can be applied or overwritten
+        std::lock_guard<std::mutex> lock(waiter_mtx);
+        commit_waiters.insert(std::make_pair(index, std::make_pair(term, done)));
+    }
+    log_mtx.unlock();
+
+    wait_appended(term, index);
+    return true;
+}
+
+template<typename state_machine, typename command>
+bool raft<state_machine, command>::new_commands(const std::vector<command> &cmds, int &term, int &first_index,
+                                                int &last_index) {
+    if (cmds.empty()) {
+        return false;
+    }
+    log_mtx.lock();
+    long long word = term_role.load();
+    if ((word & 3) != leader || transfer_target >= 0) {
+        log_mtx.unlock();
+        return false;
+    }
+
+    term = static_cast<int>(word >> 2);
+    last_index = add_to_log(cmds, term);
+    first_index = last_index - static_cast<int>(cmds.size()) + 1;
+    log_mtx.unlock();
+
+    wait_appended(term, last_index);
+    return true;
+}
+
+/**
+ * Replicate the entries a leader of `term` appended up to index, and count itself once they are durable.
+ */
+template<typename state_machine, typename command>
+void raft<state_machine, command>::wait_appended(int term, int index) {
+    progress_mtx.lock();
+    kick_replication();
+    progress_mtx.unlock();
+
+    // many callers share one write + fdatasync, the leader only counts itself once its entry is on disk
+    storage->wait_durable(index);
+
+    std::unique_lock<std::mutex> lock(progress_mtx);
+    if (leader_of(term)) {
+        int last_index;
+        {
+            std::lock_guard<std::mutex> log_lock(log_mtx);
+            last_index = last_log_index();
+        }
+        int durable = std::min(storage->durable_index(), last_index);
+        if (durable > match_index[my_id]) {
+            match_index[my_id] = durable;
+            try_commit();
+        }
+    }
+}
+
+template<typename state_machine, typename command>
+void raft<state_machine, command>::set_snapshot_chunk_size(int bytes) {
+    snapshot_chunk_size = std::max(1, bytes);
+}
+
+template<typename state_machine, typename command>
+void raft<state_machine, command>::set_auto_snapshot(int entries, long long bytes) {
+    auto_snapshot_entries = std::max(0, entries);
+    auto_snapshot_bytes = std::max(0LL, bytes);
+}
+
+template<typename state_machine, typename command>
+bool raft<state_machine, command>::save_snapshot() {
+    // Your code here:
+    std::unique_lock<std::mutex> snapshot_lock(snapshot_mtx);
+    std::function<bool(snapshot_writer &)> view;
+    int snapshot_end_log, snapshot_end_term;
+    raft_config snapshot_conf;
+    {
+        // the state machine holds exactly the applied logs while we hold apply_mtx, freeze that version
+        std::lock_guard<std::mutex> apply_lock(apply_mtx);
+        snapshot_end_log = last_applied - 1;
+        {
+            std::lock_guard<std::mutex> log_lock(log_mtx);
+            if (snapshot_end_log <= last_included_index) {
+                // maybe recovered yet and wait for commit id and applied id recover
+                return true;
+            }
+            snapshot_end_term = get_log_entry(snapshot_end_log).term;
+            snapshot_conf = config_at(snapshot_end_log);
+        }
+        std::function<bool(snapshot_writer &)> state_view = ((raft_state_machine *) state)->snapshot_view();
+        // the configuration goes first, the entry that set it may be compacted away
+        view = [snapshot_conf, state_view](snapshot_writer &writer) {
+            return writer.write_int((int) snapshot_conf.voters) && writer.write_int((int) snapshot_conf.learners) &&
+                   state_view(writer);
+        };
+    }
+
+    // serialize and write with no raft lock held, the applier and the RPCs go on
+    if (!storage->install_snapshot(snapshot_end_log, snapshot_end_term, view)) {
+        return false;
+    }
+
+    // the file is durable, the entries it covers can go now
+    std::lock_guard<std::mutex> log_lock(log_mtx);
+    if (snapshot_end_log > last_included_index && snapshot_end_log < logic2fact(log.size())) {
+        log.compact(fact2logic(snapshot_end_log), snapshot_end_term);
+        compact_configs(snapshot_end_log);
+        last_included_index = snapshot_end_log;
+    }
+//    RAFT_LOG("Snap shot, install to %d, term: %d", snapshot_end_log, snapshot_end_term);
+    return true;
+}
+
+
+/******************************************************************
+
+                         RPC Related
+
+*******************************************************************/
+template<typename state_machine, typename command>
+int raft<state_machine, command>::request_vote(request_vote_args args, request_vote_reply &reply) {
+    // Your code here:
+    bool up_to_date;
+    mtx.lock();
+
+    reply.follower_term = current_term;
+    if (lease_read && !args.transfer && role != leader &&
+        std::chrono::steady_clock::now() < last_leader_time + election_timeout) {
+        // the leader we just heard from may be serving lease reads, neither vote nor take the new term
+        reply.vote_granted = false;
+        mtx.unlock();
+        return 0;
+    }
+
+    if (current_term > args.current_term) {
+        // candidates term id not the newest
+        goto reject;
+    } else if (current_term == args.current_term) {
+        if (voted_for == -1 || voted_for == args.candidate_id) { // never vote for a candidate
+            goto check_index;
+        } else {
+            goto reject; // only vote for first candidate
+        }
+    } else {
+        // seen a larger term, convert to follower
+        // and update term id
+        // persist first
+        set_term_role(args.current_term, follower);
+        voted_for = -1;
+        while (!storage->persist_meta(current_term, voted_for)) {}
+//        RAFT_LOG("Term update to %d", current_term);
+        goto check_index;
+    }
+
+    check_index:
+    // no longer leader here, so the log cannot grow under us
+    log_mtx.lock();
+    up_to_date = logic2fact(log.size()) == 1 || args.last_log_term > log.back().term ||
+                 (args.last_log_term == log.back().term && args.last_log_index >= last_log_index());
+    log_mtx.unlock();
+    if (up_to_date) {
+        reply.vote_granted = true;
+        voted_for = args.candidate_id;
+        while (!storage->persist_meta(current_term, voted_for)) {}
+        set_now(last_rpc_time);
+        mtx.unlock();
+        return 0;
+    } else {
+        goto reject;
+    }
+
+    reject:
+    reply.vote_granted = false;
+    set_now(last_rpc_time);
+    mtx.unlock();
+    return 0;
+}
+
+
+template<typename state_machine, typename command>
+void raft<state_machine, command>::handle_request_vote_reply(int target, const request_vote_args &arg,
+                                                             const request_vote_reply &reply) {
+    // Your code here:
+    mtx.lock();
+    if (reply.follower_term > current_term) {
+        set_term_role(reply.follower_term, follower);
+        voted_for = -1;
+        while (!storage->persist_meta(current_term, voted_for)) {}
+//        RAFT_LOG("Term update to %d", current_term);
+    }
+    if (role == candidate && arg.current_term == current_term && reply.vote_granted) {
+        voter_for_self.insert(target);
+        raft_config conf = active_config();
+        int votes = 0;
+        for (int voter : voter_for_self) {
+            votes += conf.is_voter(voter);
+        }
+        if (votes * 2 > conf.num_voters()) {
+            // I'm leader!!!
+//            RAFT_LOG("Successful become leader: %d", static_cast<int>(voter_for_self.size()));
+            become_leader();
+        }
+    }
+    set_now(last_rpc_time);
+    mtx.unlock();
+    return;
+}
+
+/**
+ * PreVote: would we vote for the candidate in args.current_term? Changes nothing, neither the term nor the timer,
+ * so a node that cannot win never disturbs the others.
+ */
+template<typename state_machine, typename command>
+int raft<state_machine, command>::pre_vote(request_vote_args args, request_vote_reply &reply) {
+    mtx.lock();
+    reply.follower_term = current_term;
+    reply.vote_granted = false;
+    // nobody gets to replace a leader we still hear from
+    if (args.current_term > current_term && role != leader &&
+        std::chrono::steady_clock::now() >= last_leader_time + election_timeout) {
+        std::lock_guard<std::mutex> log_lock(log_mtx);
+        reply.vote_granted = logic2fact(log.size()) == 1 || args.last_log_term > log.back().term ||
+                             (args.last_log_term == log.back().term && args.last_log_index >= last_log_index());
+    }
+    mtx.unlock();
+    return 0;
+}
+
+template<typename state_machine, typename command>
+void raft<state_machine, command>::handle_pre_vote_reply(int target, const request_vote_args &arg,
+                                                         const request_vote_reply &reply) {
+    mtx.lock();
+    if (reply.follower_term > current_term) {
+        set_term_role(reply.follower_term, follower);
+        voted_for = -1;
+        while (!storage->persist_meta(current_term, voted_for)) {}
+    }
+    if (pre_voting && role != leader && arg.current_term == current_term + 1 && reply.vote_granted) {
+        pre_voters.insert(target);
+        raft_config conf = active_config();
+        int votes = 0;
+        for (int voter : pre_voters) {
+            votes += conf.is_voter(voter);
+        }
+        if (votes * 2 > conf.num_voters()) {
+            // a majority would vote for us, only now the term goes up
+            start_new_election();
+        }
+    }
+    mtx.unlock();
+    return;
+}
+
+/**
+ * TimeoutNow: our leader hands over to us, start the election right away, without a pre-vote
+ */
+template<typename state_machine, typename command>
+int raft<state_machine, command>::timeout_now(timeout_now_args args, timeout_now_reply &reply) {
+    mtx.lock();
+    reply.reply_term = current_term;
+    if (args.leader_term == current_term && role == follower) {
+        start_new_election(true);
+    }
+    mtx.unlock();
+    return 0;
+}
+
+/**
+ * one heartbeat out of a raft_host's batch, an empty AppendEntries
+ */
+template<typename state_machine, typename command>
+append_entries_reply raft<state_machine, command>::heartbeat(const heartbeat_args &args) {
+    append_entries_args<command> arg;
+    arg.leader_term = args.leader_term;
+    arg.leader_id = args.leader_id;
+    arg.prev_log_index = args.prev_log_index;
+    arg.prev_log_term = args.prev_log_term;
+    arg.leader_commit_index = args.leader_commit_index;
+    append_entries_reply reply;
+    append_entries(arg, reply);
+    return reply;
+}
+
+
+/**
+ * follower or leader itself or candidate
+ * receive REAL Request or heart beat, handler
+ * @tparam state_machine
+ * @tparam command
+ * @param arg
+ * @param reply
+ * @return
+ */
 template<typename state_machine, typename command>
 int raft<state_machine, command>::append_entries(append_entries_args<command> arg, append_entries_reply &reply) {
     // Your code here:
+    // only the leader appends without mtx, so holding mtx as a follower keeps the log ours to change,
+    // log_mtx is taken around the changes for the readers. The wait for the disk happens after mtx is released.
     mtx.lock();
     reply.reply_term = current_term;
+    reply.conflict_term = -1;
+    reply.conflict_index = 0;
+    reply.match_index = 0;
 
-    int append_start, last_index = logic2fact(log.size() - 1);
+    int append_start, last_index;
     int new_size = arg.entries.size();
+    long long cuts;
+    std::unique_lock<std::mutex> log_lock(log_mtx, std::defer_lock);
 
     if (arg.leader_term > current_term) {
-        current_term = arg.leader_term;
+        set_term_role(arg.leader_term, follower);
         voted_for = -1;
-        role = follower;
-        while (!storage->update(current_term, voted_for, log)) {}
+        while (!storage->persist_meta(current_term, voted_for)) {}
     } // first update leader or mine
     else if (arg.leader_term < current_term) {
         goto fail_return;
@@ -462,18 +1326,39 @@ int raft<state_machine, command>::append_entries(append_entries_args<command> ar
     if (role == leader) {
         goto success_return;
     }
+    last_leader_time = std::chrono::steady_clock::now();
 
-    if (arg.prev_log_index == 0 ||
-        (last_index >= arg.prev_log_index &&
-         get_log_entry(arg.prev_log_index).term == arg.prev_log_term)) {
+    log_lock.lock();
+    last_index = last_log_index();
+    if (arg.prev_log_index < last_included_index) {
+        // already compacted into my snapshot, let the leader continue right after it
+        reply.conflict_index = last_included_index + 1;
+        goto fail_return;
+    } else if (arg.prev_log_index == 0 ||
+               (last_index >= arg.prev_log_index &&
+                get_log_entry(arg.prev_log_index).term == arg.prev_log_term)) {
         goto add2local;
     } else {
 //        RAFT_LOG("Prev info not satisfied, prev log: index %d, term %d, current log size %d",
 //                 arg.prev_log_index, arg.prev_log_term, last_index);
+        if (last_index < arg.prev_log_index) {
+            reply.conflict_index = last_index + 1;
+        } else {
+            // skip the whole conflicting term at once
+            reply.conflict_term = get_log_entry(arg.prev_log_index).term;
+            reply.conflict_index = arg.prev_log_index;
+            while (reply.conflict_index - 1 > last_included_index &&
+                   get_log_entry(reply.conflict_index - 1).term == reply.conflict_term) {
+                --reply.conflict_index;
+            }
+        }
         goto fail_return;
     }
 
     fail_return:
+    if (log_lock.owns_lock()) {
+        log_lock.unlock();
+    }
     reply.success = false; // never match
     set_now(last_rpc_time);
     mtx.unlock();
@@ -484,11 +1369,13 @@ int raft<state_machine, command>::append_entries(append_entries_args<command> ar
     for (int i = 0; i < new_size; ++i) {
         int idx = arg.prev_log_index + 1 + i;
         if (last_index >= idx && idx >= last_included_index) { // buggy here!
-            if (get_log_entry(idx).term != arg.entries[i].term) {
+            if (get_log_entry(idx).term != arg.entries[i]->term) {
 //                RAFT_LOG("TRUNCATE HAPPENS. Cut conflict, origin: %d, current: %d", last_index, idx);
+                drop_waiters(idx);
                 log.resize(fact2logic(idx));
+                configs.erase(configs.lower_bound(idx), configs.end());
                 last_index = logic2fact(log.size() - 1);
-                while (!storage->update(current_term, voted_for, log)) {}
+                // the replacing entries follow right away, appending them over the old ones cuts those in storage
                 break;
             }
         } else {
@@ -497,6 +1384,9 @@ int raft<state_machine, command>::append_entries(append_entries_args<command> ar
     }
     // if we have logs never heard, add them
     append_start = last_index - arg.prev_log_index;
+    if (append_start < new_size) {
+        while (!storage->append(arg.prev_log_index + 1 + append_start, arg.entries, append_start)) {}
+    }
     for (; append_start < new_size; ++append_start) {
         int idx = arg.prev_log_index + 1 + append_start;
         if (last_index >= idx) {
@@ -504,12 +1394,41 @@ int raft<state_machine, command>::append_entries(append_entries_args<command> ar
         }
         log.push_back(arg.entries[append_start]);
         assert(((int) logic2fact(log.size()) == idx + 1));
+        if (!arg.entries[append_start]->conf.empty()) {
+            configs[idx] = arg.entries[append_start]->conf;
+        }
     }
-    while (!storage->update(current_term, voted_for, log)) {}
+    // a follower uses the latest configuration in its log too, committed or not
+    publish_config();
+    log_lock.unlock();
     // if leader commit id is larger:
     if (arg.leader_commit_index > commit_index) {
-        commit_index = std::min(arg.leader_commit_index, logic2fact(static_cast<int>(log.size() - 1)));
+        advance_commit(std::min(arg.leader_commit_index, arg.prev_log_index + new_size));
+        notify_apply();
+    }
+    set_now(last_rpc_time);
+    if (new_size == 0) {
+        // a heartbeat answers with what is on disk right now, the leader counts no further than that
+        reply.match_index = std::min(arg.prev_log_index, storage->durable_index());
+        mtx.unlock();
+        reply.success = true;
+        return 0;
     }
+    cuts = storage->cut_count();
+    mtx.unlock();
+
+    // the log writer persists the entries together with those of the RPCs behind us, reply only once
+    // everything up to the last one is durable. A cut after ours may have replaced them with a newer
+    // leader's entries at the same indexes, whose durability says nothing about ours.
+    if (!storage->wait_durable(arg.prev_log_index + new_size, cuts)) {
+        // a newer leader cut them meanwhile
+        reply.success = false;
+        reply.conflict_index = arg.prev_log_index + 1;
+        return 0;
+    }
+    reply.success = true;
+    reply.match_index = arg.prev_log_index + new_size;
+    return 0;
 
     success_return:
     reply.success = true;
@@ -529,100 +1448,178 @@ int raft<state_machine, command>::append_entries(append_entries_args<command> ar
 
 template<typename state_machine, typename command>
 void raft<state_machine, command>::handle_append_entries_reply(int target, const append_entries_args<command> &arg,
-                                                               const append_entries_reply &reply) {
+                                                               const append_entries_reply &reply, int epoch,
+                                                               std::chrono::steady_clock::time_point sent) {
     // Your code here:
-    mtx.lock();
-    if (role == leader) { // In any case, we turn to follower when meeting larger term
-        if (reply.reply_term > current_term) {
-            current_term = reply.reply_term;
-            voted_for = -1;
-            while (!storage->update(current_term, voted_for, log)) {}
-//            RAFT_LOG("LOSE POWER. Term update to %d", current_term);
-            role = follower;
-        } else { // only care about real entry appending
-            if (reply.success) { // appending successfully
-                // update next_index and match index
-                int match_to = arg.prev_log_index + arg.entries.size();
-                next_index[target] = match_to + 1;
-                match_index[target] = match_to;
-                syn_index[target] = true;
-
-                // update commit id iff:
-                // 1. commit id < match[target]
-                // 2. log[match[target]].term == current term
-                // 3. over majority accept this log
-                // 4. really has sth to match
-                if (match_to > commit_index) {
-                    auto ent = get_log_entry(match_to);
-                    if (ent.term == current_term) {
-                        // check maj
-                        int votes = 0, cluster_size = rpc_clients.size();
-                        for (int i = 0; i < cluster_size; ++i) {
-                            if (match_index[i] >= match_to) {
-                                ++votes;
-                            }
-                        }
-                        if (votes * 2 > cluster_size) {
-//                            RAFT_LOG("New commit id, id: %d", match_to);
-                            commit_index = match_to;
-                        }
-                    }
-                }
-            } else if (!syn_index[target]) {
-                // only update next_index
-                next_index[target]--;
-                assert(next_index[target] >= 1);
-            } else {
-//                RAFT_LOG("Initialized but still fail，Please Pay attention");
-                next_index[target]--;
-            }
+    if (reply.reply_term > arg.leader_term) { // In any case, we turn to follower when meeting larger term
+//        RAFT_LOG("LOSE POWER. Term update to %d", reply.reply_term);
+        step_down(reply.reply_term);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(progress_mtx);
+    if (!leader_of(arg.leader_term)) { // replies to an older leadership are stale
+        return;
+    }
+    // the follower did not vote for anybody since we sent it, the lease runs from here
+    ack_time[target] = std::max(ack_time[target], sent);
+    release_slot(target, epoch);
+    if (reply.success) { // appending successfully
+        // replies may come back out of order, never move backwards
+        int match_to = std::min(arg.prev_log_index + (int) arg.entries.size(), reply.match_index);
+        next_index[target] = std::max(next_index[target], match_to + 1);
+        syn_index[target] = true;
+        if (match_to > match_index[target]) {
+            // the quorum index can only move when a match index does
+            match_index[target] = match_to;
+            try_commit();
         }
+        if (transfer_target == target) {
+            read_cv.notify_all();
+        }
+    } else {
+        // retransmit from the follower's hint, probing one RPC at a time
+        int hint = conflict_next_index(arg, reply);
+        if (hint > arg.prev_log_index) {
+            next_index[target] = std::max(next_index[target], hint);
+        } else {
+            next_index[target] = std::max(1, std::min(next_index[target], hint));
+        }
+        syn_index[target] = false;
     }
+    replicate(target);
+}
 
-    set_now(last_rpc_time);
-    mtx.unlock();
+/**
+ * where to resume after a rejection: right after my last entry of the follower's conflict term if I have
+ * that term, otherwise at the follower's conflict index. A follower whose snapshot already covers
+ * prev_log_index moves us forward instead. Must hold progress_mtx.
+ */
+template<typename state_machine, typename command>
+int raft<state_machine, command>::conflict_next_index(const append_entries_args<command> &arg,
+                                                      const append_entries_reply &reply) {
+    int next = reply.conflict_index;
+    if (reply.conflict_term != -1) {
+        std::lock_guard<std::mutex> log_lock(log_mtx);
+        int i = std::min(arg.prev_log_index, logic2fact(static_cast<int>(log.size() - 1)));
+        for (; i > last_included_index && get_log_entry(i).term > reply.conflict_term; --i) {}
+        if (i > last_included_index && get_log_entry(i).term == reply.conflict_term) {
+            next = i + 1;
+        }
+        next = std::min(next, arg.prev_log_index);
+    }
+    return next;
+}
+
+/**
+ * an AppendEntries/InstallSnapshot never came back: free its window slot and resend from where it started
+ */
+template<typename state_machine, typename command>
+void raft<state_machine, command>::handle_rpc_failure(int target, int term, int retry_from, int epoch) {
+    std::lock_guard<std::mutex> lock(progress_mtx);
+    if (leader_of(term) && epoch == window_epoch[target]) {
+        release_slot(target, epoch);
+        next_index[target] = std::max(1, std::min(next_index[target], retry_from));
+    }
+}
+
+/**
+ * an RPC of the window came back, heartbeats (epoch -1) and replies to an abandoned window hold no slot,
+ * must hold progress_mtx
+ */
+template<typename state_machine, typename command>
+void raft<state_machine, command>::release_slot(int target, int epoch) {
+    if (epoch == window_epoch[target] && inflight[target] > 0) {
+        --inflight[target];
+        set_now(window_time[target]);
+    }
 }
 
 template<typename state_machine, typename command>
 int raft<state_machine, command>::install_snapshot(install_snapshot_args args, install_snapshot_reply &reply) {
     // Your code here:
-    mtx.lock();
-    set_now(last_rpc_time);
-    reply.reply_term = current_term;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        set_now(last_rpc_time);
+        reply.reply_term = current_term;
+        reply.installed = false;
+        reply.next_offset = 0;
 
-    if (args.leader_term > current_term) {
-        voted_for = -1;
-        role = follower;
-        current_term = args.leader_term;
-        while (!storage->update(current_term, voted_for, log)) {}
+        if (args.leader_term > current_term) {
+            voted_for = -1;
+            set_term_role(args.leader_term, follower);
+            while (!storage->persist_meta(current_term, voted_for)) {}
+        }
+        if (args.leader_term < current_term || role == leader) {
+            return 0;
+        }
+        last_leader_time = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> log_lock(log_mtx);
+        if (args.last_included_index <= last_included_index) {
+            reply.installed = true;
+            return 0;
+        }
     }
-    if (args.leader_term < current_term || role == leader
-        || args.last_included_index <= last_included_index) {
+
+    // chunks go to a staging file, the snapshot is taken over only once the last one is there and the
+    // whole file checks out. Both happen off the raft locks, the log and the state machine stay in use.
+    snapshot_reader snapshot;
+    {
+        std::lock_guard<std::mutex> stage_lock(stage_mtx);
+        reply.next_offset = storage->stage_snapshot(args.last_included_index, args.last_included_term,
+                                                    args.leader_term, args.offset, args.data);
+        if (!args.done || reply.next_offset != args.offset + (int) args.data.size() ||
+            !storage->install_staged_snapshot(snapshot)) {
+            return 0;
+        }
+    }
+    reply.installed = true;
+
+    // the snapshot holds committed entries only, it replaces our state whatever the term is by now
+    std::unique_lock<std::mutex> apply_lock(apply_mtx);
+    mtx.lock();
+    std::unique_lock<std::mutex> log_lock(log_mtx);
+    if (args.last_included_index <= last_included_index) {
         goto direct_return;
     }
-//    RAFT_LOG("Snapshot received! idx: %d", args.last_included_index);
-    // follower receive snapshot never received
-    snapshot_data = args.data;
 
+//    RAFT_LOG("Snapshot received! idx: %d", args.last_included_index);
     // truncate
-    if (fact2logic(args.last_included_index) < (int) (log.size()) && log.size() > 1 &&
+    if (fact2logic(args.last_included_index) < log.size() && log.size() > 1 &&
         get_log_entry(args.last_included_index).term == args.last_included_term) {
 //        RAFT_LOG("Cut part of log, idx: %d", args.last_included_index);
-        log.erase(log.begin() + 1, log.begin() + fact2logic(args.last_included_index) + 1);
+        // the log matches the snapshot up to its end, our entries there are the committed ones
+        finish_waiters(args.last_included_index + 1, [this](int index, int term) {
+            return index > last_included_index && get_log_entry(index).term == term;
+        });
+        log.compact(fact2logic(args.last_included_index), args.last_included_term);
+        compact_configs(args.last_included_index);
         if (last_applied < args.last_included_index || commit_index < args.last_included_index) {
             RAFT_LOG("Weird! Why snapshot come first than commit id?");
-            commit_index = args.last_included_index;
+            advance_commit(args.last_included_index);
             last_applied = args.last_included_index + 1;
-            ((raft_state_machine *) state)->apply_snapshot(args.data);
+            raft_config conf;
+            if (!read_snapshot_config(snapshot, conf) || !((raft_state_machine *) state)->load_snapshot(snapshot)) {
+                RAFT_LOG("Error: cannot load the snapshot ending at %d", args.last_included_index);
+                assert(0);
+            }
         }
         goto save_return;
     } else {
         // discard!
 //        RAFT_LOG("Discard all to install");
-        log.resize(1);
-        commit_index = args.last_included_index;
+        finish_waiters(args.last_included_index + 1, [](int, int) { return false; });
+        drop_waiters(args.last_included_index + 1);
+        log.reset(args.last_included_term);
+        while (!storage->truncate_suffix(args.last_included_index + 1)) {}
+        advance_commit(args.last_included_index);
         last_applied = args.last_included_index + 1;
-        ((raft_state_machine *) state)->apply_snapshot(args.data);
+        configs.clear();
+        if (!read_snapshot_config(snapshot, configs[args.last_included_index]) ||
+            !((raft_state_machine *) state)->load_snapshot(snapshot)) {
+            RAFT_LOG("Error: cannot load the snapshot ending at %d", args.last_included_index);
+            assert(0);
+        }
 
         goto save_return;
     }
@@ -630,12 +1627,15 @@ int raft<state_machine, command>::install_snapshot(install_snapshot_args args, i
     // maybe buggy here
     save_return:
     last_included_index = args.last_included_index;
-    log[0].term = args.last_included_term;
+    publish_config();
+    notify_applied();
+    kick_waiters();
 //    RAFT_LOG("Recover from snap shot, term: %d, last index: %d", log[0].term, last_included_index);
-    while (!storage->install_snapshot(last_included_index, log, snapshot_data)) {}
-    while (!storage->update(current_term, voted_for, log)) {}
 
     direct_return:
+    if (log_lock.owns_lock()) {
+        log_lock.unlock();
+    }
     mtx.unlock();
     return 0;
 }
@@ -643,53 +1643,114 @@ int raft<state_machine, command>::install_snapshot(install_snapshot_args args, i
 
 template<typename state_machine, typename command>
 void raft<state_machine, command>::handle_install_snapshot_reply(int target, const install_snapshot_args &arg,
-                                                                 const install_snapshot_reply &reply) {
+                                                                 const install_snapshot_reply &reply, int epoch) {
     // Your code here:
-    mtx.lock();
-    set_now(last_rpc_time);
-    if (reply.reply_term > current_term) {
-        voted_for = -1;
-        role = follower;
-        current_term = reply.reply_term;
-        while (!storage->update(current_term, voted_for, log)) {}
-    } else {
-        // what to do?
-        int next_idx = next_index[target], match_idx = match_index[target];
-        next_index[target] = std::max(next_idx, arg.last_included_index + 1);
-        match_index[target] = std::max(match_idx, arg.last_included_index);
-        syn_index[target] = true;
+    if (reply.reply_term > arg.leader_term) {
+        step_down(reply.reply_term);
+        return;
+    }
+    std::unique_lock<std::mutex> lock(progress_mtx);
+    if (leader_of(arg.leader_term)) {
+        release_slot(target, epoch);
+        if (reply.installed) {
+            int next_idx = next_index[target], match_idx = match_index[target];
+            next_index[target] = std::max(next_idx, arg.last_included_index + 1);
+            match_index[target] = std::max(match_idx, arg.last_included_index);
+            syn_index[target] = true;
+        } else if (snapshot_sending[target] == arg.last_included_index) {
+            // continue right after what the follower has staged
+            snapshot_offset[target] = reply.next_offset;
+        }
+        replicate(target);
     }
-    mtx.unlock();
     return;
 }
 
 template<typename state_machine, typename command>
-void raft<state_machine, command>::send_request_vote(int target, request_vote_args arg) {
-    request_vote_reply reply;
-    if (rpc_clients[target]->call(raft_rpc_opcodes::op_request_vote, arg, reply) == 0) {
-        handle_request_vote_reply(target, arg, reply);
+void raft<state_machine, command>::send_request_vote(int target, request_vote_args arg) {
+    request_vote_reply reply;
+    if (rpc_clients[target]->call(opcode(raft_rpc_opcodes::op_request_vote), arg, reply) == 0) {
+        handle_request_vote_reply(target, arg, reply);
+    } else {
+        // RPC fails
+    }
+}
+
+template<typename state_machine, typename command>
+void raft<state_machine, command>::send_pre_vote(int target, request_vote_args arg) {
+    request_vote_reply reply;
+    if (rpc_clients[target]->call(opcode(raft_rpc_opcodes::op_pre_vote), arg, reply) == 0) {
+        handle_pre_vote_reply(target, arg, reply);
+    }
+}
+
+template<typename state_machine, typename command>
+void raft<state_machine, command>::send_timeout_now(int target, timeout_now_args arg) {
+    timeout_now_reply reply;
+    if (rpc_clients[target]->call(opcode(raft_rpc_opcodes::op_timeout_now), arg, reply) == 0 &&
+        reply.reply_term > arg.leader_term) {
+        step_down(reply.reply_term);
+    }
+}
+
+template<typename state_machine, typename command>
+void raft<state_machine, command>::send_append_entries(int target, append_entries_args<command> arg, int epoch) {
+    append_entries_reply reply;
+    auto sent = std::chrono::steady_clock::now();
+    if (rpc_clients[target]->call(opcode(raft_rpc_opcodes::op_append_entries), arg, reply) == 0) {
+        handle_append_entries_reply(target, arg, reply, epoch, sent);
     } else {
         // RPC fails
+        handle_rpc_failure(target, arg.leader_term, arg.prev_log_index + 1, epoch);
     }
 }
 
 template<typename state_machine, typename command>
-void raft<state_machine, command>::send_append_entries(int target, append_entries_args<command> arg) {
+void raft<state_machine, command>::send_heartbeat(int target, append_entries_args<command> arg, int round) {
     append_entries_reply reply;
-    if (rpc_clients[target]->call(raft_rpc_opcodes::op_append_entries, arg, reply) == 0) {
-        handle_append_entries_reply(target, arg, reply);
-    } else {
-        // RPC fails
+    auto sent = std::chrono::steady_clock::now();
+    if (rpc_clients[target]->call(opcode(raft_rpc_opcodes::op_append_entries), arg, reply) == 0) {
+        handle_heartbeat_reply(target, arg, reply, round, sent);
+    }
+}
+
+template<typename state_machine, typename command>
+void raft<state_machine, command>::handle_heartbeat_reply(int target, const append_entries_args<command> &arg,
+                                                          const append_entries_reply &reply, int round,
+                                                          std::chrono::steady_clock::time_point sent) {
+    if (reply.reply_term <= arg.leader_term) {
+        // the follower still takes us as its leader, whether its log matches or not
+        handle_read_ack(target, arg.leader_term, round);
+    }
+    handle_append_entries_reply(target, arg, reply, -1, sent);
+}
+
+template<typename state_machine, typename command>
+void raft<state_machine, command>::handle_read_ack(int target, int term, int round) {
+    if (round == 0) {
+        // no read asked for a confirmation yet
+        return;
+    }
+    std::lock_guard<std::mutex> lock(progress_mtx);
+    if (leader_of(term) && round > read_acked[target]) {
+        read_acked[target] = round;
+        read_cv.notify_all();
     }
 }
 
 template<typename state_machine, typename command>
-void raft<state_machine, command>::send_install_snapshot(int target, install_snapshot_args arg) {
+void raft<state_machine, command>::send_install_snapshot(int target, install_snapshot_args arg, int epoch) {
     install_snapshot_reply reply;
-    if (rpc_clients[target]->call(raft_rpc_opcodes::op_install_snapshot, arg, reply) == 0) {
-        handle_install_snapshot_reply(target, arg, reply);
+    // the chunk is read here, off every lock, a snapshot replaced meanwhile is resent from the start
+    if (!storage->read_snapshot(arg.last_included_index, arg.offset, snapshot_chunk_size, arg.data, arg.done)) {
+        handle_rpc_failure(target, arg.leader_term, arg.last_included_index, epoch);
+        return;
+    }
+    if (rpc_clients[target]->call(opcode(raft_rpc_opcodes::op_install_snapshot), arg, reply) == 0) {
+        handle_install_snapshot_reply(target, arg, reply, epoch);
     } else {
         // RPC fails
+        handle_rpc_failure(target, arg.leader_term, arg.last_included_index, epoch);
     }
 }
 
@@ -709,25 +1770,26 @@ void raft<state_machine, command>::run_background_election() {
     //        For example:
     //        if (current_time - last_received_RPC_time > timeout) start_election();
     //        Actually, the timeout should be different between the follower (e.g. 300-500ms) and the candidate (e.g. 1s).
-    while (true) {
-        if (is_stopped()) return;
+    std::unique_lock<std::mutex> lock(mtx);
+    while (!is_stopped()) {
         // Your code here:
-        auto current_time = duration_cast<std::chrono::milliseconds>(system_clock::now().time_since_epoch()).count();
-        if (role == follower &&
-            (current_time - last_rpc_time) > (std::chrono::milliseconds((rand() % 200) + 300)).count()) {
-            // start an election
-            mtx.lock();
-            start_new_election();
-            mtx.unlock();
-        } else if (role == candidate &&
-                   (current_time - last_rpc_time) > (std::chrono::milliseconds((rand() % 1000) + 1000)).count()) {
-            // candidate timeout
-            mtx.lock();
-            start_new_election();
-            mtx.unlock();
+        if (role == leader || !active_config().is_voter(my_id)) {
+            // nothing to watch, or no vote to run with, look again a ping period later
+            election_cv.wait_for(lock, ping_timeout);
+            continue;
+        }
+        // one randomized timeout per round, sleep until it runs out unless an RPC pushes it back,
+        // a role change starts a new round
+        raft_role round_role = role;
+        std::chrono::milliseconds timeout = election_round_length(round_role);
+        while (!is_stopped() && role == round_role) {
+            auto deadline = system_clock::time_point(std::chrono::milliseconds(last_rpc_time) + timeout);
+            if (system_clock::now() >= deadline) {
+                start_pre_vote();
+                break;
+            }
+            election_cv.wait_until(lock, deadline);
         }
-//        mtx.unlock();
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
     }
     return;
 }
@@ -740,54 +1802,21 @@ void raft<state_machine, command>::run_background_commit() {
 
     // Hints: You should check the leader's last log index and the follower's next log index.
 
-    while (true) {
-        if (is_stopped()) return;
+    std::unique_lock<std::mutex> lock(progress_mtx);
+    while (!is_stopped()) {
         // Your code here:
-        if (role == leader) {
-            mtx.lock();
-            int log_size = logic2fact(log.size());
+        if ((term_role.load() & 3) == leader) {
             int cluster_size = rpc_clients.size();
-
-            append_entries_args<command> args;
-            install_snapshot_args snapshot_args;
-            args.leader_id = my_id;
-            args.leader_term = current_term;
-            args.leader_commit_index = commit_index;
-            snapshot_args.leader_id = my_id;
-            snapshot_args.leader_term = current_term;
-            snapshot_args.last_included_index = last_included_index;
-            snapshot_args.last_included_term = log[0].term;
-            snapshot_args.offset = 0; // never used
-            snapshot_args.done = true; // never used
-            snapshot_args.data = snapshot_data;
-
+            raft_config conf = active_config();
             for (int i = 0; i < cluster_size; ++i) {
-                int next_idx = next_index[i];
-
-                if (syn_index[i] && next_idx >= log_size) {
-                    continue;
-                }
-
-                if (last_included_index >= next_idx) {
-                    thread_pool->addObjJob(this, &raft::send_install_snapshot, i, snapshot_args);
-
-                } else {
-                    assert(next_idx >= 1);
-                    args.prev_log_index = next_idx - 1;
-                    args.prev_log_term = get_log_entry(next_idx - 1).term; // never used
-
-                    std::vector <log_entry<command>> commands;
-                    for (int i = next_idx; i < log_size; ++i) {
-                        auto tmp = get_log_entry(i);
-                        commands.push_back(tmp);
-                    }
-                    args.entries = commands;
-                    thread_pool->addObjJob(this, &raft::send_append_entries, i, args);
+                if (i != my_id && conf.is_member(i)) {
+                    replicate(i);
                 }
             }
-            mtx.unlock();
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        // woken by new entries, otherwise retry failed RPCs every retry_interval
+        commit_cv.wait_for(lock, retry_interval, [this]() { return replicate_kicked || is_stopped(); });
+        replicate_kicked = false;
     }
 
     return;
@@ -801,21 +1830,74 @@ void raft<state_machine, command>::run_background_apply() {
     // Hints: You should check the commit index and the apply index.
     //        Update the apply index and apply the log if commit_index > apply_index
 
-    while (true) {
-        if (is_stopped()) return;
+    std::vector<log_entry_ptr<command>> batch;
+    std::vector<raft_command *> cmds;
+    while (!is_stopped()) {
         // Your code here:
-        mtx.lock();
-        if (commit_index >= logic2fact(static_cast<int>(log.size()))) {
-//            RAFT_LOG("Error: commit id = %d, log size = %d", commit_index, (int) log.size());
+        {
+            std::unique_lock<std::mutex> lock(signal_mtx);
+            apply_cv.wait(lock, [this]() { return last_applied <= commit_index || waiters_kicked || is_stopped(); });
+            waiters_kicked = false;
+        }
+        run_finished_waiters();
+
+        // copy the committed entries under log_mtx, then apply them without blocking the RPCs
+        std::unique_lock<std::mutex> apply_lock(apply_mtx);
+        int from = last_applied, to = commit_index;
+        if (from > to) {
+            // a snapshot got installed meanwhile
+            continue;
+        }
+        log_mtx.lock();
+        if (to >= logic2fact(static_cast<int>(log.size()))) {
+//            RAFT_LOG("Error: commit id = %d, log size = %d", to, (int) log.size());
             assert(0);
         }
-        for (; last_applied <= commit_index; ++last_applied) {
-            auto ent = get_log_entry(last_applied); // BUGGY here
-//            RAFT_LOG("Commit id = %d, applied id = %d", commit_index, last_applied);
-            ((raft_state_machine *) state)->apply_log(ent.cmd);
+        batch.clear();
+        for (int i = from; i <= to; ++i) {
+            batch.push_back(log.at(fact2logic(i)));
+        }
+        log_mtx.unlock();
+
+        cmds.clear();
+        for (auto &ent : batch) {
+            // the state machine only reads the command, the entry stays shared with the log
+            cmds.push_back(const_cast<command *>(&ent->cmd));
+        }
+//        RAFT_LOG("Commit id = %d, apply from %d", to, from);
+        ((raft_state_machine *) state)->apply_logs(cmds);
+
+        // only snapshots move last_applied too, and they wait for apply_mtx
+        last_applied = from + static_cast<int>(batch.size());
+        notify_applied();
+        finish_waiters(last_applied, [&](int index, int term) {
+            return index >= from && batch[index - from]->term == term;
+        });
+        apply_lock.unlock();
+        run_finished_waiters();
+
+        if (snapshot_due()) {
+            std::lock_guard<std::mutex> lock(signal_mtx);
+            snapshot_kicked = true;
+            snapshot_cv.notify_one();
+        }
+    }
+    return;
+}
+
+template<typename state_machine, typename command>
+void raft<state_machine, command>::run_background_snapshot() {
+    // Save snapshots when the applier finds the log too long.
+    // Work for all the nodes, the snapshot never blocks the applier for longer than taking a view.
+    while (!is_stopped()) {
+        {
+            std::unique_lock<std::mutex> lock(signal_mtx);
+            snapshot_cv.wait(lock, [this]() { return snapshot_kicked || is_stopped(); });
+            snapshot_kicked = false;
+        }
+        if (!is_stopped() && snapshot_due()) {
+            save_snapshot();
         }
-        mtx.unlock();
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
     }
     return;
 }
@@ -824,51 +1906,138 @@ template<typename state_machine, typename command>
 void raft<state_machine, command>::run_background_ping() {
     // Send empty append_entries RPC to the followers.
     // Only work for the leader.
-    while (true) {
-        if (is_stopped()) return;
+    std::unique_lock<std::mutex> lock(progress_mtx);
+    while (!is_stopped()) {
         // Your code here:
+        long long word = term_role.load();
+        if ((word & 3) != leader) {
+            ping_cv.wait(lock, [this]() { return (term_role.load() & 3) == leader || is_stopped(); });
+            continue;
+        }
+        if (!quorum_alive() || removed_self()) {
+            // check-quorum: cut off from the majority, which may elect another leader any time now,
+            // or a committed configuration left us out
+            lock.unlock();
+            resign(static_cast<int>(word >> 2));
+            lock.lock();
+            continue;
+        }
+        auto deadline = system_clock::time_point(std::chrono::milliseconds(last_ping_time) + ping_timeout);
+        if (commit_notice_pending()) {
+            // followers apply only after hearing the new commit index, tell them soon
+            deadline = std::min(deadline, system_clock::time_point(
+                    std::chrono::milliseconds(last_commit_time) + commit_notify_delay));
+        }
+        if (system_clock::now() < deadline) {
+            ping_cv.wait_until(lock, deadline);
+            continue;
+        }
 
-        if (role == leader) {
-            auto current_time = duration_cast<std::chrono::milliseconds>(
-                    system_clock::now().time_since_epoch()).count();
-            if ((current_time - last_ping_time) > ping_timeout.count()) {
-                mtx.lock();
-                set_now(last_ping_time);
-                append_entries_args<command> args;
-                args.leader_term = current_term;
-                args.leader_id = my_id;
-                args.leader_commit_index = commit_index;
-                args.entries = std::vector<log_entry<command>>(0);
-
-                int cluster_size = rpc_clients.size();
-                for (int i = 0; i < cluster_size; ++i) {
-                    int next_idx = next_index[i];
-                    assert(next_idx >= 1);
-                    if ((next_idx) <= last_included_index) {
-                        continue;
-                    } else {
-                        args.prev_log_index = next_idx - 1;
-                        args.prev_log_term = get_log_entry(next_idx - 1).term;
-                    }
-//                    RAFT_LOG("RPC Happens, Ping");
-                    thread_pool->addObjJob(this, &raft::send_append_entries, i, args);
-                }
+        broadcast_heartbeat(word);
+    }
+    return;
+}
 
 
-                mtx.unlock();
-            }
-        }
-        std::this_thread::sleep_for(std::chrono::milliseconds(10)); // Change the timeout here!
+/**
+ * the election and ping workers of a raft_host's group, one step each, beat says the idle heartbeats are due
+ */
+template<typename state_machine, typename command>
+void raft<state_machine, command>::tick(bool beat) {
+    tick_election();
+    tick_ping(beat);
+}
+
+template<typename state_machine, typename command>
+void raft<state_machine, command>::tick_election() {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (is_stopped() || role == leader || !active_config().is_voter(my_id)) {
+        election_round = false;
+        return;
+    }
+    // like the election worker: a randomized timeout per round, a role change starts a new round
+    if (!election_round || role != election_round_role) {
+        election_round = true;
+        election_round_role = role;
+        election_round_timeout = election_round_length(role);
+    }
+    auto deadline = system_clock::time_point(std::chrono::milliseconds(last_rpc_time) + election_round_timeout);
+    if (system_clock::now() >= deadline) {
+        election_round = false;
+        start_pre_vote();
     }
-    return;
 }
 
+template<typename state_machine, typename command>
+void raft<state_machine, command>::tick_ping(bool beat) {
+    std::unique_lock<std::mutex> lock(progress_mtx);
+    long long word = term_role.load();
+    if ((word & 3) != leader || is_stopped()) {
+        return;
+    }
+    if (!quorum_alive() || removed_self()) {
+        lock.unlock();
+        resign(static_cast<int>(word >> 2));
+        return;
+    }
+    // idle heartbeats wait for the host's common beat to share the RPCs with the other groups
+    if (beat || (commit_notice_pending() &&
+                 system_clock::now() >= system_clock::time_point(
+                         std::chrono::milliseconds(last_commit_time) + commit_notify_delay))) {
+        broadcast_heartbeat(word);
+    }
+}
 
 /******************************************************************
 
                         Other functions
 
 *******************************************************************/
+template<typename state_machine, typename command>
+std::chrono::milliseconds raft<state_machine, command>::election_round_length(raft_role r) {
+    return std::chrono::milliseconds(r == follower ? (rand() % 200) + election_timeout.count()
+                                                   : (rand() % 1000) + 1000);
+}
+
+/**
+ * some member has not heard the commit index yet, must hold progress_mtx
+ */
+template<typename state_machine, typename command>
+bool raft<state_machine, command>::commit_notice_pending() {
+    int cluster_size = rpc_clients.size();
+    int commit = commit_index;
+    raft_config conf = active_config();
+    for (int i = 0; i < cluster_size; ++i) {
+        if (i != my_id && conf.is_member(i) && commit_sent[i] < commit) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * queue an RPC job on the thread pool, which may be a raft_host's, stop waits for the jobs still queued
+ */
+template<typename state_machine, typename command>
+template<typename... Params, typename... Args>
+void raft<state_machine, command>::post(void (raft::*job)(Params...), Args... args) {
+    ++pending_jobs;
+    thread_pool->addObjJob(this, &raft::run_job, std::function<void()>(std::bind(job, this, args...)));
+}
+
+template<typename state_machine, typename command>
+void raft<state_machine, command>::run_job(std::function<void()> job) {
+    job();
+    finish_job();
+}
+
+template<typename state_machine, typename command>
+void raft<state_machine, command>::finish_job() {
+    if (--pending_jobs == 0) {
+        std::lock_guard<std::mutex> lock(signal_mtx);
+        jobs_cv.notify_all();
+    }
+}
 /**
  *
  * @tparam state_machine
@@ -881,8 +2050,10 @@ request_vote_args raft<state_machine, command>::get_voter_args() {
     args.current_term = current_term;
     args.candidate_id = my_id;
 
-    args.last_log_index = logic2fact(static_cast<int>(log.size() - 1));
+    std::lock_guard<std::mutex> log_lock(log_mtx);
+    args.last_log_index = last_log_index();
     args.last_log_term = log.back().term;
+    args.transfer = false;
 
     return args;
 }
@@ -894,21 +2065,50 @@ void raft<state_machine, command>::set_now(std::chrono::milliseconds::rep &timer
 }
 
 /**
- *
+ * must hold log_mtx, the storage sees the appends in log order
  * @tparam state_machine
  * @tparam command
  * @param command_
+ * @param term
  * @return return REAL SIZE + 1!! corresponding to INDEX From 1 on
  */
 template<typename state_machine, typename command>
-int raft<state_machine, command>::add_to_log(command &command_) {
-    log_entry<command> ent;
-    ent.term = (current_term);
-    ent.cmd = (command_);
+int raft<state_machine, command>::add_to_log(command &command_, int term) {
+    std::shared_ptr<log_entry<command>> ent = std::make_shared<log_entry<command>>();
+    ent->term = term;
+    ent->cmd = (command_);
 
     log.push_back(ent);
-    while (!storage->update(current_term, voted_for, log)) {}
-    return logic2fact(log.size() - 1);
+    int index = last_log_index();
+    while (!storage->append(index, *ent)) {}
+    return index;
+}
+
+/**
+ * must hold log_mtx, returns the index of the last command
+ */
+template<typename state_machine, typename command>
+int raft<state_machine, command>::add_to_log(const std::vector<command> &commands, int term) {
+    int first = last_log_index() + 1;
+    std::vector<log_entry_ptr<command>> entries;
+    entries.reserve(commands.size());
+    for (const command &cmd : commands) {
+        std::shared_ptr<log_entry<command>> ent = std::make_shared<log_entry<command>>();
+        ent->term = term;
+        ent->cmd = cmd;
+        log.push_back(ent);
+        entries.push_back(ent);
+    }
+    while (!storage->append(first, entries)) {}
+    return last_log_index();
+}
+
+/**
+ * must hold log_mtx
+ */
+template<typename state_machine, typename command>
+int raft<state_machine, command>::last_log_index() {
+    return logic2fact(static_cast<int>(log.size() - 1));
 }
 
 /**
@@ -919,10 +2119,10 @@ int raft<state_machine, command>::add_to_log(command &command_) {
  * @return log[index - 1]
  */
 template<typename state_machine, typename command>
-log_entry<command> raft<state_machine, command>::get_log_entry(int index) {
+const log_entry<command> &raft<state_machine, command>::get_log_entry(int index) {
     int logic = fact2logic(index);
 
-    if (!((logic >= 0 && logic < (int) log.size()))) {
+    if (!((logic >= 0 && logic < log.size()))) {
 //        RAFT_LOG("Error: get %d", logic);
         assert(0);
     }
@@ -936,19 +2136,454 @@ log_entry<command> raft<state_machine, command>::get_log_entry(int index) {
  * @tparam command
  */
 template<typename state_machine, typename command>
-void raft<state_machine, command>::start_new_election() {
-    ++current_term;
+void raft<state_machine, command>::start_new_election(bool transfer) {
+    pre_voting = false;
+    set_term_role(current_term + 1, candidate);
     voted_for = my_id;
-    role = candidate;
     voter_for_self.clear();
     voter_for_self.insert(my_id);
-    while (!storage->update(current_term, voted_for, log)) {}
+    set_now(last_rpc_time); // restart the election timer, an isolated candidate hears nothing else
+    while (!storage->persist_meta(current_term, voted_for)) {}
     // produce vote args and send out
     request_vote_args args = get_voter_args();
+    args.transfer = transfer;
     int cluster_size = rpc_clients.size();
+    raft_config conf = active_config();
     for (int i = 0; i < cluster_size; ++i) {
 //        RAFT_LOG("RPC Happens, ask for votes");
-        thread_pool->addObjJob(this, &raft::send_request_vote, i, args);
+        if (conf.is_voter(i)) {
+            post(&raft::send_request_vote, i, args);
+        }
+    }
+}
+
+/**
+ * ask everybody whether they would vote for us in the next term, the real election starts on a majority,
+ * must hold mtx
+ */
+template<typename state_machine, typename command>
+void raft<state_machine, command>::start_pre_vote() {
+    pre_voting = true;
+    pre_voters.clear();
+    pre_voters.insert(my_id);
+    set_now(last_rpc_time); // try again an election timeout later if the majority says no
+    raft_config conf = active_config();
+    if (conf.num_voters() == 1) {
+        start_new_election();
+        return;
+    }
+    request_vote_args args = get_voter_args();
+    args.current_term = current_term + 1;
+    int cluster_size = rpc_clients.size();
+    for (int i = 0; i < cluster_size; ++i) {
+        if (i != my_id && conf.is_voter(i)) {
+            post(&raft::send_pre_vote, i, args);
+        }
+    }
+}
+
+/**
+ * give up leading `term` without a newer term to move to, the others elect a leader among them
+ */
+template<typename state_machine, typename command>
+void raft<state_machine, command>::resign(int term) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (role == leader && current_term == term) {
+        set_term_role(term, follower);
+        set_now(last_rpc_time);
+    }
+}
+
+/**
+ * advance commit id to the quorum index, the largest index a majority of the voters (the leader counts its
+ * durable entries only) holds, iff:
+ * 1. commit id < quorum index
+ * 2. log[quorum index].term == current term
+ * One advance however many entries it covers, so the applier is woken once. Must hold progress_mtx
+ * @tparam state_machine
+ * @tparam command
+ */
+template<typename state_machine, typename command>
+void raft<state_machine, command>::try_commit() {
+    raft_config conf = active_config();
+    int cluster_size = rpc_clients.size();
+    quorum_match.clear();
+    for (int i = 0; i < cluster_size; ++i) {
+        if (conf.is_voter(i)) {
+            quorum_match.push_back(match_index[i]);
+        }
+    }
+    if (quorum_match.empty()) {
+        return;
+    }
+    // the median from the top: a majority matches at least this far
+    int quorum = static_cast<int>(quorum_match.size()) / 2;
+    std::nth_element(quorum_match.begin(), quorum_match.begin() + quorum, quorum_match.end(), std::greater<int>());
+    int index = quorum_match[quorum];
+    if (index <= commit_index) {
+        return;
+    }
+    {
+        // an older term below the quorum index means none of ours is there either
+        std::lock_guard<std::mutex> log_lock(log_mtx);
+        long long word = term_role.load();
+        if ((word & 3) != leader || get_log_entry(index).term != (int) (word >> 2)) {
+            return;
+        }
+    }
+//    RAFT_LOG("New commit id, id: %d", index);
+    advance_commit(index);
+    set_now(last_commit_time);
+    notify_apply();
+    ping_cv.notify_one();
+}
+
+/**
+ * reinitialize the replication state after winning an election and wake the ping / commit workers,
+ * must hold mtx
+ * @tparam state_machine
+ * @tparam command
+ */
+template<typename state_machine, typename command>
+void raft<state_machine, command>::become_leader() {
+    std::lock_guard<std::mutex> lock(progress_mtx);
+    set_now(last_ping_time);
+    int cluster_size = rpc_clients.size();
+    int index_size;
+    {
+        std::lock_guard<std::mutex> log_lock(log_mtx);
+        index_size = logic2fact(log.size());
+    }
+    next_index.assign(cluster_size, index_size);
+    match_index.assign(cluster_size, 0);
+    syn_index.assign(cluster_size, false);
+    inflight.assign(cluster_size, 0);
+    window_epoch.assign(cluster_size, 0);
+    window_time.assign(cluster_size, last_ping_time);
+    commit_sent.assign(cluster_size, 0);
+    snapshot_sending.assign(cluster_size, 0);
+    snapshot_offset.assign(cluster_size, 0);
+    read_acked.assign(cluster_size, 0);
+    ack_time.assign(cluster_size, std::chrono::steady_clock::time_point());
+    leader_since = std::chrono::steady_clock::now();
+    match_index[my_id] = std::min(storage->durable_index(), index_size - 1);
+    syn_index[my_id] = true;
+    // publish only once the progress is ready, appends and replies start right after
+    set_term_role(current_term, leader);
+
+    ping_cv.notify_one();
+    kick_replication();
+}
+
+/**
+ * send an empty AppendEntries to every follower, carrying the commit index and the current read round,
+ * must hold progress_mtx
+ */
+template<typename state_machine, typename command>
+void raft<state_machine, command>::broadcast_heartbeat(long long word) {
+    set_now(last_ping_time);
+    int cluster_size = rpc_clients.size();
+    int commit = commit_index;
+    append_entries_args<command> args;
+    args.leader_term = static_cast<int>(word >> 2);
+    args.leader_id = my_id;
+    args.leader_commit_index = commit;
+    args.entries = std::vector<log_entry_ptr<command>>(0);
+    raft_config conf = active_config();
+
+    for (int i = 0; i < cluster_size; ++i) {
+        if (!conf.is_member(i)) {
+            continue;
+        }
+        int next_idx = next_index[i];
+        assert(next_idx >= 1);
+        // next_index runs ahead of the follower while entries are in flight,
+        // a synced follower is pinged at its known match point instead
+        int prev_idx = syn_index[i] ? match_index[i] : next_idx - 1;
+        commit_sent[i] = std::max(commit_sent[i], commit);
+        if (i == my_id) {
+            continue;
+        }
+        {
+            // the log only grows while the word still says we lead this term
+            std::lock_guard<std::mutex> log_lock(log_mtx);
+            if (term_role.load() != word) {
+                return;
+            }
+            if (prev_idx < last_included_index) {
+                continue;
+            }
+            args.prev_log_index = prev_idx;
+            args.prev_log_term = get_log_entry(prev_idx).term;
+        }
+//        RAFT_LOG("RPC Happens, Ping");
+        if (!host) {
+            post(&raft::send_heartbeat, i, args, read_round);
+            continue;
+        }
+        // rides along with the heartbeats of the host's other groups for node i
+        heartbeat_args beat;
+        beat.group = group;
+        beat.leader_term = args.leader_term;
+        beat.leader_id = my_id;
+        beat.prev_log_index = args.prev_log_index;
+        beat.prev_log_term = args.prev_log_term;
+        beat.leader_commit_index = commit;
+        int round = read_round;
+        ++pending_jobs;
+        host->send_heartbeat(i, beat, [this, i, args, round](bool ok, const append_entries_reply &reply,
+                                                             std::chrono::steady_clock::time_point sent) {
+            if (ok) {
+                handle_heartbeat_reply(i, args, reply, round, sent);
+            }
+            finish_job();
+        });
+    }
+}
+
+/**
+ * wake the commit worker to ship newly appended entries, must hold progress_mtx
+ */
+template<typename state_machine, typename command>
+void raft<state_machine, command>::kick_replication() {
+    replicate_kicked = true;
+    commit_cv.notify_one();
+}
+
+/**
+ * change the term and the role together, must hold mtx. Taking log_mtx orders it against the appends of
+ * new_command: no entry of a term is appended after the node stops leading it.
+ */
+template<typename state_machine, typename command>
+void raft<state_machine, command>::set_term_role(int term, raft_role r) {
+    bool deposed;
+    {
+        std::lock_guard<std::mutex> log_lock(log_mtx);
+        deposed = role == leader && r != leader;
+        current_term = term;
+        role = r;
+        term_role.store(((long long) term << 2) | r);
+    }
+    if (deposed) {
+        // wake the reads and the transfer waiting for the leadership, only become_leader holds progress_mtx here
+        std::lock_guard<std::mutex> lock(progress_mtx);
+        read_cv.notify_all();
+    }
+}
+
+template<typename state_machine, typename command>
+bool raft<state_machine, command>::leader_of(int term) {
+    return term_role.load() == (((long long) term << 2) | leader);
+}
+
+/**
+ * a reply carried a larger term, the replication paths hold no mtx and step down through here
+ */
+template<typename state_machine, typename command>
+void raft<state_machine, command>::step_down(int term) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (term > current_term) {
+        voted_for = -1;
+        set_term_role(term, follower);
+        while (!storage->persist_meta(current_term, voted_for)) {}
+        set_now(last_rpc_time);
+    }
+}
+
+/**
+ * the commit index never moves backwards, even if a stale leader path races a follower path
+ */
+template<typename state_machine, typename command>
+void raft<state_machine, command>::advance_commit(int index) {
+    int old = commit_index.load();
+    while (old < index && !commit_index.compare_exchange_weak(old, index)) {}
+}
+
+template<typename state_machine, typename command>
+void raft<state_machine, command>::notify_apply() {
+    { std::lock_guard<std::mutex> lock(signal_mtx); } // the applier is either waiting or will see the new index
+    apply_cv.notify_one();
+}
+
+/**
+ * wake the readers waiting for last_applied
+ */
+template<typename state_machine, typename command>
+void raft<state_machine, command>::notify_applied() {
+    { std::lock_guard<std::mutex> lock(signal_mtx); }
+    applied_cv.notify_all();
+}
+
+/**
+ * decide the callbacks of the entries before end, applied tells whether the entry (index, term) took effect
+ */
+template<typename state_machine, typename command>
+void raft<state_machine, command>::finish_waiters(int end, const std::function<bool(int index, int term)> &applied) {
+    std::lock_guard<std::mutex> lock(waiter_mtx);
+    auto last = commit_waiters.lower_bound(end);
+    for (auto it = commit_waiters.begin(); it != last; ++it) {
+        finished_waiters.push_back(std::make_pair(it->second.second, applied(it->first, it->second.first)));
+    }
+    commit_waiters.erase(commit_waiters.begin(), last);
+}
+
+/**
+ * must hold log_mtx, the entries from index on are overwritten
+ */
+template<typename state_machine, typename command>
+void raft<state_machine, command>::drop_waiters(int index) {
+    {
+        std::lock_guard<std::mutex> lock(waiter_mtx);
+        auto first = commit_waiters.lower_bound(index);
+        if (first == commit_waiters.end()) {
+            return;
+        }
+        for (auto it = first; it != commit_waiters.end(); ++it) {
+            finished_waiters.push_back(std::make_pair(it->second.second, false));
+        }
+        commit_waiters.erase(first, commit_waiters.end());
+    }
+    kick_waiters();
+}
+
+/**
+ * let the applier run the callbacks decided elsewhere
+ */
+template<typename state_machine, typename command>
+void raft<state_machine, command>::kick_waiters() {
+    std::lock_guard<std::mutex> lock(signal_mtx);
+    waiters_kicked = true;
+    apply_cv.notify_one();
+}
+
+/**
+ * must hold no raft lock, the callbacks may call back into the node
+ */
+template<typename state_machine, typename command>
+void raft<state_machine, command>::run_finished_waiters() {
+    std::vector<std::pair<commit_callback, bool>> finished;
+    {
+        std::lock_guard<std::mutex> lock(waiter_mtx);
+        finished.swap(finished_waiters);
+    }
+    for (auto &waiter : finished) {
+        waiter.first(waiter.second);
+    }
+}
+
+template<typename state_machine, typename command>
+bool raft<state_machine, command>::wait_for_applied(int index, std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(signal_mtx);
+    return applied_cv.wait_for(lock, timeout, [&]() { return last_applied > index || is_stopped(); }) &&
+           !is_stopped();
+}
+
+template<typename state_machine, typename command>
+bool raft<state_machine, command>::snapshot_due() {
+    int entries = auto_snapshot_entries;
+    long long bytes = auto_snapshot_bytes;
+    if (entries == 0 && bytes == 0) {
+        return false;
+    }
+    int applied = last_applied - 1;
+    std::lock_guard<std::mutex> log_lock(log_mtx);
+    if (applied <= last_included_index) {
+        return false;
+    }
+    return (entries > 0 && applied - last_included_index >= entries) || (bytes > 0 && log.bytes() >= bytes);
+}
+
+/**
+ * Fill the replication window of one follower: keep sending the entries after next_index while fewer
+ * than max_inflight RPCs are outstanding, advancing next_index optimistically. Each RPC carries at most
+ * max_entries_per_rpc entries / max_bytes_per_rpc bytes. A follower whose match point is unknown is
+ * probed with a single RPC at a time. RPCs lost on the way only come back as failures after the rpc
+ * timeout, so a window that hears nothing for window_timeout is abandoned and refilled from the match
+ * point. Nodes outside the configuration get nothing. Must hold progress_mtx, the log is read under log_mtx and the RPCs are queued without it.
+ * @tparam state_machine
+ * @tparam command
+ * @param target
+ */
+template<typename state_machine, typename command>
+void raft<state_machine, command>::replicate(int target) {
+    long long word = term_role.load();
+    if ((word & 3) != leader || !active_config().is_member(target)) {
+        return;
+    }
+    int term = static_cast<int>(word >> 2);
+    auto current_time = duration_cast<std::chrono::milliseconds>(system_clock::now().time_since_epoch()).count();
+    if (inflight[target] > 0 && current_time - window_time[target] > window_timeout.count()) {
+        ++window_epoch[target];
+        inflight[target] = 0;
+        if (syn_index[target]) {
+            next_index[target] = match_index[target] + 1;
+        }
+    }
+    if (inflight[target] == 0) {
+        window_time[target] = current_time;
+    }
+
+    while (inflight[target] < max_inflight) {
+        int next_idx = next_index[target];
+        assert(next_idx >= 1);
+
+        std::unique_lock<std::mutex> log_lock(log_mtx);
+        if (term_role.load() != word) {
+            // lost the leadership, the log may get truncated from now on
+            return;
+        }
+        int last_index = last_log_index();
+        if (last_included_index >= next_idx) {
+            // the follower lags behind the snapshot
+            if (inflight[target] == 0) {
+                install_snapshot_args snapshot_args;
+                snapshot_args.leader_id = my_id;
+                snapshot_args.leader_term = term;
+                snapshot_args.last_included_index = last_included_index;
+                snapshot_args.last_included_term = log[0].term;
+                if (snapshot_sending[target] != last_included_index) {
+                    snapshot_sending[target] = last_included_index;
+                    snapshot_offset[target] = 0;
+                }
+                snapshot_args.offset = snapshot_offset[target];
+                snapshot_args.done = false; // data and done are filled in by the sender
+                log_lock.unlock();
+                ++inflight[target];
+                post(&raft::send_install_snapshot, target, snapshot_args,
+                                       window_epoch[target]);
+            }
+            return;
+        }
+        if (syn_index[target] ? next_idx > last_index : inflight[target] > 0) {
+            return;
+        }
+
+        append_entries_args<command> args;
+        args.leader_id = my_id;
+        args.leader_term = term;
+        args.leader_commit_index = commit_index;
+        args.prev_log_index = next_idx - 1;
+        args.prev_log_term = get_log_entry(next_idx - 1).term;
+
+        int bytes = 0;
+        for (int i = next_idx; i <= last_index && (int) args.entries.size() < max_entries_per_rpc; ++i) {
+            const log_entry_ptr<command> &ent = log.at(fact2logic(i));
+            bytes += ((const raft_command *) (&ent->cmd))->size();
+            if (!args.entries.empty() && bytes > max_bytes_per_rpc) {
+                break;
+            }
+            args.entries.push_back(ent);
+        }
+        log_lock.unlock();
+
+        next_index[target] = next_idx + args.entries.size();
+        commit_sent[target] = std::max(commit_sent[target], args.leader_commit_index);
+        ++inflight[target];
+        post(&raft::send_append_entries, target, args, window_epoch[target]);
+
+        if (!syn_index[target]) {
+            return;
+        }
     }
 }
 
@@ -0,0 +1,93 @@
+#ifndef raft_batcher_h
+#define raft_batcher_h
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+#include "raft.h"
+
+/**
+ * Client side batching for a raft node.
+ *
+ * Concurrent submit() calls that arrive within `window` of each other are coalesced and sent with one
+ * new_commands(), so they share one log append, one storage write and one replication round. The first
+ * caller of a batch waits out the window (or until max_batch commands joined) and sends it, the others
+ * only wait for the result. There is no thread of its own, a lone caller pays at most the window.
+ */
+template<typename state_machine, typename command>
+class raft_batcher {
+public:
+    raft_batcher(raft<state_machine, command> *node,
+                 std::chrono::microseconds window = std::chrono::microseconds(50), int max_batch = 256) :
+            node(node), window(window), max_batch(max_batch > 0 ? max_batch : 1) {}
+
+    // like raft::new_command, returns false if the node does not lead
+    bool submit(const command &cmd, int &term, int &index);
+
+private:
+    struct batch {
+        std::vector<command> cmds;
+        bool full = false;          // the sender need not wait out the window
+        bool done = false;
+        bool ok = false;
+        int term = 0;
+        int first_index = 0;
+    };
+
+    raft<state_machine, command> *node;
+    std::chrono::microseconds window;
+    int max_batch;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::shared_ptr<batch> open;    // the batch new callers join, null once it is being sent
+};
+
+template<typename state_machine, typename command>
+bool raft_batcher<state_machine, command>::submit(const command &cmd, int &term, int &index) {
+    std::unique_lock<std::mutex> lock(mtx);
+    std::shared_ptr<batch> b = open;
+    bool sender = !b;
+    if (sender) {
+        b = std::make_shared<batch>();
+        b->cmds.reserve(max_batch);
+        open = b;
+    }
+    int pos = static_cast<int>(b->cmds.size());
+    b->cmds.push_back(cmd);
+    if (static_cast<int>(b->cmds.size()) >= max_batch) {
+        b->full = true;
+        open = nullptr;
+        cv.notify_all();
+    }
+
+    if (sender) {
+        cv.wait_for(lock, window, [&]() { return b->full; });
+        if (open == b) {
+            open = nullptr;
+        }
+        lock.unlock();
+
+        int first_index = 0, last_index = 0;
+        bool ok = node->new_commands(b->cmds, b->term, first_index, last_index);
+
+        lock.lock();
+        b->ok = ok;
+        b->first_index = first_index;
+        b->done = true;
+        cv.notify_all();
+    } else {
+        cv.wait(lock, [&]() { return b->done; });
+    }
+    if (!b->ok) {
+        return false;
+    }
+    term = b->term;
+    index = b->first_index + pos;
+    return true;
+}
+
+#endif // raft_batcher_h
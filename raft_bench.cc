@@ -0,0 +1,116 @@
+/*
+ * Contention benchmark of the raft core: client threads hammer new_command on the leader of a
+ * 3-node group, the throughput should keep growing with the number of clients.
+ * With a batch window the clients go through a raft_batcher and share new_commands calls.
+ * Without one, commit callbacks measure the latency from new_command until the entry is applied.
+ *
+ * usage: raft_bench [seconds per round] [max client threads] [batch window in us, 0 = no batching]
+ */
+
+#include "raft_test_utils.h"
+#include "raft_batcher.h"
+
+typedef raft_group<list_state_machine, list_command> list_raft_group;
+typedef raft_batcher<list_state_machine, list_command> list_raft_batcher;
+
+struct commit_latency {
+    std::mutex mtx;
+    std::vector<double> us;         // of every applied entry
+    std::atomic<long long> pending; // callbacks still to come
+
+    commit_latency() : pending(0) {}
+
+    double percentile(double p) {
+        if (us.empty()) {
+            return 0;
+        }
+        size_t k = std::min(us.size() - 1, (size_t) (p * us.size()));
+        std::nth_element(us.begin(), us.begin() + k, us.end());
+        return us[k];
+    }
+};
+
+static double bench_round(list_raft_group *group, int leader, list_raft_batcher *batcher, int threads, int seconds,
+                          long long &failed, commit_latency &latency) {
+    std::atomic<long long> ops(0), fails(0);
+    std::atomic_bool done(false);
+    std::vector<std::thread> clients;
+    for (int t = 0; t < threads; ++t) {
+        clients.emplace_back([&, t]() {
+            int value = t << 24;
+            while (!done.load()) {
+                int term, index;
+                bool ok;
+                if (batcher) {
+                    ok = batcher->submit(list_command(value++), term, index);
+                } else {
+                    auto sent = std::chrono::steady_clock::now();
+                    auto applied = [&latency, sent](bool ok) {
+                        if (ok) {
+                            auto us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - sent);
+                            std::lock_guard<std::mutex> lock(latency.mtx);
+                            latency.us.push_back(us.count());
+                        }
+                        --latency.pending;
+                    };
+                    ++latency.pending;
+                    ok = group->nodes[leader]->new_command(list_command(value++), term, index, applied);
+                    if (!ok) {
+                        --latency.pending;
+                    }
+                }
+                if (ok) {
+                    ++ops;
+                } else {
+                    ++fails;
+                }
+            }
+        });
+    }
+    auto start = std::chrono::steady_clock::now();
+    mssleep(seconds * 1000);
+    done.store(true);
+    for (auto &th : clients) {
+        th.join();
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    for (int i = 0; i < 500 && latency.pending.load() > 0; ++i) {
+        mssleep(10);
+    }
+    failed = fails.load();
+    return ops.load() / elapsed;
+}
+
+int main(int argc, char **argv) {
+    int seconds = argc > 1 ? atoi(argv[1]) : 2;
+    int max_threads = argc > 2 ? atoi(argv[2]) : 16;
+    int window = argc > 3 ? atoi(argv[3]) : 0;
+
+    list_raft_group *group = new list_raft_group(3);
+    int leader = group->check_exact_one_leader();
+    list_raft_batcher *batcher = window > 0 ?
+                                 new list_raft_batcher(group->nodes[leader], std::chrono::microseconds(window)) : nullptr;
+
+    // outlives the group: stopping it runs the callbacks of a round that stopped committing
+    commit_latency latency;
+    printf("%8s %12s %10s %14s %12s %12s\n", "clients", "ops/s", "failed", "entries/fsync", "p50 us", "p99 us");
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        raft_storage_stats before = group->storages[leader]->stats();
+        long long failed = 0;
+        latency.us.clear();
+        double rate = bench_round(group, leader, batcher, threads, seconds, failed, latency);
+        raft_storage_stats after = group->storages[leader]->stats();
+        long long batches = after.batches - before.batches;
+        printf("%8d %12.0f %10lld %14.1f %12.0f %12.0f\n", threads, rate, failed,
+               batches ? (double) (after.entries - before.entries) / batches : 0.0,
+               latency.percentile(0.5), latency.percentile(0.99));
+        if (failed || latency.pending.load() > 0) {
+            // lost the leadership or stopped committing, the numbers after this point mean nothing
+            break;
+        }
+    }
+
+    delete batcher;
+    delete group;
+    return 0;
+}
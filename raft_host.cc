@@ -0,0 +1,169 @@
+#include "raft_host.h"
+
+raft_host::raft_host(rpcs *server, std::vector<rpcc *> clients, int idx, int threads,
+                     std::chrono::milliseconds tick, std::chrono::milliseconds beat) :
+        rpc_server(server),
+        rpc_clients(clients),
+        my_id(idx),
+        thread_pool(new ThrPool(threads)),
+        tick_interval(tick),
+        beat_interval(beat),
+        queued(clients.size()),
+        stopping(false) {
+    rpc_server->reg(raft_rpc_opcodes::op_heartbeats, this, &raft_host::heartbeats);
+    ticker = new std::thread(&raft_host::run_ticker, this);
+}
+
+raft_host::~raft_host() {
+    {
+        std::lock_guard<std::mutex> lock(beat_mtx);
+        stopping = true;
+        ticker_cv.notify_all();
+    }
+    ticker->join();
+    delete ticker;
+    thread_pool->destroy();
+    delete thread_pool;
+
+    // the groups are gone, nobody waits for these any more
+    append_entries_reply none;
+    none.reply_term = -1;
+    for (auto &batch : queued) {
+        for (size_t i = 0; batch && i < batch->done.size(); ++i) {
+            batch->done[i](false, none, std::chrono::steady_clock::now());
+        }
+    }
+}
+
+void raft_host::add_group(int group, const tick_handler &tick, const heartbeat_handler &heartbeat) {
+    assert(group >= 0 && group < 0x8000);
+    std::lock_guard<std::mutex> lock(groups_mtx);
+    groups[group] = std::make_shared<group_handlers>(group_handlers{tick, heartbeat, 0});
+}
+
+void raft_host::remove_group(int group) {
+    std::unique_lock<std::mutex> lock(groups_mtx);
+    auto it = groups.find(group);
+    if (it == groups.end()) {
+        return;
+    }
+    std::shared_ptr<group_handlers> handlers = it->second;
+    groups.erase(it);
+    calls_cv.wait(lock, [&]() { return handlers->calls == 0; });
+}
+
+std::shared_ptr<raft_host::group_handlers> raft_host::enter(int group) {
+    auto it = groups.find(group);
+    if (it == groups.end()) {
+        return nullptr;
+    }
+    ++it->second->calls;
+    return it->second;
+}
+
+void raft_host::leave(const std::shared_ptr<group_handlers> &handlers) {
+    std::lock_guard<std::mutex> lock(groups_mtx);
+    if (--handlers->calls == 0) {
+        calls_cv.notify_all();
+    }
+}
+
+void raft_host::send_heartbeat(int target, const heartbeat_args &args, const heartbeat_callback &done) {
+    std::unique_lock<std::mutex> lock(beat_mtx);
+    if (stopping) {
+        lock.unlock();
+        append_entries_reply none;
+        none.reply_term = -1;
+        done(false, none, std::chrono::steady_clock::now());
+        return;
+    }
+    if (!queued[target]) {
+        queued[target] = std::make_shared<heartbeat_batch>();
+    }
+    queued[target]->args.beats.push_back(args);
+    queued[target]->done.push_back(done);
+}
+
+int raft_host::heartbeats(heartbeats_args args, heartbeats_reply &reply) {
+    for (const heartbeat_args &beat : args.beats) {
+        std::shared_ptr<group_handlers> handlers;
+        {
+            std::lock_guard<std::mutex> lock(groups_mtx);
+            handlers = enter(beat.group);
+        }
+        if (!handlers) {
+            append_entries_reply none;
+            none.reply_term = -1;
+            none.success = false;
+            none.conflict_term = -1;
+            none.conflict_index = 0;
+            none.match_index = 0;
+            reply.replies.push_back(none);
+        } else {
+            reply.replies.push_back(handlers->heartbeat(beat));
+            leave(handlers);
+        }
+    }
+    return 0;
+}
+
+void raft_host::run_ticker() {
+    auto next_beat = std::chrono::steady_clock::now() + beat_interval;
+    std::unique_lock<std::mutex> lock(beat_mtx);
+    while (!stopping) {
+        ticker_cv.wait_for(lock, tick_interval, [this]() { return stopping; });
+        if (stopping) {
+            break;
+        }
+        lock.unlock();
+
+        auto now = std::chrono::steady_clock::now();
+        bool beat = now >= next_beat;
+        if (beat) {
+            next_beat = now + beat_interval;
+        }
+        std::vector<std::shared_ptr<group_handlers>> entered;
+        {
+            std::lock_guard<std::mutex> groups_lock(groups_mtx);
+            for (auto &group : groups) {
+                entered.push_back(enter(group.first));
+            }
+        }
+        for (auto &handlers : entered) {
+            handlers->tick(beat);
+            leave(handlers);
+        }
+        flush_heartbeats();
+
+        lock.lock();
+    }
+}
+
+/**
+ * one RPC per node for what the groups queued since the last tick
+ */
+void raft_host::flush_heartbeats() {
+    std::vector<std::shared_ptr<heartbeat_batch>> batches(rpc_clients.size());
+    {
+        std::lock_guard<std::mutex> lock(beat_mtx);
+        batches.swap(queued);
+    }
+    for (int target = 0; target < (int) batches.size(); ++target) {
+        if (batches[target]) {
+            thread_pool->addObjJob(this, &raft_host::send_heartbeats, target, batches[target]);
+        }
+    }
+}
+
+void raft_host::send_heartbeats(int target, std::shared_ptr<heartbeat_batch> batch) {
+    heartbeats_reply reply;
+    auto sent = std::chrono::steady_clock::now();
+    bool ok = rpc_clients[target]->call(raft_rpc_opcodes::op_heartbeats, batch->args, reply) == 0 &&
+              reply.replies.size() == batch->done.size();
+    append_entries_reply none;
+    none.reply_term = -1;
+    for (size_t i = 0; i < batch->done.size(); ++i) {
+        bool answered = ok && reply.replies[i].reply_term >= 0;
+        batch->done[i](answered, answered ? reply.replies[i] : none, sent);
+    }
+}
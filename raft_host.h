@@ -0,0 +1,107 @@
+#ifndef raft_host_h
+#define raft_host_h
+
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <thread>
+#include <memory>
+#include <functional>
+
+#include "rpc.h"
+#include "raft_protocol.h"
+
+/**
+ * Multi-raft: what the raft groups of one process share.
+ *
+ * One RPC server and one client per node, the opcodes of every group are tagged with its id (raft_opcode).
+ * One thread pool for all the outgoing RPCs. One ticker thread drives the election and heartbeat timers
+ * of every group instead of two threads per group, and it sends the heartbeats of all groups for the same
+ * node in one RPC. Idle heartbeats go out on a common beat, so a pair of nodes exchanges one heartbeat RPC
+ * per ping period however many groups they share.
+ * Only those are shared. There is no shared log writer and no group-tagged log: every group's storage keeps
+ * its own files, writer thread and fsyncs, and every group still runs its own commit, apply and snapshot
+ * threads. A host with n groups runs 4n threads besides the pool and the ticker and issues n fsync streams,
+ * which suits tens of groups, not hundreds.
+ * Groups hook in with raft's host constructor, the host has to outlive them.
+ */
+class raft_host {
+public:
+    // called with false if the RPC failed or the group is not on the target node
+    typedef std::function<void(bool ok, const append_entries_reply &reply,
+                               std::chrono::steady_clock::time_point sent)> heartbeat_callback;
+
+    // a group's timers, beat tells that the idle heartbeats are due
+    typedef std::function<void(bool beat)> tick_handler;
+
+    typedef std::function<append_entries_reply(const heartbeat_args &args)> heartbeat_handler;
+
+    raft_host(rpcs *server, std::vector<rpcc *> clients, int idx, int threads = 32,
+              std::chrono::milliseconds tick = std::chrono::milliseconds(5),
+              std::chrono::milliseconds beat = std::chrono::milliseconds(150));
+
+    ~raft_host();
+
+    rpcs *server() { return rpc_server; }
+
+    const std::vector<rpcc *> &clients() { return rpc_clients; }
+
+    int id() { return my_id; }
+
+    ThrPool *pool() { return thread_pool; }
+
+    void add_group(int group, const tick_handler &tick, const heartbeat_handler &heartbeat);
+
+    // once it returns, the ticker and the heartbeat RPCs no longer call into the group
+    void remove_group(int group);
+
+    // queue a heartbeat, it leaves with the next tick together with those of the other groups for target,
+    // done is called exactly once
+    void send_heartbeat(int target, const heartbeat_args &args, const heartbeat_callback &done);
+
+private:
+    struct group_handlers {
+        tick_handler tick;
+        heartbeat_handler heartbeat;
+        int calls;      // running now, guarded by groups_mtx
+    };
+
+    struct heartbeat_batch {
+        heartbeats_args args;
+        std::vector<heartbeat_callback> done;
+    };
+
+    rpcs *rpc_server;
+    std::vector<rpcc *> rpc_clients;
+    int my_id;
+    ThrPool *thread_pool;
+    std::chrono::milliseconds tick_interval;
+    std::chrono::milliseconds beat_interval;
+
+    // Lock order: groups_mtx -> beat_mtx. The groups are called without them, a follower may wait for its disk.
+    std::mutex groups_mtx;              // the groups and their running calls
+    std::mutex beat_mtx;                // the queued heartbeats and the ticker state
+    std::map<int, std::shared_ptr<group_handlers>> groups;
+    std::condition_variable calls_cv;   // a call into a group returned, with groups_mtx
+    std::vector<std::shared_ptr<heartbeat_batch>> queued; // by target node
+    bool stopping;
+    std::condition_variable ticker_cv;  // stop, with beat_mtx
+    std::thread *ticker;
+
+    // RPC handler
+    int heartbeats(heartbeats_args args, heartbeats_reply &reply);
+
+    // the group is entered, null if it is gone, must hold groups_mtx
+    std::shared_ptr<group_handlers> enter(int group);
+
+    void leave(const std::shared_ptr<group_handlers> &handlers);
+
+    void run_ticker();
+
+    void flush_heartbeats();
+
+    void send_heartbeats(int target, std::shared_ptr<heartbeat_batch> batch);
+};
+
+#endif // raft_host_h
@@ -0,0 +1,474 @@
+#include "raft_kv.h"
+
+#include <set>
+#include <thread>
+#include <random>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+const kv_route *kv_route_table::find(const std::string &key) const {
+    auto it = routes.upper_bound(key);
+    if (it == routes.begin()) {
+        return nullptr;
+    }
+    --it;
+    return it->second.range.contains(key) ? &it->second : nullptr;
+}
+
+raft_kv::shard::~shard() {
+    for (auto node : nodes) {
+        node->stop();
+    }
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        delete nodes[i];
+        delete states[i];
+        delete storages[i];
+    }
+}
+
+raft_kv::raft_kv(const std::vector<raft_host *> &hosts, const std::string &dir) :
+        hosts(hosts), dir(dir), next_group(1), moving{-1, -1, "", false} {
+    std::lock_guard<std::mutex> lock(admin_mtx);
+    if (!load_routes()) {
+        table.routes[""] = kv_route{kv_range(), 0};
+        while (!save_routes()) {}
+        open_group(0);
+        return;
+    }
+    std::set<int> groups;
+    for (auto &route : table.routes) {
+        groups.insert(route.second.group);
+    }
+    if (moving.source >= 0) {
+        groups.insert(moving.source);
+        groups.insert(moving.target);
+    }
+    for (int group : groups) {
+        open_group(group);
+    }
+    finish_handoff();
+}
+
+raft_kv::~raft_kv() {
+    std::lock_guard<std::mutex> lock(mtx);
+    shards.clear();
+}
+
+kv_route_table raft_kv::route_table() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return table;
+}
+
+kv_state_machine *raft_kv::state(int group, int node) {
+    std::lock_guard<std::mutex> lock(mtx);
+    auto it = shards.find(group);
+    return it == shards.end() ? nullptr : it->second->states[node];
+}
+
+void raft_kv::open_group(int group) {
+    std::shared_ptr<shard> s = std::make_shared<shard>();
+    for (size_t i = 0; i < hosts.size(); ++i) {
+        std::string node_dir = dir + "/group_" + std::to_string(group) + "_" + std::to_string(i);
+        mkdir(node_dir.c_str(), 0777);
+        s->storages.push_back(new raft_storage<kv_command>(node_dir));
+        s->states.push_back(new kv_state_machine(group == 0 ? kv_range() : kv_range::none()));
+        s->nodes.push_back(new kv_raft(hosts[i], group, s->storages[i], s->states[i]));
+    }
+    for (auto node : s->nodes) {
+        node->start();
+    }
+    std::lock_guard<std::mutex> lock(mtx);
+    shards[group] = s;
+}
+
+void raft_kv::destroy_group(int group) {
+    std::shared_ptr<shard> s;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = shards.find(group);
+        if (it == shards.end()) {
+            return;
+        }
+        s = it->second;
+        shards.erase(it);
+    }
+    // the last user stops the nodes, a client may still wait on one of them
+}
+
+std::shared_ptr<raft_kv::shard> raft_kv::find_shard(int group) {
+    std::lock_guard<std::mutex> lock(mtx);
+    auto it = shards.find(group);
+    return it == shards.end() ? nullptr : it->second;
+}
+
+bool raft_kv::propose(shard &s, kv_command &cmd) {
+    int n = s.nodes.size(), hint = s.leader;
+    for (int k = 0; k < n; ++k) {
+        int i = (hint + k) % n, term, index;
+        if (s.nodes[i]->new_command(cmd, term, index)) {
+            s.leader = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool raft_kv::wait(kv_command &cmd, std::chrono::steady_clock::time_point deadline) {
+    std::unique_lock<std::mutex> lock(cmd.res->mtx);
+    return cmd.res->cv.wait_until(lock, deadline, [&]() { return cmd.res->done; });
+}
+
+bool raft_kv::execute(int group, kv_command &cmd, std::chrono::milliseconds timeout) {
+    std::shared_ptr<shard> s = find_shard(group);
+    return s && propose(*s, cmd) && wait(cmd, std::chrono::steady_clock::now() + timeout);
+}
+
+bool raft_kv::read(int group, kv_command &cmd, std::chrono::milliseconds timeout) {
+    std::shared_ptr<shard> s = find_shard(group);
+    if (!s) {
+        return false;
+    }
+    int n = s->nodes.size(), hint = s->leader;
+    for (int k = 0; k < n; ++k) {
+        int i = (hint + k) % n, index;
+        if (s->nodes[i]->read_index(index)) {
+            // everything committed before the call is applied
+            s->leader = i;
+            s->states[i]->read(cmd);
+            return true;
+        }
+    }
+    return propose(*s, cmd) && wait(cmd, std::chrono::steady_clock::now() + timeout);
+}
+
+bool raft_kv::execute_admin(int group, kv_command &cmd) {
+    std::shared_ptr<shard> s = find_shard(group);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (s && !propose(*s, cmd)) {
+        // e.g. a new group still electing
+        if (std::chrono::steady_clock::now() > deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    // appended, not proposed again: it may still commit
+    return s && wait(cmd, std::chrono::steady_clock::now() + std::chrono::seconds(10));
+}
+
+bool raft_kv::split(const std::string &key) {
+    std::lock_guard<std::mutex> lock(admin_mtx);
+    return split_locked(key);
+}
+
+bool raft_kv::split_locked(const std::string &key) {
+    if (!finish_handoff()) {
+        return false;
+    }
+    handoff h;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        const kv_route *r = table.find(key);
+        if (!r || r->range.lo == key) {
+            return false;
+        }
+        h = handoff{r->group, next_group, key, false};
+    }
+    // on disk before the group is, a restart finds it or undoes the split
+    ++next_group;
+    moving = h;
+    if (!save_routes()) {
+        moving.source = -1;
+        return false;
+    }
+    open_group(h.target);
+    finish_handoff();
+    std::lock_guard<std::mutex> lock(mtx);
+    return routed(h);
+}
+
+bool raft_kv::merge(const std::string &lo) {
+    std::lock_guard<std::mutex> lock(admin_mtx);
+    return merge_locked(lo);
+}
+
+bool raft_kv::merge_locked(const std::string &lo) {
+    if (!finish_handoff()) {
+        return false;
+    }
+    handoff h;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = table.routes.find(lo);
+        if (it == table.routes.end() || it == table.routes.begin()) {
+            return false;
+        }
+        int right = it->second.group;
+        h = handoff{right, (--it)->second.group, lo, true};
+    }
+    moving = h;
+    if (!save_routes()) {
+        moving.source = -1;
+        return false;
+    }
+    finish_handoff();
+    std::lock_guard<std::mutex> lock(mtx);
+    return routed(h);
+}
+
+bool raft_kv::routed(const handoff &h) {
+    if (h.merge) {
+        return !table.routes.count(h.key);
+    }
+    auto it = table.routes.find(h.key);
+    return it != table.routes.end() && it->second.group == h.target;
+}
+
+bool raft_kv::finish_handoff() {
+    handoff h = moving;
+    if (h.source < 0) {
+        return true;
+    }
+    bool moved;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        moved = routed(h);
+    }
+    // every step may have been done before, e.g. by a run cut short, each gives the same answer again
+    if (!moved) {
+        kv_command cut(kv_command::CMD_SPLIT, h.key, "");
+        if (!execute_admin(h.source, cut)) {
+            return false;
+        }
+        kv_command take(kv_command::CMD_INGEST, "", cut.res->value);
+        if (cut.res->succ && !execute_admin(h.target, take)) {
+            return false;
+        }
+        if (!cut.res->succ || !take.res->succ) {
+            // nothing was cut, or the target refused the piece and the source takes it back
+            kv_command back(kv_command::CMD_SPLIT_UNDO, h.key, "");
+            if (cut.res->succ && (!execute_admin(h.source, back) || !back.res->succ)) {
+                return false;
+            }
+            moving.source = -1;
+            while (!save_routes()) {}
+            if (!h.merge) {
+                destroy_group(h.target);
+            }
+            return true;
+        }
+
+        std::lock_guard<std::mutex> lock(mtx);
+        if (h.merge) {
+            auto right = table.routes.find(h.key);
+            std::prev(right)->second.range.hi = right->second.range.hi;
+            table.routes.erase(right);
+        } else {
+            kv_route &from = table.routes[table.find(h.key)->range.lo];
+            table.routes[h.key] = kv_route{kv_range(h.key, from.range.hi), h.target};
+            from.range.hi = h.key;
+        }
+        ++table.version;
+    }
+    // the table goes out first, the source drops its copy of the piece only then
+    if (!save_routes()) {
+        return false;
+    }
+    kv_command done(kv_command::CMD_SPLIT_DONE, h.key, "");
+    if (!execute_admin(h.source, done)) {
+        return false;
+    }
+    moving.source = -1;
+    while (!save_routes()) {}
+    if (h.merge) {
+        destroy_group(h.source);
+    }
+    return true;
+}
+
+bool raft_kv::save_routes() {
+    kv_route_table saved = route_table();
+    snapshot_writer writer;
+    std::string tmp = dir + "/routes.tmp", path = dir + "/routes";
+    bool ok = writer.open(tmp, saved.version, 0) && writer.write_int(next_group) &&
+              writer.write_int(saved.routes.size());
+    for (auto &route : saved.routes) {
+        const kv_range &range = route.second.range;
+        ok = ok && writer.write_int(route.second.group) && writer.write_int(range.lo.size()) &&
+             writer.write_int(range.hi.size()) && writer.write(range.lo.data(), range.lo.size()) &&
+             writer.write(range.hi.data(), range.hi.size());
+    }
+    ok = ok && writer.write_int(moving.source) && writer.write_int(moving.target) && writer.write_int(moving.merge) &&
+         writer.write_int(moving.key.size()) && writer.write(moving.key.data(), moving.key.size()) &&
+         writer.finish() && rename(tmp.c_str(), path.c_str()) == 0;
+    if (ok) {
+        int fd = open(dir.c_str(), O_RDONLY);
+        ok = fd >= 0 && fsync(fd) == 0;
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    return ok;
+}
+
+bool raft_kv::load_routes() {
+    snapshot_reader reader;
+    if (!reader.open(dir + "/routes") || !reader.verify()) {
+        return false;
+    }
+    int n, merge;
+    if (!reader.read_int(next_group) || !reader.read_int(n)) {
+        return false;
+    }
+    auto read_string = [&](std::string &str, int len) {
+        str.resize(std::max(len, 0));
+        return len >= 0 && (!len || reader.read(&str[0], len));
+    };
+    for (int i = 0; i < n; ++i) {
+        kv_route route;
+        int lo_s, hi_s;
+        if (!reader.read_int(route.group) || !reader.read_int(lo_s) || !reader.read_int(hi_s) ||
+            !read_string(route.range.lo, lo_s) || !read_string(route.range.hi, hi_s)) {
+            return false;
+        }
+        table.routes[route.range.lo] = route;
+    }
+    if (!reader.read_int(moving.source) || !reader.read_int(moving.target) || !reader.read_int(merge) ||
+        !reader.read_int(n) || !read_string(moving.key, n)) {
+        return false;
+    }
+    moving.merge = merge;
+    table.version = reader.last_included_index();
+    return true;
+}
+
+int raft_kv::balance(size_t max_bytes, long long max_ops, size_t min_bytes) {
+    std::lock_guard<std::mutex> lock(admin_mtx);
+    if (!finish_handoff()) {
+        return 0;
+    }
+    struct load {
+        kv_range range;
+        size_t bytes;
+        long long ops;
+        std::string split_key;
+    };
+    std::vector<load> loads;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (auto &route : table.routes) {
+            shard &s = *shards[route.second.group];
+            kv_state_machine *state = s.states[s.leader];
+            long long ops = state->ops();
+            loads.push_back(load{route.second.range, state->bytes(), ops - s.last_ops, ""});
+            s.last_ops = ops;
+            if ((max_bytes && loads.back().bytes > max_bytes) || (max_ops && loads.back().ops > max_ops)) {
+                loads.back().split_key = state->split_key();
+            }
+        }
+    }
+
+    int changes = 0;
+    // cold: small and under half the hot rate, a pair of them becomes one range
+    auto cold = [&](const load &l) {
+        return min_bytes && l.split_key.empty() && l.bytes < min_bytes && (!max_ops || 2 * l.ops < max_ops);
+    };
+    for (size_t i = 0; i < loads.size(); ++i) {
+        if (!loads[i].split_key.empty() && loads[i].split_key != loads[i].range.lo) {
+            changes += split_locked(loads[i].split_key);
+        } else if (i + 1 < loads.size() && cold(loads[i]) && cold(loads[i + 1])) {
+            changes += merge_locked(loads[i + 1].range.lo);
+            ++i;
+        }
+    }
+    return changes;
+}
+
+kv_client::kv_client(raft_kv *kv) : kv(kv), table(kv->route_table()), id(0), seq(0), stale(0) {
+    std::random_device rd;
+    while (!id) {
+        id = (unsigned long long) rd() << 32 | rd();
+    }
+}
+
+bool kv_client::execute(kv_command &cmd) {
+    // a write may commit after its try timed out, every try of it carries the same seq so that it applies once
+    if (cmd.cmd_tp == kv_command::CMD_PUT || cmd.cmd_tp == kv_command::CMD_DEL ||
+        cmd.cmd_tp == kv_command::CMD_DEL_RANGE) {
+        cmd.client = id;
+        cmd.seq = ++seq;
+    }
+    for (int attempt = 0; attempt < 100; ++attempt) {
+        const kv_route *route = table.find(cmd.key);
+        if (route) {
+            // a fresh result per try, a late answer to an earlier one is ignored
+            kv_command attempt_cmd(cmd.cmd_tp, cmd.key, cmd.value);
+            attempt_cmd.client = cmd.client;
+            attempt_cmd.seq = cmd.seq;
+            bool read = cmd.cmd_tp == kv_command::CMD_GET || cmd.cmd_tp == kv_command::CMD_SCAN;
+            bool done = read ? kv->read(route->group, attempt_cmd, std::chrono::milliseconds(1000)) :
+                        kv->execute(route->group, attempt_cmd, std::chrono::milliseconds(1000));
+            if (done && !attempt_cmd.res->not_my_range) {
+                cmd.res = attempt_cmd.res;
+                return true;
+            }
+            stale += done;
+        }
+        int version = table.version;
+        table = kv->route_table();
+        if (table.version == version) {
+            // a split or merge in flight, or no leader yet
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+    }
+    return false;
+}
+
+bool kv_client::put(const std::string &key, const std::string &value) {
+    kv_command cmd(kv_command::CMD_PUT, key, value);
+    return execute(cmd);
+}
+
+bool kv_client::get(const std::string &key, std::string &value) {
+    kv_command cmd(kv_command::CMD_GET, key, "");
+    if (!execute(cmd) || !cmd.res->succ) {
+        value = "";
+        return false;
+    }
+    value = cmd.res->value;
+    return true;
+}
+
+bool kv_client::del(const std::string &key) {
+    kv_command cmd(kv_command::CMD_DEL, key, "");
+    return execute(cmd) && cmd.res->succ;
+}
+
+bool kv_client::scan(const std::string &from, const std::string &to,
+                     std::vector<std::pair<std::string, std::string>> &entries) {
+    std::string next = from;
+    do {
+        // one range at a time, each stops at its end
+        kv_command cmd(kv_command::CMD_SCAN, next, to);
+        if (!execute(cmd)) {
+            return false;
+        }
+        entries.insert(entries.end(), cmd.res->entries.begin(), cmd.res->entries.end());
+        next = cmd.res->key;
+    } while (!next.empty());
+    return true;
+}
+
+bool kv_client::del_range(const std::string &from, const std::string &to, int &count) {
+    std::string next = from;
+    count = 0;
+    do {
+        kv_command cmd(kv_command::CMD_DEL_RANGE, next, to);
+        if (!execute(cmd)) {
+            return false;
+        }
+        count += std::stoi(cmd.res->value);
+        next = cmd.res->key;
+    } while (!next.empty());
+    return true;
+}
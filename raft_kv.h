@@ -0,0 +1,186 @@
+#ifndef raft_kv_h
+#define raft_kv_h
+
+#include <map>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "raft.h"
+#include "raft_host.h"
+#include "raft_state_machine.h"
+
+/**
+ * Range-sharded KV over multi-raft.
+ *
+ * The keyspace is cut into ranges, each served by a raft group with a replica on every host. The route table
+ * maps the ranges to their groups, a kv_state_machine serves only its range and fails other keys with
+ * not_my_range, so a client with a stale table routes again instead of reading the wrong shard.
+ *
+ * A split goes through the logs: CMD_SPLIT hands the upper keys off as a piece, which a new group takes over
+ * with CMD_INGEST. A merge hands the whole right range off the same way to its left neighbour and drops the
+ * group. The keys being moved are unavailable in between, their clients retry.
+ *
+ * Nothing of a handoff lives in memory only. The source keeps the piece in its state until CMD_SPLIT_DONE,
+ * after the route table was updated, or takes it back with CMD_SPLIT_UNDO if the target refuses it. The table
+ * is written to dir/routes together with the handoff under way, and every step can be repeated, so a handoff
+ * cut short by a timeout or a restart is finished by the next split, merge or balance, or by the constructor
+ * on the same dir.
+ * The hosts have to outlive it.
+ */
+struct kv_route {
+    kv_range range;
+    int group;
+};
+
+class kv_route_table {
+public:
+    int version;
+    std::map<std::string, kv_route> routes; // by range.lo
+
+    kv_route_table() : version(0) {}
+
+    // the route serving key, null if none does
+    const kv_route *find(const std::string &key) const;
+};
+
+class raft_kv {
+public:
+    typedef raft<kv_state_machine, kv_command> kv_raft;
+
+    // one group serving every key, its storage and that of later groups in dir, or the groups and routes
+    // found there
+    raft_kv(const std::vector<raft_host *> &hosts, const std::string &dir);
+
+    ~raft_kv();
+
+    kv_route_table route_table();
+
+    // run cmd on the group's leader and wait for its result, false without a leader or result in time
+    bool execute(int group, kv_command &cmd, std::chrono::milliseconds timeout);
+
+    // a CMD_GET or CMD_SCAN: the leader confirms with raft::read_index and answers from its state, only if
+    // no node can, cmd goes through the log as with execute
+    bool read(int group, kv_command &cmd, std::chrono::milliseconds timeout);
+
+    // split the range holding key, key becomes the lower bound of the new group's range.
+    // False also if an earlier handoff could not be finished yet.
+    bool split(const std::string &key);
+
+    // merge the range starting at lo into the range before it
+    bool merge(const std::string &lo);
+
+    // split the ranges above max_bytes, or above max_ops reads and writes since the last call, at their
+    // median key, merge adjacent ranges both under min_bytes, 0 turns a rule off. Returns the changes made.
+    int balance(size_t max_bytes, long long max_ops, size_t min_bytes);
+
+    kv_state_machine *state(int group, int node);
+
+private:
+    struct shard {
+        std::vector<kv_raft *> nodes;
+        std::vector<kv_state_machine *> states;
+        std::vector<raft_storage<kv_command> *> storages;
+        std::atomic<int> leader;    // hint
+        long long last_ops;         // for balance, guarded by admin_mtx
+
+        shard() : leader(0), last_ops(0) {}
+
+        // stops the nodes
+        ~shard();
+    };
+
+    // a split or merge under way, the piece from key up moves from source to target
+    struct handoff {
+        int source;     // -1 if none
+        int target;
+        std::string key;
+        bool merge;     // the source is dropped once it is over, a split target is dropped if it fails
+    };
+
+    std::vector<raft_host *> hosts;
+    std::string dir;
+
+    // Lock order: admin_mtx -> mtx
+    std::mutex admin_mtx;   // one split, merge or balance at a time, and the fields persisted with the table
+    std::mutex mtx;         // the route table and the shards
+    kv_route_table table;
+    std::map<int, std::shared_ptr<shard>> shards; // a client may still hold a dropped one
+    int next_group;
+    handoff moving;
+
+    // the group on every host, from its storage in dir if it was there before. Group 0 starts with
+    // every key, the others vacant.
+    void open_group(int group);
+
+    void destroy_group(int group);
+
+    std::shared_ptr<shard> find_shard(int group);
+
+    // append cmd on the leader, trying the hint first
+    bool propose(shard &s, kv_command &cmd);
+
+    bool wait(kv_command &cmd, std::chrono::steady_clock::time_point deadline);
+
+    // must hold admin_mtx, retries to propose until the group has a leader, but never proposes twice
+    bool execute_admin(int group, kv_command &cmd);
+
+    // must hold admin_mtx
+    bool split_locked(const std::string &key);
+
+    bool merge_locked(const std::string &lo);
+
+    // must hold admin_mtx, true once no handoff is under way. One that timed out is left for the next call.
+    bool finish_handoff();
+
+    // the table already routes the piece of h to its target, must hold mtx
+    bool routed(const handoff &h);
+
+    // write the table, next_group and the handoff to dir/routes, must hold admin_mtx
+    bool save_routes();
+
+    bool load_routes();
+};
+
+/**
+ * Routes with a cached copy of the table, refreshed on not_my_range or a key it has no route for.
+ * A write is tried again after a timeout, its random client id and seq let the shard apply it only once.
+ * One thread at a time.
+ */
+class kv_client {
+public:
+    explicit kv_client(raft_kv *kv);
+
+    bool put(const std::string &key, const std::string &value);
+
+    // false if the key is absent
+    bool get(const std::string &key, std::string &value);
+
+    // false if the key is absent
+    bool del(const std::string &key);
+
+    // the pairs in [from, to) in key order across the ranges, an empty to is unbounded
+    bool scan(const std::string &from, const std::string &to,
+              std::vector<std::pair<std::string, std::string>> &entries);
+
+    // delete [from, to) across the ranges, count says how many keys went
+    bool del_range(const std::string &from, const std::string &to, int &count);
+
+    // how often the cached table was stale
+    int refreshes() { return stale; }
+
+private:
+    raft_kv *kv;
+    kv_route_table table;
+    unsigned long long id;
+    unsigned int seq;   // of the last write
+    int stale;
+
+    // false if the command did not get through after several tries
+    bool execute(kv_command &cmd);
+};
+
+#endif // raft_kv_h
@@ -0,0 +1,136 @@
+#ifndef raft_log_h
+#define raft_log_h
+
+#include "raft_protocol.h"
+#include <memory>
+#include <vector>
+#include <cassert>
+
+/**
+ * In-memory raft log, a ring of reference counted immutable entries.
+ *
+ * Slot 0 is a dummy entry carrying the term of the snapshot, slots 1.. hold the entries after it.
+ * An entry is built once and then shared by AppendEntries, the storage encoder and the applier.
+ * Compaction advances the head of the ring and truncation pulls back its tail, nothing is shifted.
+ */
+template<typename command>
+class raft_log {
+public:
+    typedef log_entry_ptr<command> entry_ptr;
+
+    raft_log();
+
+    int size() const { return count; }
+
+    // encoded size of the commands in slots 1.., what a snapshot would free
+    long long bytes() const { return total_bytes; }
+
+    const log_entry<command> &operator[](int i) const { return *at(i); }
+
+    const entry_ptr &at(int i) const;
+
+    const log_entry<command> &back() const { return *at(count - 1); }
+
+    void push_back(const entry_ptr &ent);
+
+    // keep the first n slots, n >= 1
+    void resize(int n);
+
+    // drop the entries in slots 1..n, slot 0 then stands for a snapshot ending in `term`
+    void compact(int n, int term);
+
+    // only a snapshot ending in `term` remains
+    void reset(int term);
+
+    // replace the whole log, e.g. with the entries recovered from storage
+    void assign(const std::vector<log_entry<command>> &entries);
+
+private:
+    std::vector<entry_ptr> ring;    // capacity is a power of two
+    int head;
+    int count;
+    long long total_bytes;
+
+    int slot(int i) const { return (head + i) & (static_cast<int>(ring.size()) - 1); }
+
+    static entry_ptr make_dummy(int term);
+
+    static int entry_bytes(const entry_ptr &ent) { return ent->cmd.size(); }
+};
+
+template<typename command>
+raft_log<command>::raft_log() : ring(16), head(0), count(0), total_bytes(0) {
+    push_back(make_dummy(-1));
+}
+
+template<typename command>
+const typename raft_log<command>::entry_ptr &raft_log<command>::at(int i) const {
+    assert(i >= 0 && i < count);
+    return ring[slot(i)];
+}
+
+template<typename command>
+void raft_log<command>::push_back(const entry_ptr &ent) {
+    if (count == static_cast<int>(ring.size())) {
+        std::vector<entry_ptr> bigger(ring.size() * 2);
+        for (int i = 0; i < count; ++i) {
+            bigger[i].swap(ring[slot(i)]);
+        }
+        ring.swap(bigger);
+        head = 0;
+    }
+    ring[slot(count)] = ent;
+    if (count > 0) {
+        total_bytes += entry_bytes(ent);
+    }
+    ++count;
+}
+
+template<typename command>
+void raft_log<command>::resize(int n) {
+    assert(n >= 1 && n <= count);
+    for (int i = n; i < count; ++i) {
+        total_bytes -= entry_bytes(ring[slot(i)]);
+        ring[slot(i)].reset();
+    }
+    count = n;
+}
+
+template<typename command>
+void raft_log<command>::compact(int n, int term) {
+    assert(n >= 0 && n < count);
+    for (int i = 1; i <= n; ++i) {
+        total_bytes -= entry_bytes(ring[slot(i)]);
+    }
+    for (int i = 0; i < n; ++i) {
+        ring[slot(i)].reset();
+    }
+    head = slot(n);
+    count -= n;
+    ring[head] = make_dummy(term);
+}
+
+template<typename command>
+void raft_log<command>::reset(int term) {
+    resize(1);
+    ring[head] = make_dummy(term);
+}
+
+template<typename command>
+void raft_log<command>::assign(const std::vector<log_entry<command>> &entries) {
+    assert(!entries.empty());
+    resize(1);
+    ring[head] = std::make_shared<log_entry<command>>(entries[0]);
+    for (size_t i = 1; i < entries.size(); ++i) {
+        push_back(std::make_shared<log_entry<command>>(entries[i]));
+    }
+}
+
+template<typename command>
+typename raft_log<command>::entry_ptr raft_log<command>::make_dummy(int term) {
+    std::shared_ptr<log_entry<command>> ent = std::make_shared<log_entry<command>>();
+    ent->term = term;
+    return ent;
+}
+
+#endif // raft_log_h
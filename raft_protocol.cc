@@ -2,14 +2,14 @@
 
 marshall &operator<<(marshall &m, const request_vote_args &args) {
     // Your code here
-    m << args.candidate_id << args.current_term << args.last_log_index << args.last_log_term;
+    m << args.candidate_id << args.current_term << args.last_log_index << args.last_log_term << args.transfer;
     return m;
 
 }
 
 unmarshall &operator>>(unmarshall &u, request_vote_args &args) {
     // Your code here
-    u >> args.candidate_id >> args.current_term >> args.last_log_index >> args.last_log_term;
+    u >> args.candidate_id >> args.current_term >> args.last_log_index >> args.last_log_term >> args.transfer;
     return u;
 }
 
@@ -27,13 +27,13 @@ unmarshall &operator>>(unmarshall &u, request_vote_reply &reply) {
 
 marshall &operator<<(marshall &m, const append_entries_reply &reply) {
     // Your code here
-    m << reply.reply_term << reply.success;
+    m << reply.reply_term << reply.success << reply.conflict_term << reply.conflict_index << reply.match_index;
     return m;
 }
 
 unmarshall &operator>>(unmarshall &m, append_entries_reply &reply) {
     // Your code here
-    m >> reply.reply_term >> reply.success;
+    m >> reply.reply_term >> reply.success >> reply.conflict_term >> reply.conflict_index >> reply.match_index;
     return m;
 }
 
@@ -54,12 +54,64 @@ unmarshall &operator>>(unmarshall &u, install_snapshot_args &args) {
 
 marshall &operator<<(marshall &m, const install_snapshot_reply &reply) {
     // Your code here
-    m << reply.reply_term;
+    m << reply.reply_term << reply.installed << reply.next_offset;
     return m;
 }
 
 unmarshall &operator>>(unmarshall &u, install_snapshot_reply &reply) {
     // Your code here
+    u >> reply.reply_term >> reply.installed >> reply.next_offset;
+    return u;
+}
+
+marshall &operator<<(marshall &m, const timeout_now_args &args) {
+    m << args.leader_id << args.leader_term;
+    return m;
+}
+
+unmarshall &operator>>(unmarshall &u, timeout_now_args &args) {
+    u >> args.leader_id >> args.leader_term;
+    return u;
+}
+
+marshall &operator<<(marshall &m, const timeout_now_reply &reply) {
+    m << reply.reply_term;
+    return m;
+}
+
+unmarshall &operator>>(unmarshall &u, timeout_now_reply &reply) {
     u >> reply.reply_term;
     return u;
-}
\ No newline at end of file
+}
+
+marshall &operator<<(marshall &m, const heartbeat_args &args) {
+    m << args.group << args.leader_term << args.leader_id << args.prev_log_index << args.prev_log_term
+      << args.leader_commit_index;
+    return m;
+}
+
+unmarshall &operator>>(unmarshall &u, heartbeat_args &args) {
+    u >> args.group >> args.leader_term >> args.leader_id >> args.prev_log_index >> args.prev_log_term
+      >> args.leader_commit_index;
+    return u;
+}
+
+marshall &operator<<(marshall &m, const heartbeats_args &args) {
+    m << args.beats;
+    return m;
+}
+
+unmarshall &operator>>(unmarshall &u, heartbeats_args &args) {
+    u >> args.beats;
+    return u;
+}
+
+marshall &operator<<(marshall &m, const heartbeats_reply &reply) {
+    m << reply.replies;
+    return m;
+}
+
+unmarshall &operator>>(unmarshall &u, heartbeats_reply &reply) {
+    u >> reply.replies;
+    return u;
+}
@@ -3,13 +3,22 @@
 
 #include "rpc.h"
 #include "raft_state_machine.h"
+#include <memory>
 
 enum raft_rpc_opcodes {
     op_request_vote = 0x1212,
     op_append_entries = 0x3434,
-    op_install_snapshot = 0x5656
+    op_install_snapshot = 0x5656,
+    op_pre_vote = 0x7878,           // request_vote_args/reply for the term the candidate would start
+    op_timeout_now = 0x9a9a,
+    op_heartbeats = 0xbcbc          // a raft_host's heartbeats of every group for one node
 };
 
+// the groups of a raft_host share its server, the group id tags the opcodes, group 0 uses the plain ones
+inline unsigned int raft_opcode(raft_rpc_opcodes op, int group) {
+    return (unsigned int) op | ((unsigned int) group << 16);
+}
+
 enum raft_rpc_status {
     OK,
     RETRY,
@@ -25,6 +34,7 @@ public:
     int candidate_id;
     int last_log_index;
     int last_log_term;
+    bool transfer;              // the leader handed over with TimeoutNow, voters need not wait out its lease
 };
 
 marshall &operator<<(marshall &m, const request_vote_args &args);
@@ -43,25 +53,55 @@ marshall &operator<<(marshall &m, const request_vote_reply &reply);
 
 unmarshall &operator>>(unmarshall &u, request_vote_reply &reply);
 
+// membership of a group, a bit per node index into rpc_clients
+class raft_config {
+public:
+    unsigned voters;            // elect the leader and form every quorum
+    unsigned learners;          // get the log, but neither vote nor count towards a quorum
+
+    raft_config() : voters(0), learners(0) {}
+
+    raft_config(unsigned voters, unsigned learners) : voters(voters), learners(learners) {}
+
+    bool empty() const { return voters == 0; }
+
+    bool is_voter(int node) const { return (voters >> node) & 1; }
+
+    bool is_learner(int node) const { return (learners >> node) & 1; }
+
+    bool is_member(int node) const { return ((voters | learners) >> node) & 1; }
+
+    int num_voters() const { return __builtin_popcount(voters); }
+
+    bool operator==(const raft_config &other) const {
+        return voters == other.voters && learners == other.learners;
+    }
+};
+
 template<typename command>
 class log_entry {
 public:
     // Your code here
     int term;
     command cmd;
+    raft_config conf;           // set on configuration entries only, their cmd stays a default (no-op) command
 };
 
+// entries are immutable once built, the log, RPCs and the applier share them
+template<typename command>
+using log_entry_ptr = std::shared_ptr<const log_entry<command>>;
+
 template<typename command>
 marshall &operator<<(marshall &m, const log_entry<command> &entry) {
     // Your code here
-    m << entry.cmd << entry.term;
+    m << entry.cmd << entry.term << entry.conf.voters << entry.conf.learners;
     return m;
 }
 
 template<typename command>
 unmarshall &operator>>(unmarshall &u, log_entry<command> &entry) {
     // Your code here
-    u >> entry.cmd >> entry.term;
+    u >> entry.cmd >> entry.term >> entry.conf.voters >> entry.conf.learners;
     return u;
 }
 
@@ -74,7 +114,7 @@ public:
     int prev_log_index;
     int prev_log_term;
 
-    std::vector <log_entry<command>> entries;
+    std::vector <log_entry_ptr<command>> entries;
     int leader_commit_index;
 
 };
@@ -88,7 +128,8 @@ marshall &operator<<(marshall &m, const append_entries_args<command> &args) {
     m << size_;
 
     for (int i = 0; i < size_; ++i) {
-        m << args.entries[i].term << args.entries[i].cmd;
+        m << args.entries[i]->term << args.entries[i]->cmd << args.entries[i]->conf.voters
+          << args.entries[i]->conf.learners;
     }
     return m;
 }
@@ -102,8 +143,8 @@ unmarshall &operator>>(unmarshall &u, append_entries_args<command> &args) {
     int size_;
     u >> size_;
     for (int i = 0; i < size_; ++i) {
-        log_entry<command> t;
-        u >> t.term >> t.cmd;
+        std::shared_ptr<log_entry<command>> t = std::make_shared<log_entry<command>>();
+        u >> t->term >> t->cmd >> t->conf.voters >> t->conf.learners;
         args.entries.push_back(t);
     }
 
@@ -115,6 +156,15 @@ public:
     // Your code here
     int reply_term;
     bool success;
+
+    // on rejection, where the leader should resume:
+    // conflict_term is the follower's term at prev_log_index and conflict_index its first index in that term,
+    // or conflict_term == -1 and conflict_index is the first index the follower can take
+    int conflict_term;
+    int conflict_index;
+
+    // on success, the last index the follower holds as sent and has on disk
+    int match_index;
 };
 
 marshall &operator<<(marshall &m, const append_entries_reply &reply);
@@ -129,10 +179,10 @@ public:
     int leader_id;
     int last_included_index;
     int last_included_term;
-    int offset;
+    int offset;                 // where data starts in the snapshot file
 
-    std::vector<char> data;
-    bool done;
+    std::vector<char> data;     // one chunk of the snapshot
+    bool done;                  // data is the last chunk
 };
 
 marshall &operator<<(marshall &m, const install_snapshot_args &args);
@@ -144,6 +194,8 @@ class install_snapshot_reply {
 public:
     // Your code here
     int reply_term;
+    bool installed;             // the follower holds a snapshot at least as new now
+    int next_offset;            // bytes of this snapshot the follower has staged, the leader resumes there
 };
 
 marshall &operator<<(marshall &m, const install_snapshot_reply &reply);
@@ -151,4 +203,61 @@ marshall &operator<<(marshall &m, const install_snapshot_reply &reply);
 unmarshall &operator>>(unmarshall &m, install_snapshot_reply &reply);
 
 
+class timeout_now_args {
+public:
+    int leader_term;
+    int leader_id;
+};
+
+marshall &operator<<(marshall &m, const timeout_now_args &args);
+
+unmarshall &operator>>(unmarshall &u, timeout_now_args &args);
+
+
+class timeout_now_reply {
+public:
+    int reply_term;
+};
+
+marshall &operator<<(marshall &m, const timeout_now_reply &reply);
+
+unmarshall &operator>>(unmarshall &u, timeout_now_reply &reply);
+
+
+// an empty AppendEntries of one group
+class heartbeat_args {
+public:
+    int group;
+    int leader_term;
+    int leader_id;
+    int prev_log_index;
+    int prev_log_term;
+    int leader_commit_index;
+};
+
+marshall &operator<<(marshall &m, const heartbeat_args &args);
+
+unmarshall &operator>>(unmarshall &u, heartbeat_args &args);
+
+
+class heartbeats_args {
+public:
+    std::vector<heartbeat_args> beats;
+};
+
+marshall &operator<<(marshall &m, const heartbeats_args &args);
+
+unmarshall &operator>>(unmarshall &u, heartbeats_args &args);
+
+
+class heartbeats_reply {
+public:
+    std::vector<append_entries_reply> replies;  // one per beat, reply_term -1 if the group is not here
+};
+
+marshall &operator<<(marshall &m, const heartbeats_reply &reply);
+
+unmarshall &operator>>(unmarshall &u, heartbeats_reply &reply);
+
+
 #endif // raft_protocol_h
\ No newline at end of file
@@ -0,0 +1,344 @@
+#ifndef raft_snapshot_h
+#define raft_snapshot_h
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstddef>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+
+/**
+ * CRC32 (IEEE 802.3) used to detect torn or corrupted log entries and snapshot blocks.
+ */
+static inline uint32_t raft_crc32(const char *buf, size_t len, uint32_t crc = 0) {
+    static uint32_t table[256];
+    static bool table_ready = ([]() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = (c & 1) ? (0xedb88320u ^ (c >> 1)) : (c >> 1);
+            }
+            table[i] = c;
+        }
+        return true;
+    })();
+    (void) table_ready;
+
+    crc = ~crc;
+    for (size_t i = 0; i < len; ++i) {
+        crc = table[(crc ^ (uint8_t) buf[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/**
+ * On-disk snapshot format.
+ *
+ * A fixed header {magic, version, last_included_index, last_included_term, block_size, crc} is followed
+ * by blocks of at most block_size payload bytes, each prefixed with {size, crc}, and by an end block
+ * {0, snapshot_end_mark}. The payload is whatever the state machine writes. Readers and writers only
+ * ever hold one block in memory, and every block sits at a known place in the file, so the file can
+ * be streamed, sent in raw chunks or mapped as it is.
+ */
+struct snapshot_header {
+    uint32_t magic;
+    int version;
+    int last_included_index;
+    int last_included_term;
+    int block_size;
+    uint32_t crc;               // of the fields above
+};
+
+static const uint32_t snapshot_magic = 0x504e5352;  // "RSNP"
+static const int snapshot_version = 1;
+static const uint32_t snapshot_end_mark = 0xffffffffu;
+
+class snapshot_writer {
+public:
+    static const int default_block_size = 64 * 1024;
+
+    snapshot_writer() : fd(-1), offset(0), block_size(default_block_size) {}
+
+    ~snapshot_writer() { abort(); }
+
+    // create or replace the file and write the header
+    bool open(const std::string &path, int last_included_index, int last_included_term,
+              int block_size = default_block_size);
+
+    bool write(const void *buf, size_t len);
+
+    bool write_int(int value) { return write(&value, sizeof(value)); }
+
+    // write the last block and the end block and fdatasync, the file is complete once it returns true
+    bool finish();
+
+    // give up the file, it is left incomplete
+    void abort();
+
+private:
+    snapshot_writer(const snapshot_writer &);
+    snapshot_writer &operator=(const snapshot_writer &);
+
+    bool write_raw(const char *buf, size_t len);
+
+    bool flush_block();
+
+    int fd;
+    off_t offset;
+    int block_size;
+    std::string block;          // payload of the block being filled
+};
+
+class snapshot_reader {
+public:
+    snapshot_reader() : fd(-1), header(), offset(0), cursor(0), at_end(false) {}
+
+    ~snapshot_reader() { close(); }
+
+    // open the file and check its header, the reader keeps reading this file even if it gets replaced
+    bool open(const std::string &path);
+
+    bool is_open() const { return fd >= 0; }
+
+    int last_included_index() const { return header.last_included_index; }
+
+    int last_included_term() const { return header.last_included_term; }
+
+    // read exactly len payload bytes, fails on a short or corrupted file
+    bool read(void *buf, size_t len);
+
+    bool read_int(int &value) { return read(&value, sizeof(value)); }
+
+    // read the rest of the payload at once, for state machines that cannot consume it incrementally
+    bool read_all(std::vector<char> &data);
+
+    // every payload byte has been read
+    bool eof();
+
+    // check every block and the end block, then rewind to the first payload byte
+    bool verify();
+
+    void close();
+
+private:
+    snapshot_reader(const snapshot_reader &);
+    snapshot_reader &operator=(const snapshot_reader &);
+
+    bool read_raw(char *buf, size_t len);
+
+    // load the next block, false at the end block or on corruption
+    bool next_block();
+
+    int fd;
+    snapshot_header header;
+    off_t offset;               // file offset of the next block
+    std::string block;          // payload of the current block
+    size_t cursor;              // read position in it
+    bool at_end;
+};
+
+inline bool snapshot_writer::open(const std::string &path, int last_included_index, int last_included_term,
+                                  int block_size) {
+    abort();
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    this->block_size = block_size > 0 ? block_size : default_block_size;
+    offset = 0;
+    block.clear();
+
+    snapshot_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = snapshot_magic;
+    header.version = snapshot_version;
+    header.last_included_index = last_included_index;
+    header.last_included_term = last_included_term;
+    header.block_size = this->block_size;
+    header.crc = raft_crc32((const char *) &header, offsetof(snapshot_header, crc));
+    return write_raw((const char *) &header, sizeof(header));
+}
+
+inline bool snapshot_writer::write(const void *buf, size_t len) {
+    const char *p = (const char *) buf;
+    while (len > 0) {
+        if (fd < 0) {
+            return false;
+        }
+        size_t n = std::min(len, (size_t) block_size - block.size());
+        block.append(p, n);
+        p += n;
+        len -= n;
+        if ((int) block.size() == block_size && !flush_block()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline bool snapshot_writer::finish() {
+    if (fd < 0 || (!block.empty() && !flush_block())) {
+        abort();
+        return false;
+    }
+    uint32_t end[2] = {0, snapshot_end_mark};
+    bool ok = write_raw((const char *) end, sizeof(end)) && fdatasync(fd) == 0;
+    ::close(fd);
+    fd = -1;
+    return ok;
+}
+
+inline void snapshot_writer::abort() {
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+inline bool snapshot_writer::flush_block() {
+    uint32_t head[2] = {(uint32_t) block.size(), raft_crc32(block.data(), block.size())};
+    bool ok = write_raw((const char *) head, sizeof(head)) && write_raw(block.data(), block.size());
+    block.clear();
+    return ok;
+}
+
+inline bool snapshot_writer::write_raw(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+inline bool snapshot_reader::open(const std::string &path) {
+    close();
+    fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    offset = 0;
+    if (!read_raw((char *) &header, sizeof(header)) || header.magic != snapshot_magic ||
+        header.version != snapshot_version || header.block_size <= 0 ||
+        header.crc != raft_crc32((const char *) &header, offsetof(snapshot_header, crc))) {
+        close();
+        return false;
+    }
+    block.clear();
+    cursor = 0;
+    at_end = false;
+    return true;
+}
+
+inline bool snapshot_reader::read(void *buf, size_t len) {
+    char *p = (char *) buf;
+    while (len > 0) {
+        if (cursor == block.size() && !next_block()) {
+            return false;
+        }
+        size_t n = std::min(len, block.size() - cursor);
+        memcpy(p, block.data() + cursor, n);
+        cursor += n;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+inline bool snapshot_reader::read_all(std::vector<char> &data) {
+    data.clear();
+    while (!eof()) {
+        data.insert(data.end(), block.begin() + cursor, block.end());
+        cursor = block.size();
+    }
+    // eof() also stops at a corrupted block, only the end block means the whole payload is there
+    return at_end;
+}
+
+inline bool snapshot_reader::eof() {
+    while (cursor == block.size() && !at_end) {
+        if (!next_block()) {
+            break;
+        }
+    }
+    return cursor == block.size();
+}
+
+inline bool snapshot_reader::verify() {
+    if (fd < 0) {
+        return false;
+    }
+    off_t first = sizeof(snapshot_header);
+    offset = first;
+    block.clear();
+    cursor = 0;
+    at_end = false;
+    while (next_block()) {
+        cursor = block.size();
+    }
+    bool ok = at_end;
+    offset = first;
+    block.clear();
+    cursor = 0;
+    at_end = false;
+    return ok;
+}
+
+inline void snapshot_reader::close() {
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+inline bool snapshot_reader::next_block() {
+    if (fd < 0 || at_end) {
+        return false;
+    }
+    uint32_t head[2];
+    if (!read_raw((char *) head, sizeof(head))) {
+        return false;
+    }
+    if (head[0] == 0) {
+        at_end = head[1] == snapshot_end_mark;
+        return false;
+    }
+    if (head[0] > (uint32_t) header.block_size) {
+        return false;
+    }
+    block.resize(head[0]);
+    if (!read_raw(&block[0], block.size()) || raft_crc32(block.data(), block.size()) != head[1]) {
+        block.clear();
+        cursor = 0;
+        return false;
+    }
+    cursor = 0;
+    return true;
+}
+
+inline bool snapshot_reader::read_raw(char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = pread(fd, buf, len, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+#endif // raft_snapshot_h
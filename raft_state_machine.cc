@@ -1,5 +1,7 @@
 #include "raft_state_machine.h"
 
+#include <algorithm>
+
 /******************************************************************
 
                         Tool function
@@ -57,88 +59,130 @@ void get_int_num(const char *buf, int &value) {
     value |= buf[3] & 0xff;
 }
 
+// LEB128: 7 bits a byte, the high bit says more follow
+int varint_len(unsigned long long value) {
+    int n = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        ++n;
+    }
+    return n;
+}
+
+int put_varint(char *buf, unsigned long long value) {
+    int n = 0;
+    while (value >= 0x80) {
+        buf[n++] = (char) (value | 0x80);
+        value >>= 7;
+    }
+    buf[n++] = (char) value;
+    return n;
+}
+
+bool get_varint(const char *buf, int size, int &cursor, unsigned long long &value) {
+    value = 0;
+    for (int shift = 0; shift < 70 && cursor < size; shift += 7) {
+        unsigned char c = buf[cursor++];
+        value |= (unsigned long long) (c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 /******************************************************************
 
                         My code below
 
 *******************************************************************/
 
-kv_command::kv_command() : kv_command(CMD_NONE, "", "") {}
+// in the type of a command that carries client and seq
+static const unsigned int session_flag = 0x40;
+
+// a command_type, session_flag aside
+static bool known_type(unsigned long long tp) {
+    return (tp & ~(unsigned long long) session_flag) <= kv_command::CMD_SPLIT_UNDO;
+}
+
+kv_command::kv_command() : cmd_tp(CMD_NONE), client(0), seq(0) {}
 
 kv_command::kv_command(command_type tp, const std::string &key, const std::string &value) :
-        cmd_tp(tp), key(key), value(value), res(std::make_shared<result>()) {
+        cmd_tp(tp), key(key), value(value), client(0), seq(0), res(std::make_shared<result>()) {
     res->start = std::chrono::system_clock::now();
     res->key = key;
 }
 
 kv_command::kv_command(const kv_command &cmd) :
-        cmd_tp(cmd.cmd_tp), key(cmd.key), value(cmd.value), res(cmd.res) {}
+        cmd_tp(cmd.cmd_tp), key(cmd.key), value(cmd.value), client(cmd.client), seq(cmd.seq), res(cmd.res) {}
 
 kv_command::~kv_command() {}
 
 int kv_command::size() const {
     // Your code here:
-    if (cmd_tp == CMD_NONE) {
-        return 0;
-    }
-    int ret = static_cast<int>(3 * sizeof(int) + key.size() + value.size());
-    return ret;
+    return header_size() + key.size() + value.size();
+}
+
+int kv_command::header_size() const {
+    int n = varint_len(cmd_tp) + varint_len(key.size()) + varint_len(value.size());
+    return client ? n + varint_len(client) + varint_len(seq) : n;
 }
 
+int kv_command::put_header(char *buf) const {
+    int cursor = put_varint(buf, client ? cmd_tp | session_flag : cmd_tp);
+    cursor += put_varint(buf + cursor, key.size());
+    cursor += put_varint(buf + cursor, value.size());
+    if (client) {
+        cursor += put_varint(buf + cursor, client);
+        cursor += put_varint(buf + cursor, seq);
+    }
+    return cursor;
+}
 
 void kv_command::serialize(char *buf, int size) const {
     // Your code here:
-    if (size != this->size() || cmd_tp == CMD_NONE) {
+    if (size != this->size()) {
         return;
     }
-
-    int cursor = 0;
-    put_int_num((buf + cursor), (int)cmd_tp);
-    cursor += sizeof(int);
-    put_int_num((buf + cursor), key.size());
-    cursor += sizeof(int);
-    put_int_num((buf + cursor), value.size());
-    cursor += sizeof(int);
-    memcpy((buf + cursor), key.c_str(), key.size());
+    int cursor = put_header(buf);
+    key.copy(buf + cursor, key.size());
     cursor += key.size();
-    memcpy((buf + cursor), value.c_str(), value.size());
-    cursor += value.size();
-    assert(cursor == size);
-    return;
+    value.copy(buf + cursor, value.size());
 }
 
 void kv_command::deserialize(const char *buf, int size) {
     // Your code here:
-    if (size == 0) {
+    // straight into key and value, their buffers are reused and short ones need none
+    unsigned long long tp, key_size, value_size, session_client = 0, session_seq = 0;
+    int cursor = 0;
+    if (!get_varint(buf, size, cursor, tp) || !get_varint(buf, size, cursor, key_size) ||
+        !get_varint(buf, size, cursor, value_size) ||
+        ((tp & session_flag) && (!get_varint(buf, size, cursor, session_client) ||
+                                 !get_varint(buf, size, cursor, session_seq))) ||
+        !known_type(tp) || key_size > (unsigned long long) (size - cursor) ||
+        value_size != (size - cursor) - key_size) {
+        cmd_tp = CMD_NONE;
+        client = 0;
+        key.clear();
+        value.clear();
         return;
     }
-    int key_size, value_size;
-
-    int cursor = 0, cmd_int_tp = 0;
-    get_int_num((buf + cursor), cmd_int_tp);
-    cmd_tp = (command_type)cmd_int_tp;
-    cursor += sizeof(int);
-    get_int_num((buf + cursor), key_size);
-    cursor += sizeof(int);
-    get_int_num((buf + cursor), value_size);
-    cursor += sizeof(int);
-
-    char *key_array = new char[key_size], *value_array = new char[value_size];
-    memcpy(key_array, (buf + cursor), key_size);
-    cursor += key_size;
-    memcpy(value_array, (buf + cursor), value_size);
-    cursor += value_size;
-
-    key = key_size == 0 ? "" : std::string(key_array, key_size);
-    value = value_size == 0 ? "" : std::string(value_array, value_size);
-    delete[]key_array;
-    delete[]value_array;
+    cmd_tp = (command_type) (tp & ~session_flag);
+    client = session_client;
+    seq = session_seq;
+    key.assign(buf + cursor, key_size);
+    value.assign(buf + cursor + key_size, value_size);
+}
 
-//    assert(cursor == size);
-    if(size != cursor){
-        printf("What the fuck! %d, %d", size, cursor);
+std::string kv_command::prefix_end(const std::string &prefix) {
+    std::string end = prefix;
+    while (!end.empty() && (unsigned char) end.back() == 0xff) {
+        end.pop_back();
     }
-    return;
+    if (!end.empty()) {
+        end.back() = (char) ((unsigned char) end.back() + 1);
+    }
+    return end;
 }
 
 void kv_command::set_command_type(int type) {
@@ -147,18 +191,58 @@ void kv_command::set_command_type(int type) {
 
 marshall &operator<<(marshall &m, const kv_command &cmd) {
     // Your code here:
-    m << (int) cmd.cmd_tp << cmd.key << cmd.value;
+    // the bytes of serialize(), the lengths make them self-delimiting
+    char header[50];
+    m.rawbytes(header, cmd.put_header(header));
+    m.rawbytes(cmd.key.data(), cmd.key.size());
+    m.rawbytes(cmd.value.data(), cmd.value.size());
     return m;
 }
 
+// get_varint() on an unmarshall, false if it ran out or the varint does not end
+static bool unmarshall_varint(unmarshall &u, unsigned long long &value) {
+    value = 0;
+    for (int shift = 0; shift < 70; shift += 7) {
+        unsigned long long c = u.rawbyte() & 0xff;
+        if (!u.ok()) {
+            return false;
+        }
+        value |= (c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 unmarshall &operator>>(unmarshall &u, kv_command &cmd) {
     // Your code here:
-    int tp;
-    u >> tp >> cmd.key >> cmd.value;
-    cmd.set_command_type(tp);
+    // the checks of deserialize(), a malformed command fails u and decodes as CMD_NONE
+    unsigned long long tp, key_size, value_size, session_client = 0, session_seq = 0;
+    if (!unmarshall_varint(u, tp) || !unmarshall_varint(u, key_size) || !unmarshall_varint(u, value_size) ||
+        ((tp & session_flag) && (!unmarshall_varint(u, session_client) || !unmarshall_varint(u, session_seq))) ||
+        !known_type(tp) || key_size > (unsigned long long) (u.size() - u.ind()) ||
+        value_size > (unsigned long long) (u.size() - u.ind()) - key_size) {
+        u.fail();
+        cmd.cmd_tp = kv_command::CMD_NONE;
+        cmd.client = 0;
+        cmd.key.clear();
+        cmd.value.clear();
+        return u;
+    }
+    u.rawbytes(cmd.key, key_size);
+    u.rawbytes(cmd.value, value_size);
+    cmd.set_command_type(tp & ~session_flag);
+    cmd.client = session_client;
+    cmd.seq = session_seq;
     return u;
 }
 
+kv_state_machine::kv_state_machine() : kv_state_machine(kv_range()) {}
+
+kv_state_machine::kv_state_machine(const kv_range &range) :
+        sessions(std::make_shared<session_map>()), served(range), data_bytes(0), applied_ops(0) {}
+
 kv_state_machine::~kv_state_machine() {
 
 }
@@ -167,120 +251,648 @@ kv_state_machine::~kv_state_machine() {
 std::vector<char> kv_state_machine::snapshot() {
     // Your code here:
     mtx.lock();
-    int snapshot_size = sizeof(int), n = mp.size();
-    for (auto &s: mp) {
-        snapshot_size += 2 * sizeof(int);
-        snapshot_size += s.first.size();
-        snapshot_size += s.second.size();
+    kv_map view = mp;
+    kv_range range = served;
+    std::shared_ptr<const session_map> clients = sessions;
+    handoff_map pieces = outgoing;
+    mtx.unlock();
+    return serialize(range, view, *clients, pieces);
+}
+
+std::function<bool(snapshot_writer &)> kv_state_machine::snapshot_view() {
+    // the sessions are shared until the next write clones them, the pieces themselves are never copied
+    mtx.lock();
+    kv_map view = mp;
+    kv_range range = served;
+    std::shared_ptr<const session_map> clients = sessions;
+    handoff_map pieces = outgoing;
+    mtx.unlock();
+    return [view, range, clients, pieces](snapshot_writer &writer) {
+        return write_map(range, view, *clients, pieces, writer);
+    };
+}
+
+bool kv_state_machine::write_map(const kv_range &range, const kv_map &m, const session_map &clients,
+                                 const handoff_map &pieces, snapshot_writer &writer) {
+    // the same layout as serialize(), streamed
+    bool ok = writer.write_int(range.vacant) && writer.write_int(range.lo.size()) &&
+              writer.write_int(range.hi.size()) && writer.write(range.lo.data(), range.lo.size()) &&
+              writer.write(range.hi.data(), range.hi.size()) && writer.write_int(m.size());
+    m.scan("", "", [&](const std::string &key, const std::string &value) {
+        ok = ok && writer.write_int(key.size()) && writer.write_int(value.size()) &&
+             writer.write(key.data(), key.size()) && writer.write(value.data(), value.size());
+        return ok;
+    });
+    ok = ok && writer.write_int(clients.size());
+    for (auto &c : clients) {
+        const session &last = c.second;
+        ok = ok && writer.write_int((int) (c.first >> 32)) && writer.write_int((int) c.first) &&
+             writer.write_int(last.seq) && writer.write_int(last.succ) && writer.write_int(last.key.size()) &&
+             writer.write_int(last.value.size()) && writer.write_int((int) (last.touched >> 32)) &&
+             writer.write_int((int) last.touched) && writer.write(last.key.data(), last.key.size()) &&
+             writer.write(last.value.data(), last.value.size());
+    }
+    ok = ok && writer.write_int(pieces.size());
+    for (auto &piece : pieces) {
+        ok = ok && writer.write_int(piece.first.size()) && writer.write_int(piece.second->size()) &&
+             writer.write(piece.first.data(), piece.first.size()) &&
+             writer.write(piece.second->data(), piece.second->size());
+    }
+    return ok;
+}
+
+bool kv_state_machine::load_snapshot(snapshot_reader &reader) {
+    kv_map restored;
+    kv_range range;
+    int vacant, lo_s, hi_s, n;
+    if (!reader.read_int(vacant) || !reader.read_int(lo_s) || !reader.read_int(hi_s) || lo_s < 0 || hi_s < 0) {
+        return false;
+    }
+    range.vacant = vacant;
+    range.lo.resize(lo_s);
+    range.hi.resize(hi_s);
+    if ((lo_s && !reader.read(&range.lo[0], lo_s)) || (hi_s && !reader.read(&range.hi[0], hi_s)) ||
+        !reader.read_int(n)) {
+        return false;
+    }
+    std::string key, value;
+    for (int i = 0; i < n; ++i) {
+        int key_s, value_s;
+        if (!reader.read_int(key_s) || !reader.read_int(value_s) || key_s < 0 || value_s < 0) {
+            return false;
+        }
+        key.resize(key_s);
+        value.resize(value_s);
+        if ((key_s && !reader.read(&key[0], key_s)) || (value_s && !reader.read(&value[0], value_s))) {
+            return false;
+        }
+        restored.put(key, value);
+    }
+    // older snapshots end with the pairs
+    std::shared_ptr<session_map> clients = std::make_shared<session_map>();
+    n = 0;
+    if (!reader.eof() && !reader.read_int(n)) {
+        return false;
+    }
+    for (int i = 0; i < n; ++i) {
+        int hi, lo, seq, succ, key_s, value_s, touched_hi, touched_lo;
+        if (!reader.read_int(hi) || !reader.read_int(lo) || !reader.read_int(seq) || !reader.read_int(succ) ||
+            !reader.read_int(key_s) || !reader.read_int(value_s) || !reader.read_int(touched_hi) ||
+            !reader.read_int(touched_lo) || key_s < 0 || value_s < 0) {
+            return false;
+        }
+        session &last = (*clients)[(unsigned long long) (unsigned int) hi << 32 | (unsigned int) lo];
+        last.seq = seq;
+        last.succ = succ;
+        last.touched = (unsigned long long) (unsigned int) touched_hi << 32 | (unsigned int) touched_lo;
+        last.key.resize(key_s);
+        last.value.resize(value_s);
+        if ((key_s && !reader.read(&last.key[0], key_s)) || (value_s && !reader.read(&last.value[0], value_s))) {
+            return false;
+        }
+    }
+    handoff_map pieces;
+    n = 0;
+    if (!reader.eof() && !reader.read_int(n)) {
+        return false;
+    }
+    for (int i = 0; i < n; ++i) {
+        int lo_s, piece_s;
+        if (!reader.read_int(lo_s) || !reader.read_int(piece_s) || lo_s < 0 || piece_s < 0) {
+            return false;
+        }
+        key.resize(lo_s);
+        value.resize(piece_s);
+        if ((lo_s && !reader.read(&key[0], lo_s)) || (piece_s && !reader.read(&value[0], piece_s))) {
+            return false;
+        }
+        pieces[key] = std::make_shared<const std::string>(value);
+    }
+    size_t restored_bytes = count_bytes(restored);
+    mtx.lock();
+    mp = restored;
+    served = range;
+    sessions = clients;
+    outgoing.swap(pieces);
+    reindex_locked();
+    data_bytes = restored_bytes;
+    mtx.unlock();
+    return true;
+}
+
+std::vector<char> kv_state_machine::serialize(const kv_range &range, const kv_map &m,
+                                              const session_map &clients, const handoff_map &pieces) {
+    int snapshot_size = 6 * sizeof(int) + range.lo.size() + range.hi.size(), n = m.size();
+    m.scan("", "", [&](const std::string &key, const std::string &value) {
+        snapshot_size += 2 * sizeof(int) + key.size() + value.size();
+        return true;
+    });
+    for (auto &c : clients) {
+        snapshot_size += 8 * sizeof(int) + c.second.key.size() + c.second.value.size();
+    }
+    for (auto &piece : pieces) {
+        snapshot_size += 2 * sizeof(int) + piece.first.size() + piece.second->size();
     }
-    char *arr = new char[snapshot_size];
+    std::vector<char> data(snapshot_size);
+    char *arr = data.data();
     int cursor = 0;
+    put_int_num((arr + cursor), range.vacant);
+    cursor += sizeof(int);
+    put_int_num((arr + cursor), range.lo.size());
+    cursor += sizeof(int);
+    put_int_num((arr + cursor), range.hi.size());
+    cursor += sizeof(int);
+    range.lo.copy((arr + cursor), range.lo.size());
+    cursor += range.lo.size();
+    range.hi.copy((arr + cursor), range.hi.size());
+    cursor += range.hi.size();
     put_int_num((arr + cursor), n);
     cursor += sizeof(int);
 
-    for (auto &s: mp) {
-        put_int_num((arr + cursor), s.first.size());
+    // in key order, neighbouring snapshots differ where the state did
+    m.scan("", "", [&](const std::string &key, const std::string &value) {
+        put_int_num((arr + cursor), key.size());
         cursor += sizeof(int);
-        put_int_num((arr + cursor), s.second.size());
+        put_int_num((arr + cursor), value.size());
         cursor += sizeof(int);
 
-        s.first.copy((arr + cursor), s.first.size());
-        cursor += s.first.size();
-        s.second.copy((arr + cursor), s.second.size());
-        cursor += s.second.size();
+        key.copy((arr + cursor), key.size());
+        cursor += key.size();
+        value.copy((arr + cursor), value.size());
+        cursor += value.size();
+        return true;
+    });
+
+    put_int_num((arr + cursor), clients.size());
+    cursor += sizeof(int);
+    for (auto &c : clients) {
+        const session &last = c.second;
+        int fields[8] = {(int) (c.first >> 32), (int) c.first, (int) last.seq, last.succ, (int) last.key.size(),
+                         (int) last.value.size(), (int) (last.touched >> 32), (int) last.touched};
+        for (int field : fields) {
+            put_int_num((arr + cursor), field);
+            cursor += sizeof(int);
+        }
+        last.key.copy((arr + cursor), last.key.size());
+        cursor += last.key.size();
+        last.value.copy((arr + cursor), last.value.size());
+        cursor += last.value.size();
     }
-    assert(cursor == snapshot_size);
 
-    mtx.unlock();
-    std::string data(arr, snapshot_size);
-    return std::vector<char>(data.begin(), data.end());
+    put_int_num((arr + cursor), pieces.size());
+    cursor += sizeof(int);
+    for (auto &piece : pieces) {
+        put_int_num((arr + cursor), piece.first.size());
+        cursor += sizeof(int);
+        put_int_num((arr + cursor), piece.second->size());
+        cursor += sizeof(int);
+        piece.first.copy((arr + cursor), piece.first.size());
+        cursor += piece.first.size();
+        piece.second->copy((arr + cursor), piece.second->size());
+        cursor += piece.second->size();
+    }
+    assert(cursor == snapshot_size);
+    return data;
 }
 
 void kv_state_machine::apply_snapshot(const std::vector<char> &snapshot) {
     // Your code here:
+    kv_map restored;
+    kv_range range;
+    std::shared_ptr<session_map> clients = std::make_shared<session_map>();
+    handoff_map pieces;
+    if (!deserialize(snapshot, range, restored, *clients, pieces)) {
+        return;
+    }
+    size_t restored_bytes = count_bytes(restored);
+    // the snapshot replaces the state, views taken before keep the old map
     mtx.lock();
-    std::string s(snapshot.begin(), snapshot.end());
-    auto ptr = s.c_str();
+    mp = restored;
+    served = range;
+    sessions = clients;
+    outgoing.swap(pieces);
+    reindex_locked();
+    data_bytes = restored_bytes;
+    mtx.unlock();
+    return;
+}
 
-    int snapshot_size, cursor = 0;
-    get_int_num(ptr + cursor, snapshot_size);
-    cursor += sizeof(int);
-    for (int i = 0; i < snapshot_size; ++i) {
-        int key_s, value_s;
-        get_int_num((ptr + cursor), key_s);
-        cursor += sizeof(int);
-        get_int_num((ptr + cursor), value_s);
+bool kv_state_machine::deserialize(const std::vector<char> &data, kv_range &range, kv_map &m,
+                                   session_map &clients, handoff_map &pieces) {
+    auto ptr = data.data();
+    int size = data.size(), cursor = 0;
+    // every length is checked against what is left, a piece arrives in a log entry
+    auto take = [&](std::string &s, int len) {
+        if (len < 0 || len > size - cursor) {
+            return false;
+        }
+        s.assign(ptr + cursor, len);
+        cursor += len;
+        return true;
+    };
+    auto take_int = [&](int &value) {
+        if ((int) sizeof(int) > size - cursor) {
+            return false;
+        }
+        get_int_num(ptr + cursor, value);
         cursor += sizeof(int);
+        return true;
+    };
 
-        char *k = new char[key_s], *v = new char[value_s];
-        memcpy(k, (ptr + cursor), key_s);
-        cursor += key_s;
-        memcpy(v, (ptr + cursor), value_s);
-        cursor += value_s;
+    int vacant, lo_s, hi_s, n;
+    if (!take_int(vacant) || !take_int(lo_s) || !take_int(hi_s) || !take(range.lo, lo_s) ||
+        !take(range.hi, hi_s) || !take_int(n)) {
+        return false;
+    }
+    range.vacant = vacant;
+    if (n < 0 || n > (size - cursor) / (2 * (int) sizeof(int))) {
+        return false;
+    }
+    std::string key, value;
+    for (int i = 0; i < n; ++i) {
+        int key_s, value_s;
+        if (!take_int(key_s) || !take_int(value_s) || !take(key, key_s) || !take(value, value_s)) {
+            return false;
+        }
+        m.put(key, value);
+    }
+    // older snapshots end with the pairs
+    if (cursor == size) {
+        return true;
+    }
+    if (!take_int(n) || n < 0 || n > (size - cursor) / (8 * (int) sizeof(int))) {
+        return false;
+    }
+    for (int i = 0; i < n; ++i) {
+        int hi, lo, seq, succ, key_s, value_s, touched_hi, touched_lo;
+        if (!take_int(hi) || !take_int(lo) || !take_int(seq) || !take_int(succ) || !take_int(key_s) ||
+            !take_int(value_s) || !take_int(touched_hi) || !take_int(touched_lo)) {
+            return false;
+        }
+        session &last = clients[(unsigned long long) (unsigned int) hi << 32 | (unsigned int) lo];
+        last.seq = seq;
+        last.succ = succ;
+        last.touched = (unsigned long long) (unsigned int) touched_hi << 32 | (unsigned int) touched_lo;
+        if (!take(last.key, key_s) || !take(last.value, value_s)) {
+            return false;
+        }
+    }
+    if (cursor == size) {
+        return true;
+    }
+    if (!take_int(n) || n < 0 || n > (size - cursor) / (2 * (int) sizeof(int))) {
+        return false;
+    }
+    for (int i = 0; i < n; ++i) {
+        int lo_s, piece_s;
+        if (!take_int(lo_s) || !take_int(piece_s) || !take(key, lo_s) || !take(value, piece_s)) {
+            return false;
+        }
+        pieces[key] = std::make_shared<const std::string>(value);
+    }
+    return cursor == size;
+}
+
+size_t kv_state_machine::count_bytes(const kv_map &m) {
+    size_t n = 0;
+    m.scan("", "", [&](const std::string &key, const std::string &value) {
+        n += key.size() + value.size();
+        return true;
+    });
+    return n;
+}
 
-        std::string key(k, key_s), value(v, value_s);
-        mp.insert({key, value});
+bool kv_state_machine::get(const std::string &key, std::string &value) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (!mp.get(key, value)) {
+        value = "";
+        return false;
     }
-    mtx.unlock();
-    return;
+    return true;
+}
+
+void kv_state_machine::scan(const std::string &from, const std::string &to,
+                            std::vector<std::pair<std::string, std::string>> &entries) {
+    std::unique_lock<std::mutex> lock(mtx);
+    kv_map view = mp;
+    lock.unlock();
+    view.scan(from, to, [&](const std::string &key, const std::string &value) {
+        entries.push_back({key, value});
+        return true;
+    });
+}
+
+void kv_state_machine::read(kv_command &kv_cmd) {
+    std::lock_guard<std::mutex> lock(mtx);
+    kv_command::result &res = *kv_cmd.res;
+    std::lock_guard<std::mutex> res_lock(res.mtx);
+    ++applied_ops;
+    res.not_my_range = !served.contains(kv_cmd.key);
+    res.key = kv_cmd.key;
+    res.value = "";
+    res.succ = false;
+    if (!res.not_my_range && kv_cmd.cmd_tp == kv_command::CMD_SCAN) {
+        scan_locked(kv_cmd, res);
+    } else if (!res.not_my_range) {
+        res.succ = mp.get(kv_cmd.key, res.value);
+    }
+    res.done = true;
 }
 
 void kv_state_machine::apply_log(raft_command &cmd) {
-    kv_command &kv_cmd = dynamic_cast<kv_command &>(cmd);
-    std::unique_lock <std::mutex> lock(kv_cmd.res->mtx);
     mtx.lock();
+    apply_locked(dynamic_cast<kv_command &>(cmd));
+    mtx.unlock();
+}
+
+void kv_state_machine::apply_logs(const std::vector<raft_command *> &cmds) {
+    mtx.lock();
+    for (auto cmd : cmds) {
+        apply_locked(dynamic_cast<kv_command &>(*cmd));
+    }
+    mtx.unlock();
+}
+
+void kv_state_machine::apply_locked(kv_command &kv_cmd) {
+    // a command from the log or an RPC has nobody waiting, its result goes to the scratch one
+    kv_command::result &res = kv_cmd.res ? *kv_cmd.res : scratch;
+    std::unique_lock <std::mutex> lock(res.mtx);
     // Your code here:
+    // a piece still kept is below the range, a CMD_SPLIT asked again gets it once more
+    bool keyed = kv_cmd.cmd_tp != kv_command::CMD_NONE && kv_cmd.cmd_tp != kv_command::CMD_INGEST &&
+                 kv_cmd.cmd_tp != kv_command::CMD_SPLIT_DONE && kv_cmd.cmd_tp != kv_command::CMD_SPLIT_UNDO &&
+                 !(kv_cmd.cmd_tp == kv_command::CMD_SPLIT && outgoing.count(kv_cmd.key));
+    if (keyed) {
+        applied_ops += kv_cmd.cmd_tp != kv_command::CMD_SPLIT;
+        if (!served.contains(kv_cmd.key)) {
+            res.succ = false;
+            res.not_my_range = true;
+            res.key = kv_cmd.key;
+            res.value = "";
+            res.done = true;
+            res.cv.notify_all();
+            return;
+        }
+    }
+    if (kv_cmd.client) {
+        auto it = sessions->find(kv_cmd.client);
+        if (it != sessions->end() && kv_cmd.seq <= it->second.seq) {
+            // a retry gets the result of the first time, an older write was given up on by its client
+            bool retry = kv_cmd.seq == it->second.seq;
+            res.succ = retry && it->second.succ;
+            res.key = retry ? it->second.key : kv_cmd.key;
+            res.value = retry ? it->second.value : "";
+            res.done = true;
+            res.cv.notify_all();
+            return;
+        }
+    }
+    std::string old_value;
+    bool found = false;
+    if (kv_cmd.cmd_tp == kv_command::CMD_GET || kv_cmd.cmd_tp == kv_command::CMD_PUT ||
+        kv_cmd.cmd_tp == kv_command::CMD_DEL) {
+        found = mp.get(kv_cmd.key, old_value);
+    }
     switch (kv_cmd.cmd_tp) {
         case kv_command::CMD_NONE:
             break;
+        case kv_command::CMD_SPLIT:
+            split_locked(kv_cmd, res);
+            break;
+        case kv_command::CMD_INGEST:
+            res.key = "";
+            adopt_locked(kv_cmd.value, res);
+            break;
+        case kv_command::CMD_SPLIT_DONE:
+            outgoing.erase(kv_cmd.key);
+            res.succ = true;
+            res.key = kv_cmd.key;
+            res.value = "";
+            break;
+        case kv_command::CMD_SPLIT_UNDO:
+            res.key = kv_cmd.key;
+            res.value = "";
+            res.succ = false;
+            if (outgoing.count(kv_cmd.key)) {
+                adopt_locked(*outgoing[kv_cmd.key], res);
+                if (res.succ) {
+                    outgoing.erase(kv_cmd.key);
+                }
+            }
+            break;
+        case kv_command::CMD_SCAN:
+        case kv_command::CMD_DEL_RANGE:
+            scan_locked(kv_cmd, res);
+            break;
         case kv_command::CMD_GET:
 
-            if (mp.count(kv_cmd.key)) {
-                kv_cmd.res->succ = true;
-                kv_cmd.res->key = kv_cmd.key;
-                kv_cmd.res->value = mp[kv_cmd.key];
-                printf("Get %s, found %s\n", kv_cmd.key.c_str(), mp[kv_cmd.key].c_str());
+            if (found) {
+                res.succ = true;
+                res.key = kv_cmd.key;
+                res.value = old_value;
+                printf("Get %s, found %s\n", kv_cmd.key.c_str(), old_value.c_str());
             } else {
-                kv_cmd.res->succ = false;
-                kv_cmd.res->key = kv_cmd.key;
-                kv_cmd.res->value = "";
+                res.succ = false;
+                res.key = kv_cmd.key;
+                res.value = "";
                 printf("Get %s, Not found\n", kv_cmd.key.c_str());
             }
             break;
         case kv_command::CMD_DEL:
-            if (mp.count(kv_cmd.key)) {
-                kv_cmd.res->succ = true;
-                kv_cmd.res->key = kv_cmd.key;
-                kv_cmd.res->value = mp[kv_cmd.key];
-                printf("DEL %s, found %s\n", kv_cmd.key.c_str(), mp[kv_cmd.key].c_str());
+            if (found) {
+                res.succ = true;
+                res.key = kv_cmd.key;
+                res.value = old_value;
+                printf("DEL %s, found %s\n", kv_cmd.key.c_str(), old_value.c_str());
+                data_bytes -= kv_cmd.key.size() + old_value.size();
                 mp.erase(kv_cmd.key);
             } else {
-                kv_cmd.res->succ = false;
-                kv_cmd.res->key = kv_cmd.key;
-                kv_cmd.res->value = "";
+                res.succ = false;
+                res.key = kv_cmd.key;
+                res.value = "";
                 printf("Get %s, Not found\n", kv_cmd.key.c_str());
             }
             break;
         case kv_command::CMD_PUT:
-            if (mp.count(kv_cmd.key)) {
-                kv_cmd.res->succ = false;
-                kv_cmd.res->key = kv_cmd.key;
-                kv_cmd.res->value = mp[kv_cmd.key];
-
-                mp[kv_cmd.key] = (kv_cmd.value);
-                printf("PUT %s, found %s, replace\n", kv_cmd.key.c_str(), mp[kv_cmd.key].c_str());
+            if (found) {
+                res.succ = false;
+                res.key = kv_cmd.key;
+                res.value = old_value;
+
+                data_bytes += kv_cmd.value.size() - old_value.size();
+                mp.put(kv_cmd.key, kv_cmd.value);
+                printf("PUT %s, found %s, replace\n", kv_cmd.key.c_str(), kv_cmd.value.c_str());
             } else {
-                kv_cmd.res->succ = true;
-                kv_cmd.res->key = kv_cmd.key;
-                kv_cmd.res->value = kv_cmd.value;
-                mp.insert({kv_cmd.key, kv_cmd.value});
-                printf("PUT %s, found %s\n", kv_cmd.key.c_str(), mp[kv_cmd.key].c_str());
+                res.succ = true;
+                res.key = kv_cmd.key;
+                res.value = kv_cmd.value;
+                data_bytes += kv_cmd.key.size() + kv_cmd.value.size();
+                mp.put(kv_cmd.key, kv_cmd.value);
+                printf("PUT %s, found %s\n", kv_cmd.key.c_str(), kv_cmd.value.c_str());
             }
             break;
     }
-    kv_cmd.res->done = true;
-    kv_cmd.res->cv.notify_all();
-    mtx.unlock();
+    if (kv_cmd.client) {
+        remember_locked(kv_cmd.client, session{kv_cmd.seq, res.succ, res.key, res.value, 0});
+    }
+    res.done = true;
+    res.cv.notify_all();
     return;
 }
 
+void kv_state_machine::scan_locked(kv_command &kv_cmd, kv_command::result &res) {
+    // clipped to the range, key tells where the next range goes on
+    std::string to = kv_cmd.value;
+    res.key = "";
+    if (!served.hi.empty() && (to.empty() || to > served.hi)) {
+        to = served.hi;
+        res.key = served.hi;
+    }
+    res.entries.clear();
+    if (kv_cmd.cmd_tp == kv_command::CMD_SCAN) {
+        mp.scan(kv_cmd.key, to, [&](const std::string &key, const std::string &value) {
+            res.entries.push_back({key, value});
+            return true;
+        });
+        res.succ = !res.entries.empty();
+        res.value = "";
+        return;
+    }
+
+    size_t erased_bytes = 0;
+    mp.scan(kv_cmd.key, to, [&](const std::string &key, const std::string &value) {
+        erased_bytes += key.size() + value.size();
+        return true;
+    });
+    size_t erased = mp.erase_range(kv_cmd.key, to);
+    data_bytes -= erased_bytes;
+    res.succ = erased > 0;
+    res.value = std::to_string(erased);
+}
+
+void kv_state_machine::split_locked(kv_command &kv_cmd, kv_command::result &res) {
+    res.key = kv_cmd.key;
+    res.value = "";
+    auto kept = outgoing.find(kv_cmd.key);
+    if (kept != outgoing.end()) {
+        res.succ = true;
+        res.value = *kept->second;
+        return;
+    }
+
+    kv_range piece(kv_cmd.key, served.hi);
+    kv_map moved;
+    mp.scan(piece.lo, piece.hi, [&](const std::string &key, const std::string &value) {
+        data_bytes -= key.size() + value.size();
+        moved.put(key, value);
+        return true;
+    });
+    mp.erase_range(piece.lo, piece.hi);
+    served.hi = kv_cmd.key;
+    served.vacant = kv_cmd.key == served.lo;
+    // the writes already applied to the moved keys must not be applied again where they go
+    std::vector<char> data = serialize(piece, moved, *sessions, handoff_map());
+    res.succ = true;
+    res.value.assign(data.begin(), data.end());
+    outgoing[kv_cmd.key] = std::make_shared<const std::string>(res.value);
+}
+
+void kv_state_machine::adopt_locked(const std::string &data, kv_command::result &res) {
+    res.value = "";
+    res.succ = false;
+    kv_range piece;
+    kv_map adopted;
+    session_map clients;
+    handoff_map none;
+    if (!deserialize(std::vector<char>(data.begin(), data.end()), piece, adopted, clients, none) || piece.vacant) {
+        return;
+    }
+    if (!served.vacant && piece.lo >= served.lo &&
+        (served.hi.empty() || (!piece.hi.empty() && piece.hi <= served.hi))) {
+        // taken over before, the handoff is being finished again
+        res.succ = true;
+        return;
+    }
+    if (served.vacant) {
+        served = piece;
+    } else if (!served.hi.empty() && served.hi == piece.lo) {
+        served.hi = piece.hi;
+    } else {
+        // not adjacent, the keys in between would have no owner
+        res.not_my_range = true;
+        return;
+    }
+    adopted.scan("", "", [&](const std::string &key, const std::string &value) {
+        data_bytes += key.size() + value.size();
+        mp.put(key, value);
+        return true;
+    });
+    // the clients moved along count as writing now, their order where they came from means nothing here
+    for (auto &c : clients) {
+        auto it = sessions->find(c.first);
+        if (it == sessions->end() || it->second.seq < c.second.seq) {
+            remember_locked(c.first, c.second);
+        }
+    }
+    res.succ = true;
+}
+
+void kv_state_machine::remember_locked(unsigned long long client, session last) {
+    if (sessions.use_count() > 1) {
+        sessions = std::make_shared<session_map>(*sessions);
+    }
+    auto it = sessions->find(client);
+    if (it != sessions->end()) {
+        by_age.erase(it->second.touched);
+    }
+    last.touched = by_age.empty() ? 1 : by_age.rbegin()->first + 1;
+    by_age[last.touched] = client;
+    (*sessions)[client] = last;
+    while (sessions->size() > max_sessions) {
+        sessions->erase(by_age.begin()->second);
+        by_age.erase(by_age.begin());
+    }
+}
+
+void kv_state_machine::reindex_locked() {
+    by_age.clear();
+    for (auto &c : *sessions) {
+        by_age[c.second.touched] = c.first;
+    }
+}
+
+kv_range kv_state_machine::range() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return served;
+}
+
+size_t kv_state_machine::bytes() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return data_bytes;
+}
+
+long long kv_state_machine::ops() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return applied_ops;
+}
+
+int kv_state_machine::handoffs() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return outgoing.size();
+}
+
+std::string kv_state_machine::split_key() {
+    std::unique_lock<std::mutex> lock(mtx);
+    kv_map view = mp;
+    lock.unlock();
+    if (view.size() < 2) {
+        return "";
+    }
+    std::string median;
+    size_t skip = view.size() / 2;
+    view.scan("", "", [&](const std::string &key, const std::string &) {
+        median = key;
+        return skip-- > 0;
+    });
+    return median;
+}
@@ -2,6 +2,8 @@
 #define raft_state_machine_h
 
 #include "rpc.h"
+#include "raft_snapshot.h"
+#include "kv_btree.h"
 #include <vector>
 #include <map>
 #include <string>
@@ -10,6 +12,7 @@
 #include <atomic>
 #include <condition_variable>
 #include <unordered_map>
+#include <functional>
 #include <string.h>
 
 class raft_command {
@@ -29,10 +32,37 @@ public:
     // Apply a log to the state machine.
     virtual void apply_log(raft_command&) = 0;
 
+    // Apply a batch of consecutive logs, in order.
+    // Override it to pay the locking once per batch instead of once per log.
+    virtual void apply_logs(const std::vector<raft_command*> &cmds) {
+        for (auto cmd : cmds) {
+            apply_log(*cmd);
+        }
+    }
+
     // Generate a snapshot of the current state.
     virtual std::vector<char> snapshot() = 0;
     // Apply the snapshot to the state mahine.
     virtual void apply_snapshot(const std::vector<char>&) = 0;
+
+    // Capture the current state and return a function that writes that point-in-time view later.
+    // It is called while no log is being applied, the returned function runs on another thread meanwhile
+    // new logs are applied. Override it when the state can be frozen cheaper than serialized.
+    virtual std::function<bool(snapshot_writer &)> snapshot_view() {
+        std::vector<char> data = snapshot();
+        return [data](snapshot_writer &writer) { return writer.write(data.data(), data.size()); };
+    }
+
+    // Replace the state with a snapshot read from disk.
+    // Override it to consume the snapshot incrementally instead of holding the whole of it in memory.
+    virtual bool load_snapshot(snapshot_reader &reader) {
+        std::vector<char> data;
+        if (!reader.read_all(data)) {
+            return false;
+        }
+        apply_snapshot(data);
+        return true;
+    }
 };
 
 
@@ -42,7 +72,13 @@ public:
         CMD_NONE, // Do nothing
         CMD_GET, // Get a key-value pair
         CMD_PUT, // Put a key-value pair
-        CMD_DEL  // Delete a key-value pair
+        CMD_DEL, // Delete a key-value pair
+        CMD_SCAN, // Get the pairs from key up to value, exclusive, an empty value is unbounded
+        CMD_DEL_RANGE, // Delete the pairs from key up to value, the same bounds as a scan
+        CMD_SPLIT, // Hand the keys from key up off, the range keeps those below and the piece until one of:
+        CMD_INGEST, // Take over the piece in value, a CMD_SPLIT result, next to or instead of the range
+        CMD_SPLIT_DONE, // The piece handed off at key has a new owner, drop it
+        CMD_SPLIT_UNDO // Take the piece handed off at key back
     };
 
     struct result {
@@ -54,8 +90,18 @@ public:
         // Del       F      key      ""
         // Put       T      key   new_value
         // Put  F(replace)  key   old_value
+        // Scan     T/F     next      ""      entries, F if none
+        // DelRange T/F     next    count     F if none
+        // Split     T      key     piece    the same piece again while it is kept
+        // Ingest    T      ""       ""      T also if the range holds the piece already
+        // SplitDone T      key      ""
+        // SplitUndo T/F    key      ""      F if no piece was handed off at key
+        // A key outside the range fails with not_my_range, route it again. A scan or range delete stops at
+        // the end of the range, next is where to go on then, "" once done.
         std::string key, value;
+        std::vector<std::pair<std::string, std::string>> entries;
         bool succ;
+        bool not_my_range;
         bool done;
         std::mutex mtx; // protect the struct
         std::condition_variable cv; // notify the caller
@@ -63,6 +109,9 @@ public:
 
     kv_command();
     kv_command(command_type tp, const std::string& key, const std::string& value);
+
+    // the upper bound of a scan over the keys starting with prefix, "" if unbounded
+    static std::string prefix_end(const std::string &prefix);
     kv_command(const kv_command &);
 
     virtual ~kv_command();
@@ -70,14 +119,25 @@ public:
 
     command_type cmd_tp;
     std::string key, value;
-    std::shared_ptr<result> res;
+    // 0, or the kv_client's id and the number of its write: a retry of a write that was applied already
+    // gets the result of that time and is not applied again
+    unsigned long long client;
+    unsigned int seq;
+    std::shared_ptr<result> res; // null on commands decoded from the log or an RPC
     
     virtual int size() const override;
     virtual void serialize(char* buf, int size) const override;
+    // A malformed or empty buffer decodes as CMD_NONE with no key, value or client, which applies as nothing.
     virtual void deserialize(const char* buf, int size) override;
 
     void set_command_type(int type);
 
+    // the varint type, lengths, client and seq in front of key and value, shared by serialize and the marshall
+    // operators. client and seq are left out if client is 0.
+    int header_size() const;
+
+    int put_header(char *buf) const;
+
 private:
 
 
@@ -86,22 +146,140 @@ private:
 marshall& operator<<(marshall &m, const kv_command& cmd);
 unmarshall& operator>>(unmarshall &u, kv_command& cmd);
 
+// The keys [lo, hi) a kv_state_machine serves, an empty hi is unbounded. A vacant range serves no key.
+struct kv_range {
+    std::string lo, hi;
+    bool vacant;
+
+    kv_range() : vacant(false) {}
+
+    kv_range(const std::string &lo, const std::string &hi) : lo(lo), hi(hi), vacant(false) {}
+
+    static kv_range none() {
+        kv_range range;
+        range.vacant = true;
+        return range;
+    }
+
+    bool contains(const std::string &key) const {
+        return !vacant && key >= lo && (hi.empty() || key < hi);
+    }
+};
+
 class kv_state_machine : public raft_state_machine {
 public:
+    // serves every key
+    kv_state_machine();
+
+    // a shard, e.g. a vacant one waiting for CMD_INGEST
+    explicit kv_state_machine(const kv_range &range);
+
     virtual ~kv_state_machine();
 
     // Apply a log to the state machine.
     virtual void apply_log(raft_command&) override;
 
+    // Apply a batch of logs under one lock.
+    virtual void apply_logs(const std::vector<raft_command*> &cmds) override;
+
     // Generate a snapshot of the current state.
     virtual std::vector<char> snapshot() override;
 
     // Apply the snapshot to the state mahine.
     virtual void apply_snapshot(const std::vector<char>&) override;
 
+    // Copy-on-write: the view shares the tree, a write clones only the nodes on its path, and the sessions and the
+    // kept pieces, the first write after the view clones the session table.
+    virtual std::function<bool(snapshot_writer &)> snapshot_view() override;
+
+    // Build the map pair by pair from the file.
+    virtual bool load_snapshot(snapshot_reader &reader) override;
+
+    // Read the applied state directly, e.g. after raft::read_index, instead of applying a CMD_GET.
+    bool get(const std::string &key, std::string &value);
+
+    // the pairs in [from, to) in key order, an empty to is unbounded
+    void scan(const std::string &from, const std::string &to,
+              std::vector<std::pair<std::string, std::string>> &entries);
+
+    // Answer a CMD_GET or CMD_SCAN from the applied state as applying it would, range included, e.g. after
+    // raft::read_index.
+    void read(kv_command &kv_cmd);
+
+    // Load of the shard, to decide on splits and merges.
+    kv_range range();
+
+    // bytes of the keys and values
+    size_t bytes();
+
+    // reads and writes applied since the start, not part of the state
+    long long ops();
+
+    // the median key, where a split halves the shard, "" with less than two keys
+    std::string split_key();
+
+    // pieces handed off and kept until their CMD_SPLIT_DONE or CMD_SPLIT_UNDO
+    int handoffs();
+
 private:
+    // the ordered engine, swap in another with the same interface
+    typedef kv_btree kv_map;
+
+    // the last write of a client and its result, part of the state: a retry answers from it
+    struct session {
+        unsigned int seq;
+        bool succ;
+        std::string key, value;
+        unsigned long long touched;     // when the client last wrote, the order sessions are dropped in
+    };
+    typedef std::map<unsigned long long, session> session_map;
+
+    // At most max_sessions clients are remembered, the one that wrote least recently is dropped first. A retry
+    // arriving after its client was dropped applies again, so a client gives up on a write long before
+    // max_sessions other clients could have written.
+    static const size_t max_sessions = 10000;
+
+    // the CMD_SPLIT pieces still kept, by their lower bound, shared with the snapshot views
+    typedef std::map<std::string, std::shared_ptr<const std::string>> handoff_map;
+
+    // must hold mtx
+    void apply_locked(kv_command &kv_cmd);
+
+    // must hold mtx
+    void scan_locked(kv_command &kv_cmd, kv_command::result &res);
+
+    void split_locked(kv_command &kv_cmd, kv_command::result &res);
+
+    // take over a CMD_SPLIT piece, for CMD_INGEST and CMD_SPLIT_UNDO
+    void adopt_locked(const std::string &data, kv_command::result &res);
+
+    // Copy-on-write: clones the sessions if a snapshot view still shares them, then records the write of
+    // client and drops the least recent clients beyond max_sessions. must hold mtx
+    void remember_locked(unsigned long long client, session last);
+
+    // the age index of the sessions just loaded, must hold mtx
+    void reindex_locked();
+
+    // the range, the map, the sessions and the pieces kept, also the format of a CMD_SPLIT piece which keeps none
+    static std::vector<char> serialize(const kv_range &range, const kv_map &m, const session_map &clients,
+                                       const handoff_map &pieces);
+
+    static bool deserialize(const std::vector<char> &data, kv_range &range, kv_map &m, session_map &clients,
+                            handoff_map &pieces);
+
+    static bool write_map(const kv_range &range, const kv_map &m, const session_map &clients,
+                          const handoff_map &pieces, snapshot_writer &writer);
+
+    static size_t count_bytes(const kv_map &m);
 
-    std::unordered_map<std::string, std::string> mp;
+    kv_map mp;
+    std::shared_ptr<session_map> sessions;  // the recent clients, the moved keys take a copy along
+    std::map<unsigned long long, unsigned long long> by_age;    // touched to client, rebuilt on a load
+    handoff_map outgoing;   // the keys handed off live on here until the handoff is over
+    kv_command::result scratch;
+    kv_range served;
+    size_t data_bytes;
+    long long applied_ops;
 
     std::mutex mtx;
 };
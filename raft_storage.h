@@ -2,153 +2,449 @@
 #define raft_storage_h
 
 #include "raft_protocol.h"
+#include "raft_snapshot.h"
 #include <fcntl.h>
+#include <climits>
 #include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <string>
+#include <algorithm>
+#include <functional>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+
+struct raft_storage_options {
+    int segment_size;           // roll over to a new segment file after this many bytes
+    int max_batch_delay_us;     // how long the log writer waits for more appends before flushing
+    int max_batch_bytes;        // flush right away once this many bytes are pending
+
+    raft_storage_options() :
+            segment_size(4 * 1024 * 1024), max_batch_delay_us(100), max_batch_bytes(256 * 1024) {}
+};
+
+struct raft_storage_stats {
+    long long batches;          // number of write + fdatasync rounds
+    long long entries;          // entries flushed by those rounds
+    long long bytes;
+    long long max_batch_entries;
+    long long fsync_total_us;
+    long long fsync_max_us;
+};
 
+/**
+ * Persistent state of a raft node.
+ *
+ * meta.rft keeps (vote_for, term) and is overwritten in place.
+ * The log is a write-ahead log split into fixed-size segments (log_<seq>.rft). Every entry is
+ * stored as a header {index, term, size, voters, learners, crc} followed by the serialized command (the
+ * membership masks are 0 except on configuration entries), so the log is
+ * only ever appended to; a conflicting suffix is removed by cutting the tail of one segment and
+ * unlinking the segments after it, and compaction simply unlinks segments covered by the snapshot.
+ * snapshot.rft holds the latest snapshot in the format of raft_snapshot.h, its header names the
+ * last included index and term. A new snapshot is written aside and renamed over it once synced.
+ *
+ * append() only queues the encoded entries. A log writer thread gathers everything queued since
+ * its last round and persists it with a single write + fdatasync (group commit), callers that
+ * need durability wait for it with wait_durable() or force it with flush(). truncate_suffix() queues
+ * the cut the same way, the writer makes it on disk before it writes what was appended after it.
+ */
 template<typename command>
 class raft_storage {
 public:
-    raft_storage(const std::string &file_dir);
+    raft_storage(const std::string &file_dir, const raft_storage_options &opt = raft_storage_options());
 
     ~raft_storage();
 
     // Your code here
+    // recover term, vote and every entry after the snapshot, call recover_snapshot first
     void recovery(int &current_term, int &vote_for, std::vector <log_entry<command>> &logs);
 
+    // open the snapshot for the state machine to stream it in, the reader stays closed if there is none
     void recover_snapshot(int &last_included_index, std::vector <log_entry<command>> &logs,
-                          std::vector<char> &snapshot_data);
+                          snapshot_reader &reader);
 
-    bool install_snapshot(const int &last_included_index, const std::vector <log_entry<command>> &logs,
-                          const std::vector<char> &snapshot_data);
+    // write the snapshot through `write` and persist it durably, then drop the segments it covers,
+    // an older snapshot than the current is ignored
+    bool install_snapshot(const int &last_included_index, const int &last_included_term,
+                          const std::function<bool(snapshot_writer &)> &write);
 
-//    bool append_log(const int &idx, const log_entry<command> &log);
+    // read at most len bytes of the snapshot from offset, fails once it no longer ends at last_included_index
+    bool read_snapshot(const int &last_included_index, const int &offset, const int &len,
+                       std::vector<char> &data, bool &done);
 
-    bool update(const int &term, const int &vote_for, const std::vector <log_entry<command>> &log);
+    // write a received chunk into the staging file of the snapshot (last_included_index, last_included_term)
+    // sent by a leader of `source` term, returns how many bytes of it are staged, i.e. where to resume
+    int stage_snapshot(const int &last_included_index, const int &last_included_term, const int &source,
+                       const int &offset, const std::vector<char> &data);
 
-//    bool truncate_log(const int &idx);
+    // the staged snapshot is complete: check it, persist it as the snapshot like install_snapshot and open it
+    bool install_staged_snapshot(snapshot_reader &reader);
 
-    bool update_term(const int &term);
+    // append entries[offset..] to the log, the first of them has raft index `index`
+    bool append(const int &index, const std::vector <log_entry<command>> &entries, int offset = 0);
 
-    bool update_vote(const int &vote_for);
+    bool append(const int &index, const std::vector <log_entry_ptr<command>> &entries, int offset = 0);
 
-    bool update_meta(const int &vote_for, const int &term);
+    bool append(const int &index, const log_entry<command> &entry);
 
-//    void truncate_file_directly(int idx);
+    // drop every entry whose raft index >= index
+    bool truncate_suffix(const int &index);
 
-private:
-    std::mutex mtx;
+    bool persist_meta(const int &term, const int &vote_for);
+
+    // write and fdatasync everything appended so far
+    bool flush();
+
+    // block until the entry at `index` is durable, returns false if it was truncated meanwhile.
+    // With cuts from cut_count(), also false once any cut came after that count was taken: the entry at
+    // `index` may have been cut and appended again in one go, it is then not the one the caller appended.
+    bool wait_durable(const int &index, const long long &cuts = -1);
+
+    int durable_index();
 
+    // how many cuts were made so far
+    long long cut_count();
+
+    raft_storage_stats stats();
+
+private:
+    struct segment {
+        int seq;
+        int first_index;            // raft index of the first entry in this segment
+        std::vector<off_t> offsets; // file offset of every entry
+        off_t size;
+    };
+
+    static const int entry_header_size = 6 * sizeof(int);
+
+    std::mutex mtx;                 // protects the pending batch, the indexes below and the counters
+    std::mutex io_mtx;              // protects the segment files
+    std::mutex meta_mtx;
+    std::mutex snapshot_mtx;        // one snapshot file is written or checked at a time, outside io_mtx
+
+    raft_storage_options opt;
+
+    // group commit
+    std::string pending;                            // encoded entries waiting for the writer
+    std::vector <std::pair<int, int>> pending_entries; // (index, encoded size) of every pending entry
+    int pending_cut;                // the disk log loses every index >= it before the pending entries go out
+    long long cuts;                 // cuts made so far
+    std::chrono::steady_clock::time_point pending_since;
+    int appended_index;             // last index handed to append()
+    int durable_idx;                // last index written and synced
+    bool stopping;
+    std::condition_variable writer_cv;
+    std::condition_variable durable_cv;
+    std::thread *writer;
+    raft_storage_stats counters;
+
+    std::string dir;
     std::string meta_file_name;
-    std::string log_file_name;
-    std::string log_meta_file_name;
     std::string snapshot_file_name;
-    std::string snapshot_meta_file_name;
+    std::string staged_file_name;
+    std::string snapshot_tmp_file_name;
+
+    // snapshot being received, guarded by io_mtx
+    int staged_fd;
+    int staged_index;
+    int staged_term;
+    int staged_source;
+    off_t staged_size;
 
     bool need_recovery, need_recover_snapshot;
-    int log_meta_size;
+    int snapshot_index;
+
+    int meta_fd;
+    int log_fd;                     // the active (last) segment
+    std::vector<segment> segments;
+
+    std::string segment_file_name(int seq);
+
+    std::vector<int> list_segments();
+
+    void open_segment(int seq, int first_index);
+
+    int last_index();
+
+    void run_writer();
 
-    std::vector <std::pair<int, int>> meta_log;
+    bool flush_locked();
 
-    void write_int(std::fstream &, const int &);
+    bool write_batch(const std::string &buf, const std::vector <std::pair<int, int>> &entries);
 
-    void read_int(std::fstream &, int &);
+    bool truncate_locked(const int &index);
+
+    // drop the pending entries >= index and queue the cut for the writer, must hold mtx
+    void cut_locked(const int &index);
+
+    void sync_dir();
+
+    // the snapshot file is in place: drop the covered segments, must hold io_mtx
+    void publish_snapshot_locked(const int &last_included_index);
+
+    // entries covered by the snapshot are as good as durable
+    void cover_snapshot(const int &last_included_index);
+
+    void encode_entry(std::string &buf, const int &index, const log_entry<command> &entry);
+
+    // queue encoded entries for the log writer, sizes holds (index, encoded size) of each of them
+    bool enqueue(const int &index, const std::string &buf, const std::vector <std::pair<int, int>> &sizes);
+
+    bool write_all(int fd, const char *buf, size_t len, off_t offset);
 };
 
 template<typename command>
-raft_storage<command>::raft_storage(const std::string &dir) {
+raft_storage<command>::raft_storage(const std::string &dir, const raft_storage_options &opt) :
+        opt(opt), pending_cut(INT_MAX), cuts(0), appended_index(0), durable_idx(0), stopping(false), writer(nullptr), counters(),
+        dir(dir), staged_fd(-1), staged_index(0), staged_term(0), staged_source(0), staged_size(0),
+        snapshot_index(0), meta_fd(-1), log_fd(-1) {
     // Your code here
     mtx.lock();
     meta_file_name = dir + "/meta.rft";
-    log_file_name = dir + "/log.rft";
-    log_meta_file_name = dir + "/log_meta.rft";
     snapshot_file_name = dir + "/snapshot.rft";
-    snapshot_meta_file_name = dir + "/snapshot_meta.rft";
+    staged_file_name = dir + "/snapshot_staged.rft";
+    snapshot_tmp_file_name = dir + "/snapshot_tmp.rft";
 
     // iff need recovery, meta file must exist
     need_recovery = (access(meta_file_name.c_str(), F_OK) != -1);
-    need_recover_snapshot = (access(snapshot_meta_file_name.c_str(), F_OK) != -1);
-    log_meta_size = static_cast<int>(sizeof(int) + sizeof(int));
+    need_recover_snapshot = (access(snapshot_file_name.c_str(), F_OK) != -1);
+
+    meta_fd = open(meta_file_name.c_str(), O_RDWR | O_CREAT, 0644);
+    assert(meta_fd >= 0);
 
-    // init meta
+    // init meta and start from an empty log
     if (!need_recovery) {
-        std::fstream meta_file;
-        meta_file.open(meta_file_name, std::fstream::binary | std::fstream::out);
-        int vote_for_init = -1, term_init = 0;
-        write_int(meta_file, vote_for_init);
-        write_int(meta_file, term_init);
+        int meta[2] = {-1, 0}; // vote_for, term
+        write_all(meta_fd, (const char *) meta, sizeof(meta), 0);
+        for (int seq: list_segments()) {
+            unlink(segment_file_name(seq).c_str());
+        }
+        open_segment(0, 1);
+        sync_dir();
     }
     mtx.unlock();
+
+    writer = new std::thread(&raft_storage::run_writer, this);
 }
 
 template<typename command>
 raft_storage<command>::~raft_storage() {
     // Your code here
-
+    {
+        std::unique_lock <std::mutex> lock(mtx);
+        stopping = true;
+    }
+    writer_cv.notify_all();
+    durable_cv.notify_all();
+    writer->join();
+    delete writer;
+    flush();
+
+    if (staged_fd >= 0) {
+        close(staged_fd);
+    }
+    if (log_fd >= 0) {
+        close(log_fd);
+    }
+    if (meta_fd >= 0) {
+        close(meta_fd);
+    }
 }
 
 template<typename command>
 void raft_storage<command>::recover_snapshot(int &last_included_index, std::vector <log_entry<command>> &logs,
-                                             std::vector<char> &snapshot_data) {
+                                             snapshot_reader &reader) {
     if (!need_recover_snapshot) {
         return;
     }
-    mtx.lock();
-
-    std::ifstream snapshot_file(snapshot_file_name, std::ifstream::binary);
-    std::fstream snapshot_meta_file(snapshot_meta_file_name, std::fstream::binary | std::fstream::in);
+    io_mtx.lock();
+    // only the header is read here, the state machine streams the rest
+    bool ok = reader.open(snapshot_file_name);
+    assert(ok);
+    (void) ok;
 
     assert(logs.size() >= 1);
-    int last_snapshot_index, last_snapshot_term;
-    read_int(snapshot_meta_file, last_snapshot_index);
-    read_int(snapshot_meta_file, last_snapshot_term);
+    last_included_index = reader.last_included_index();
+    snapshot_index = reader.last_included_index();
+    logs[0].term = reader.last_included_term();
+    io_mtx.unlock();
 
-    last_included_index = last_snapshot_index;
-    logs[0].term = last_snapshot_term;
+    mtx.lock();
+    appended_index = std::max(appended_index, snapshot_index);
+    durable_idx = std::max(durable_idx, snapshot_index);
+    mtx.unlock();
+}
 
-    std::istreambuf_iterator<char> begin(snapshot_file);
-    std::istreambuf_iterator<char> end;
-    std::string snapshot_data_in_file(begin, end);
-    snapshot_data = std::vector<char>(snapshot_data_in_file.begin(), snapshot_data_in_file.end());
+template<typename command>
+bool raft_storage<command>::install_snapshot(const int &last_included_index, const int &last_included_term,
+                                             const std::function<bool(snapshot_writer &)> &write) {
+    std::unique_lock <std::mutex> snapshot_lock(snapshot_mtx);
+    // the slow part, writing and syncing the file, leaves io_mtx to the log writer
+    snapshot_writer writer;
+    if (!writer.open(snapshot_tmp_file_name, last_included_index, last_included_term) || !write(writer) ||
+        !writer.finish()) {
+        writer.abort();
+        unlink(snapshot_tmp_file_name.c_str());
+        return false;
+    }
+    io_mtx.lock();
+    if (last_included_index <= snapshot_index) {
+        // a newer snapshot got installed meanwhile
+        io_mtx.unlock();
+        unlink(snapshot_tmp_file_name.c_str());
+        return true;
+    }
+    if (rename(snapshot_tmp_file_name.c_str(), snapshot_file_name.c_str()) != 0) {
+        io_mtx.unlock();
+        return false;
+    }
+    publish_snapshot_locked(last_included_index);
+    io_mtx.unlock();
 
-    snapshot_file.close();
-    snapshot_meta_file.close();
-    mtx.unlock();
+    cover_snapshot(last_included_index);
+    return true;
 }
 
 template<typename command>
-bool raft_storage<command>::install_snapshot(const int &last_included_index,
-                                             const std::vector <log_entry<command>> &logs,
-                                             const std::vector<char> &snapshot_data) {
-    mtx.lock();
-    std::fstream snapshot_file(snapshot_file_name, std::fstream::binary | std::fstream::trunc | std::fstream::out);
-    std::fstream snapshot_meta_file(snapshot_meta_file_name,
-                                    std::fstream::binary | std::fstream::trunc | std::fstream::out);
+bool raft_storage<command>::read_snapshot(const int &last_included_index, const int &offset, const int &len,
+                                          std::vector<char> &data, bool &done) {
+    std::unique_lock <std::mutex> io_lock(io_mtx);
+    if (snapshot_index != last_included_index) {
+        return false;
+    }
+    int fd = open(snapshot_file_name.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || offset > st.st_size) {
+        close(fd);
+        return false;
+    }
+    int n = (int) std::min((off_t) len, st.st_size - offset);
+    data.resize(n);
+    bool ok = true;
+    for (int got = 0; ok && got < n;) {
+        ssize_t r = pread(fd, &data[got], n - got, offset + got);
+        ok = r > 0;
+        got += ok ? r : 0;
+    }
+    close(fd);
+    done = offset + n == st.st_size;
+    return ok;
+}
 
-    assert(logs.size() >= 1);
-    int last_snapshot_index = last_included_index, last_snapshot_term = logs[0].term;
-    write_int(snapshot_meta_file, last_snapshot_index);
-    write_int(snapshot_meta_file, last_snapshot_term);
+template<typename command>
+int raft_storage<command>::stage_snapshot(const int &last_included_index, const int &last_included_term,
+                                          const int &source, const int &offset, const std::vector<char> &data) {
+    std::unique_lock <std::mutex> io_lock(io_mtx);
+    // only chunks of the very same snapshot file may be glued together
+    if (staged_fd < 0 || staged_index != last_included_index || staged_term != last_included_term ||
+        staged_source != source) {
+        if (offset != 0) {
+            return 0;
+        }
+        if (staged_fd >= 0) {
+            close(staged_fd);
+        }
+        staged_fd = open(staged_file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (staged_fd < 0) {
+            return 0;
+        }
+        staged_index = last_included_index;
+        staged_term = last_included_term;
+        staged_source = source;
+        staged_size = 0;
+    }
+    if (offset != staged_size) {
+        // a retransmitted or an out of order chunk
+        return staged_size;
+    }
+    if (!write_all(staged_fd, data.data(), data.size(), offset)) {
+        return staged_size;
+    }
+    staged_size += data.size();
+    return staged_size;
+}
+
+template<typename command>
+bool raft_storage<command>::install_staged_snapshot(snapshot_reader &reader) {
+    std::unique_lock <std::mutex> snapshot_lock(snapshot_mtx);
+    io_mtx.lock();
+    if (staged_fd < 0 || fdatasync(staged_fd) != 0) {
+        io_mtx.unlock();
+        return false;
+    }
+    close(staged_fd);
+    staged_fd = -1;
+    int last_included_index = staged_index, last_included_term = staged_term;
+    bool moved = rename(staged_file_name.c_str(), snapshot_tmp_file_name.c_str()) == 0;
+    io_mtx.unlock();
+
+    // read the whole file once without io_mtx, a damaged transfer must not replace a good snapshot
+    if (!moved || !reader.open(snapshot_tmp_file_name) || reader.last_included_index() != last_included_index ||
+        reader.last_included_term() != last_included_term || !reader.verify()) {
+        reader.close();
+        unlink(snapshot_tmp_file_name.c_str());
+        return false;
+    }
 
-    std::string input(snapshot_data.begin(), snapshot_data.end());
-    snapshot_file.write(input.c_str(), input.size());
+    io_mtx.lock();
+    if (last_included_index <= snapshot_index) {
+        // a newer snapshot got saved locally while this one was received
+        io_mtx.unlock();
+        reader.close();
+        unlink(snapshot_tmp_file_name.c_str());
+        return false;
+    }
+    if (rename(snapshot_tmp_file_name.c_str(), snapshot_file_name.c_str()) != 0) {
+        io_mtx.unlock();
+        reader.close();
+        return false;
+    }
+    publish_snapshot_locked(last_included_index);
+    io_mtx.unlock();
 
-    snapshot_file.close();
-    snapshot_meta_file.close();
-    mtx.unlock();
+    cover_snapshot(last_included_index);
     return true;
 }
 
+template<typename command>
+void raft_storage<command>::publish_snapshot_locked(const int &last_included_index) {
+    sync_dir();
+    snapshot_index = last_included_index;
+
+    // compaction: every segment but the active one that ends at or before the snapshot is useless now
+    while (segments.size() > 1 && segments[1].first_index <= snapshot_index + 1) {
+        unlink(segment_file_name(segments.front().seq).c_str());
+        segments.erase(segments.begin());
+    }
+}
+
+template<typename command>
+void raft_storage<command>::cover_snapshot(const int &last_included_index) {
+    mtx.lock();
+    appended_index = std::max(appended_index, last_included_index);
+    durable_idx = std::max(durable_idx, last_included_index);
+    mtx.unlock();
+}
+
 template<typename command>
 void raft_storage<command>::recovery(int &current_term, int &vote_for,
                                      std::vector <log_entry<command>> &logs) {
     if (!need_recovery) {
         return;
     }
-    mtx.lock();
+    io_mtx.lock();
     if (logs.size() != 1) { // keep bid
         printf("Error, A not-qualified logs vector input, size: %d", (int) logs.size());
         log_entry<command> ent;
@@ -158,255 +454,449 @@ void raft_storage<command>::recovery(int &current_term, int &vote_for,
         logs.push_back(ent);
     }
 
-    // Open All persistent file
-    std::fstream meta_file;
-    std::fstream log_file;
-    std::fstream log_meta_file;
-
-    meta_file.open(meta_file_name, std::fstream::binary | std::fstream::in | std::fstream::out);
-    log_file.open(log_file_name, std::fstream::binary | std::fstream::in);
-    log_meta_file.open(log_meta_file_name, std::fstream::binary | std::fstream::in);
-
-    // move cursor to correct place
-    log_file.seekg(0, std::fstream::beg);
-    meta_file.seekg(0, std::fstream::beg);
-    log_meta_file.seekg(0, std::fstream::beg);
-
-    read_int(meta_file, vote_for);
-    read_int(meta_file, current_term);
-
-    int term, data_size;
-    meta_log.clear(); // keep bid
-    while (!log_meta_file.eof()) {
-        read_int(log_meta_file, term);
-        read_int(log_meta_file, data_size);
-        meta_log.push_back(std::make_pair(term, data_size));
-//        printf("Read log here, data size = %d \n", static_cast<int>(data_size));
-
-        char *s = new char[data_size];
-        log_file.read(s, data_size);
-//        if ((int) strlen(s) < data_size) {
-//            break; // special case
-//        }
-        // produce log entry and push back
-        log_entry<command> tmp;
-        tmp.term = term;
-        ((raft_command *) (&tmp.cmd))->deserialize(s, data_size);
-        logs.push_back(tmp);
-    }
-
-    log_meta_file.close();
-    meta_file.close();
-    log_file.close();
+    int meta[2] = {-1, 0};
+    if (pread(meta_fd, meta, sizeof(meta), 0) == (ssize_t) sizeof(meta)) {
+        vote_for = meta[0];
+        current_term = meta[1];
+    }
+
+    // replay every segment, stop at the first torn or out-of-order entry and cut the rest
+    segments.clear();
+    std::vector<int> seqs = list_segments();
+    bool broken = false;
+    for (int seq: seqs) {
+        std::string name = segment_file_name(seq);
+        if (broken) {
+            unlink(name.c_str());
+            continue;
+        }
+        std::ifstream seg_file(name, std::ifstream::binary);
+        std::string data((std::istreambuf_iterator<char>(seg_file)), std::istreambuf_iterator<char>());
+        seg_file.close();
+
+        segment seg;
+        seg.seq = seq;
+        seg.first_index = -1;
+        seg.size = 0;
+
+        size_t cursor = 0;
+        while (cursor + entry_header_size <= data.size()) {
+            int header[6]; // index, term, size, voters, learners, crc
+            memcpy(header, data.c_str() + cursor, entry_header_size);
+            int index = header[0], term = header[1], data_size = header[2];
+            if (data_size < 0 || cursor + entry_header_size + data_size > data.size()) {
+                break;
+            }
+            const char *payload = data.c_str() + cursor + entry_header_size;
+            uint32_t crc = raft_crc32((const char *) header, 5 * sizeof(int));
+            crc = raft_crc32(payload, data_size, crc);
+            if (crc != (uint32_t) header[5]) {
+                break;
+            }
+            int expected = seg.first_index == -1 ? index : seg.first_index + (int) seg.offsets.size();
+            if (index != expected || (!segments.empty() && seg.first_index == -1 && index <= last_index())) {
+                break;
+            }
+
+            if (index > snapshot_index && index != snapshot_index + (int) logs.size()) {
+                // a hole right after the snapshot, nothing after it can be trusted
+                break;
+            }
+
+            if (seg.first_index == -1) {
+                seg.first_index = index;
+            }
+            seg.offsets.push_back(cursor);
+            cursor += entry_header_size + data_size;
+
+            if (index > snapshot_index) {
+                log_entry<command> tmp;
+                tmp.term = term;
+                tmp.conf = raft_config(header[3], header[4]);
+                ((raft_command *) (&tmp.cmd))->deserialize(payload, data_size);
+                logs.push_back(tmp);
+            }
+        }
+        seg.size = cursor;
+        if (cursor != data.size()) {
+            // torn tail
+            broken = true;
+            truncate(name.c_str(), cursor);
+        }
+        if (seg.first_index == -1) {
+            seg.first_index = segments.empty() ? snapshot_index + 1 : last_index() + 1;
+        }
+        segments.push_back(seg);
+    }
+
+    if (segments.empty()) {
+        open_segment(0, snapshot_index + 1);
+    } else {
+        log_fd = open(segment_file_name(segments.back().seq).c_str(), O_WRONLY | O_CREAT, 0644);
+        assert(log_fd >= 0);
+    }
+    int recovered = std::max(last_index(), snapshot_index);
+    io_mtx.unlock();
+
+    mtx.lock();
+    appended_index = recovered;
+    durable_idx = recovered;
     mtx.unlock();
 }
 
 template<typename command>
-bool raft_storage<command>::update(const int &term, const int &vote_for, const std::vector <log_entry<command>> &log) {
-    mtx.lock();
-    std::fstream meta_file(meta_file_name, std::fstream::binary | std::fstream::trunc | std::fstream::out);
-    std::fstream log_file(log_file_name, std::fstream::binary | std::fstream::trunc | std::fstream::out);
-    std::fstream log_meta_file(log_meta_file_name, std::fstream::binary | std::fstream::trunc | std::fstream::out);
-
-    write_int(meta_file, vote_for);
-    write_int(meta_file, term);
+bool raft_storage<command>::append(const int &index, const std::vector <log_entry<command>> &entries, int offset) {
+    int n = entries.size();
+    if (offset >= n) {
+        return true;
+    }
+    std::string buf;
+    std::vector <std::pair<int, int>> sizes;
+    for (int i = offset; i < n; ++i) {
+        size_t before = buf.size();
+        encode_entry(buf, index + i - offset, entries[i]);
+        sizes.push_back(std::make_pair(index + i - offset, (int) (buf.size() - before)));
+    }
+    return enqueue(index, buf, sizes);
+}
 
-    meta_log.clear();
-    int log_term, data_size, n = log.size();
-    assert(n >= 1);
-    for (int i = 1; i < n; ++i) {
-        log_term = log[i].term;
-        data_size = ((raft_command *) (&(log[i].cmd)))->size();
-        char *s = new char[data_size];
-        ((raft_command *) (&(log[i].cmd)))->serialize(s, data_size);
+template<typename command>
+bool raft_storage<command>::append(const int &index, const std::vector <log_entry_ptr<command>> &entries,
+                                   int offset) {
+    int n = entries.size();
+    if (offset >= n) {
+        return true;
+    }
+    std::string buf;
+    std::vector <std::pair<int, int>> sizes;
+    for (int i = offset; i < n; ++i) {
+        size_t before = buf.size();
+        encode_entry(buf, index + i - offset, *entries[i]);
+        sizes.push_back(std::make_pair(index + i - offset, (int) (buf.size() - before)));
+    }
+    return enqueue(index, buf, sizes);
+}
 
-        write_int(log_meta_file, log_term);
-        write_int(log_meta_file, data_size);
+template<typename command>
+bool raft_storage<command>::append(const int &index, const log_entry<command> &entry) {
+    std::string buf;
+    encode_entry(buf, index, entry);
+    return enqueue(index, buf, std::vector <std::pair<int, int>>(1, std::make_pair(index, (int) buf.size())));
+}
 
-        log_file.write(s, data_size);
-        meta_log.push_back(std::make_pair(log_term, data_size));
+template<typename command>
+bool raft_storage<command>::enqueue(const int &index, const std::string &buf,
+                                    const std::vector <std::pair<int, int>> &sizes) {
+    std::unique_lock <std::mutex> lock(mtx);
+    if (index <= appended_index) {
+        cut_locked(index);
     }
+    if (pending_entries.empty() && pending_cut == INT_MAX) {
+        pending_since = std::chrono::steady_clock::now();
+    }
+    pending.append(buf);
+    pending_entries.insert(pending_entries.end(), sizes.begin(), sizes.end());
+    appended_index = sizes.back().first;
+    lock.unlock();
+    writer_cv.notify_one();
+    return true;
+}
 
-    log_meta_file.close();
-    meta_file.close();
-    log_file.close();
-    mtx.unlock();
+template<typename command>
+bool raft_storage<command>::truncate_suffix(const int &index) {
+    std::unique_lock <std::mutex> lock(mtx);
+    if (pending_entries.empty() && pending_cut == INT_MAX) {
+        pending_since = std::chrono::steady_clock::now();
+    }
+    cut_locked(index);
+    lock.unlock();
+    writer_cv.notify_one();
     return true;
 }
 
 template<typename command>
-void raft_storage<command>::read_int(std::fstream &f, int &a) {
-    int tmp;
-    f.read((char *) (&tmp), sizeof(int));
-    a = tmp;
+void raft_storage<command>::cut_locked(const int &index) {
+    // entries still waiting for the writer never reach the disk
+    while (!pending_entries.empty() && pending_entries.back().first >= index) {
+        pending.resize(pending.size() - pending_entries.back().second);
+        pending_entries.pop_back();
+    }
+    pending_cut = std::min(pending_cut, index);
+    ++cuts;
+    appended_index = std::min(appended_index, index - 1);
+    durable_idx = std::min(durable_idx, index - 1);
+    durable_cv.notify_all();
+}
+
+template<typename command>
+bool raft_storage<command>::persist_meta(const int &term, const int &vote_for) {
+    int meta[2] = {vote_for, term};
+    meta_mtx.lock();
+    bool ok = write_all(meta_fd, (const char *) meta, sizeof(meta), 0) && fdatasync(meta_fd) == 0;
+    meta_mtx.unlock();
+    return ok;
 }
 
 template<typename command>
-void raft_storage<command>::write_int(std::fstream &f, const int &a) {
-    f.write((char *) (&a), sizeof(int));
+bool raft_storage<command>::flush() {
+    std::unique_lock <std::mutex> io_lock(io_mtx);
+    return flush_locked();
 }
 
+template<typename command>
+bool raft_storage<command>::wait_durable(const int &index, const long long &cuts) {
+    std::unique_lock <std::mutex> lock(mtx);
+    auto cut = [&]() { return cuts >= 0 && this->cuts != cuts; };
+    durable_cv.wait(lock, [&]() { return durable_idx >= index || appended_index < index || cut() || stopping; });
+    return durable_idx >= index && !cut();
+}
 
-// Disable efficient but buggy code!
-/**
- *
- * @tparam command
- * @param idx I'll persist 1-n command in storage
- * Input the last index you want to keep, if is zero, cut to zero!
- * @return
- */
-//template<typename command>
-//bool raft_storage<command>::truncate_log(const int &idx) {
-//    // if input index of n, I'll truncate to 0 - (n - 1)
-//    int new_log_size = 0, new_meta_size = log_meta_size * idx;
-//    int n = std::min(idx, static_cast<int>(meta_log.size()));
-//    for (int i = 0; i < n; ++i) {
-//        new_log_size += meta_log[i].second;
-//    }
-//
-//    printf("Execute Truncate, meta size = %d, size = %d, log size = %d\n",
-//           new_meta_size, idx, new_log_size);
-//
-//    truncate(log_file_name.c_str(), new_log_size);
-//    truncate(log_meta_file_name.c_str(), new_meta_size);
-//    if (idx > static_cast<int>(meta_log.size())) {
-//        meta_log.resize(idx);
-//    }
-//
-//    return true;
-//}
-
-//template<typename command>
-//bool raft_storage<command>::append_log(const int &idx, const log_entry<command> &log) {
-//    mtx.lock(); // keep bio!
-//    if ((int) meta_log.size() > idx && meta_log[idx].first == log.term) {
-//        return true; // done
-//    } else if ((int) meta_log.size() > idx) {
-//        meta_log.resize(idx);
-//    }
-//    std::fstream log_file;
-//    std::fstream log_meta_file;
-//
-//    log_file.open(log_file_name, std::fstream::ate | std::fstream::out | std::fstream::binary);
-//    log_meta_file.open(log_meta_file_name, std::fstream::ate | std::fstream::binary | std::fstream::out);
-//
-//    int term, data_size;
-//    term = log.term;
-//    auto cmd = log.cmd;
-//    data_size = ((raft_command *) (&cmd))->size();
-//    char *s = new char[data_size];
-//
-//    ((raft_command *) (&cmd))->serialize(s, data_size);
-//    write_int(log_meta_file, term);
-//    write_int(log_meta_file, data_size);
-//
-////    printf("Write log here, data size = %d \n", static_cast<int>(data_size));
-//    log_file.write(s, data_size);
-//
-//    meta_log.push_back(std::make_pair(term, data_size));
-//
-//    log_meta_file.close();
-//    log_file.close();
-//
-//    mtx.unlock();
-//    return true;
-//}
-
-
-template<typename command>
-bool raft_storage<command>::update_vote(const int &vote_for) {
-    std::fstream meta_file(meta_file_name, std::fstream::binary | std::fstream::in);
-    int current_term, vote_for_tmp;
-    read_int(meta_file, vote_for_tmp);
-    read_int(meta_file, current_term);
-    meta_file.close();
-
-    // truncate and overwrite
-    meta_file.open(meta_file_name, std::fstream::binary | std::fstream::trunc | std::fstream::out);
-    write_int(meta_file, vote_for);
-    write_int(meta_file, current_term);
-    meta_file.close();
+template<typename command>
+int raft_storage<command>::durable_index() {
+    std::unique_lock <std::mutex> lock(mtx);
+    return durable_idx;
+}
+
+template<typename command>
+long long raft_storage<command>::cut_count() {
+    std::unique_lock <std::mutex> lock(mtx);
+    return cuts;
+}
+
+template<typename command>
+raft_storage_stats raft_storage<command>::stats() {
+    std::unique_lock <std::mutex> lock(mtx);
+    return counters;
+}
+
+template<typename command>
+void raft_storage<command>::run_writer() {
+    std::unique_lock <std::mutex> lock(mtx);
+    while (true) {
+        writer_cv.wait(lock, [&]() { return stopping || !pending_entries.empty() || pending_cut != INT_MAX; });
+        if (stopping) {
+            return;
+        }
+        // give concurrent appenders a moment to join this batch
+        auto deadline = pending_since + std::chrono::microseconds(opt.max_batch_delay_us);
+        while (!stopping && (int) pending.size() < opt.max_batch_bytes &&
+               std::chrono::steady_clock::now() < deadline) {
+            writer_cv.wait_until(lock, deadline);
+        }
+        lock.unlock();
+        flush();
+        lock.lock();
+    }
+}
+
+template<typename command>
+bool raft_storage<command>::flush_locked() {
+    std::string buf;
+    std::vector <std::pair<int, int>> entries;
+    int cut;
+    {
+        std::unique_lock <std::mutex> lock(mtx);
+        buf.swap(pending);
+        entries.swap(pending_entries);
+        cut = pending_cut;
+        pending_cut = INT_MAX;
+    }
+    if (entries.empty() && cut == INT_MAX) {
+        return true;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    bool ok = truncate_locked(cut);
+    if (ok && !entries.empty()) {
+        ok = write_batch(buf, entries) && fdatasync(log_fd) == 0;
+    }
+    long long us = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+
+    {
+        std::unique_lock <std::mutex> lock(mtx);
+        // a cut queued while we wrote leaves only what is below it durable
+        int written = entries.empty() ? durable_idx : std::min(entries.back().first, pending_cut - 1);
+        if (ok) {
+            durable_idx = std::max(durable_idx, written);
+            if (!entries.empty()) {
+                counters.batches++;
+                counters.entries += entries.size();
+                counters.bytes += buf.size();
+                counters.max_batch_entries = std::max(counters.max_batch_entries, (long long) entries.size());
+                counters.fsync_total_us += us;
+                counters.fsync_max_us = std::max(counters.fsync_max_us, us);
+            }
+        } else {
+            // put the batch back so that the next round retries it, less what was cut meanwhile
+            while (!entries.empty() && entries.back().first >= pending_cut) {
+                buf.resize(buf.size() - entries.back().second);
+                entries.pop_back();
+            }
+            pending = buf + pending;
+            entries.insert(entries.end(), pending_entries.begin(), pending_entries.end());
+            pending_entries.swap(entries);
+            pending_cut = std::min(pending_cut, cut);
+        }
+    }
+    durable_cv.notify_all();
+    return ok;
+}
+
+template<typename command>
+bool raft_storage<command>::write_batch(const std::string &buf, const std::vector <std::pair<int, int>> &entries) {
+    size_t cursor = 0, i = 0, n = entries.size();
+    while (i < n) {
+        int index = entries[i].first;
+        if (index <= last_index()) {
+            truncate_locked(index);
+        }
+        segment *active = &segments.back();
+        if (index > last_index() + 1 || active->size >= opt.segment_size) {
+            // roll over to a new segment, also used to leave a hole behind a freshly installed snapshot
+            if (active->offsets.empty()) {
+                active->first_index = index;
+            } else {
+                if (fdatasync(log_fd) != 0) {
+                    return false;
+                }
+                open_segment(active->seq + 1, index);
+                sync_dir();
+                active = &segments.back();
+            }
+        }
+
+        // one write for the whole run of consecutive entries
+        size_t j = i, run_bytes = 0;
+        while (j < n && entries[j].first == index + (int) (j - i)) {
+            active->offsets.push_back(active->size + run_bytes);
+            run_bytes += entries[j].second;
+            ++j;
+        }
+        if (!write_all(log_fd, buf.c_str() + cursor, run_bytes, active->size)) {
+            active->offsets.resize(active->offsets.size() - (j - i));
+            return false;
+        }
+        active->size += run_bytes;
+        cursor += run_bytes;
+        i = j;
+    }
     return true;
 }
 
 template<typename command>
-bool raft_storage<command>::update_term(const int &term) {
-    std::fstream meta_file(meta_file_name, std::fstream::binary | std::fstream::in);
-    int current_term, vote_for_tmp;
-    read_int(meta_file, vote_for_tmp);
-    read_int(meta_file, current_term);
-    meta_file.close();
+bool raft_storage<command>::truncate_locked(const int &index) {
+    if (index > last_index()) {
+        return true;
+    }
 
-    // truncate and overwrite
-    meta_file.open(meta_file_name, std::fstream::binary | std::fstream::trunc | std::fstream::out);
-    write_int(meta_file, vote_for_tmp);
-    write_int(meta_file, term);
-    meta_file.close();
+    // unlink whole segments after the cut point, but always keep one to append to
+    while (segments.size() > 1 && segments.back().first_index >= index) {
+        close(log_fd);
+        unlink(segment_file_name(segments.back().seq).c_str());
+        segments.pop_back();
+        log_fd = open(segment_file_name(segments.back().seq).c_str(), O_WRONLY | O_CREAT, 0644);
+        assert(log_fd >= 0);
+    }
+
+    segment &active = segments.back();
+    int keep = std::max(0, index - active.first_index);
+    if (keep < (int) active.offsets.size()) {
+        active.size = active.offsets[keep];
+        active.offsets.resize(keep);
+        if (ftruncate(log_fd, active.size) != 0 || fdatasync(log_fd) != 0) {
+            return false;
+        }
+    }
+    if (active.offsets.empty()) {
+        active.first_index = index;
+    }
     return true;
 }
 
 template<typename command>
-bool raft_storage<command>::update_meta(const int &vote_for, const int &term) {
-    std::fstream meta_file(meta_file_name, std::fstream::binary | std::fstream::trunc | std::fstream::out);
-    write_int(meta_file, vote_for);
-    write_int(meta_file, term);
-    meta_file.close();
+void raft_storage<command>::sync_dir() {
+    int fd = open(dir.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+template<typename command>
+std::string raft_storage<command>::segment_file_name(int seq) {
+    return dir + "/log_" + std::to_string(seq) + ".rft";
+}
+
+template<typename command>
+std::vector<int> raft_storage<command>::list_segments() {
+    std::vector<int> seqs;
+    DIR *d = opendir(dir.c_str());
+    if (d == nullptr) {
+        return seqs;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(d)) != nullptr) {
+        int seq;
+        char tail[8];
+        if (sscanf(ent->d_name, "log_%d.%7s", &seq, tail) == 2 && std::string(tail) == "rft") {
+            seqs.push_back(seq);
+        }
+    }
+    closedir(d);
+    std::sort(seqs.begin(), seqs.end());
+    return seqs;
+}
+
+template<typename command>
+void raft_storage<command>::open_segment(int seq, int first_index) {
+    if (log_fd >= 0) {
+        close(log_fd);
+    }
+    log_fd = open(segment_file_name(seq).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(log_fd >= 0);
+
+    segment seg;
+    seg.seq = seq;
+    seg.first_index = first_index;
+    seg.size = 0;
+    segments.push_back(seg);
+}
+
+template<typename command>
+int raft_storage<command>::last_index() {
+    const segment &active = segments.back();
+    return active.first_index + (int) active.offsets.size() - 1;
+}
+
+template<typename command>
+void raft_storage<command>::encode_entry(std::string &buf, const int &index, const log_entry<command> &entry) {
+    int data_size = ((raft_command *) (&(entry.cmd)))->size();
+    int header[6] = {index, entry.term, data_size, (int) entry.conf.voters, (int) entry.conf.learners, 0};
+
+    size_t start = buf.size();
+    buf.resize(start + entry_header_size + data_size);
+    char *payload = &buf[start + entry_header_size];
+    ((raft_command *) (&(entry.cmd)))->serialize(payload, data_size);
+
+    uint32_t crc = raft_crc32((const char *) header, 5 * sizeof(int));
+    header[5] = (int) raft_crc32(payload, data_size, crc);
+    memcpy(&buf[start], header, entry_header_size);
+}
+
+template<typename command>
+bool raft_storage<command>::write_all(int fd, const char *buf, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        buf += n;
+        len -= n;
+        offset += n;
+    }
     return true;
 }
-//
-//template<typename command>
-//void raft_storage<command>::truncate_file_directly(int idx) {
-//    // a more inefficient version
-//    std::fstream log_file;
-//    std::fstream log_meta_file;
-//
-//    log_file.open(log_file_name, std::fstream::in | std::fstream::binary);
-//    log_meta_file.open(log_meta_file_name, std::fstream::binary | std::fstream::in);
-//
-//    // move cursor to correct place
-//    log_file.seekg(0, std::fstream::beg);
-//    log_meta_file.seekg(0, std::fstream::beg);
-//
-//    int term, data_size;
-//    std::vector <log_entry<command>> logs;
-//
-//    meta_log.clear();
-//    while (!log_meta_file.eof()) {
-//        read_int(log_meta_file, term);
-//        read_int(log_meta_file, data_size);
-//        meta_log.push_back(std::make_pair(term, data_size));
-//
-//        char *s = new char[data_size];
-//        log_file.read(s, data_size);
-//
-//        // produce log entry and push back
-//        log_entry<command> tmp;
-//        tmp.term = term;
-//        ((raft_command *) (&tmp.cmd))->deserialize(s, data_size);
-//        logs.push_back(tmp);
-//    }
-//
-//    log_meta_file.close();
-//    log_file.close();
-//
-//    int n = std::min(idx, (int) logs.size());
-//    log_file.open(log_file_name, std::fstream::out | std::fstream::binary | std::fstream::trunc);
-//    log_meta_file.open(log_meta_file_name, std::fstream::binary | std::fstream::out | std::fstream::trunc);
-//
-//    for (int i = 0; i < n; ++i) {
-//        write_int(log_meta_file, meta_log[i].first);
-//        write_int(log_meta_file, meta_log[i].second);
-//
-//        auto cmd = logs[i].cmd;
-//        data_size = ((raft_command *) (&cmd))->size();
-//        char *s = new char[data_size];
-//        ((raft_command *) (&cmd))->serialize(s, data_size);
-//        log_file.write(s, data_size);
-//    }
-//    log_meta_file.close();
-//    log_file.close();
-//    // inefficient method stops here
-//}
-
-
-#endif // raft_storage_h
\ No newline at end of file
+
+#endif // raft_storage_h
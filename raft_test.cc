@@ -4,6 +4,10 @@
 
 
 #include "raft_test_utils.h"
+#include "raft_batcher.h"
+#include "raft_kv.h"
+
+#include <future>
 
 typedef raft_group<list_state_machine, list_command> list_raft_group;
 
@@ -66,6 +70,71 @@ TEST_CASE(part1, re_election, "Election after network failure")
     delete group;   
 }
 
+TEST_CASE(part1, pre_vote, "A rejoining node does not disturb the leader, a cut off leader steps down")
+{
+    int num_nodes = 3;
+    list_raft_group *group = new list_raft_group(num_nodes);
+    int leader = group->check_exact_one_leader();
+    mssleep(500); // the heartbeats carry the term to everybody
+    int term = group->check_same_term();
+
+    // an isolated follower times out again and again, but never finds a majority to raise its term
+    int follower = (leader + 1) % num_nodes;
+    group->disable_node(follower);
+    mssleep(2000);
+    int follower_term;
+    group->nodes[follower]->is_leader(follower_term);
+    ASSERT(follower_term == term, "the isolated follower moved to term " << follower_term);
+    group->enable_node(follower);
+    mssleep(1000);
+    ASSERT(group->check_exact_one_leader() == leader, "the rejoining follower deposed the leader");
+    ASSERT(group->check_same_term() == term, "the rejoining follower raised the term");
+
+    // check-quorum: a leader that hears from nobody stops leading well before the others would be back
+    group->disable_node((leader + 1) % num_nodes);
+    group->disable_node((leader + 2) % num_nodes);
+    mssleep(1000);
+    int leader_term;
+    ASSERT(!group->nodes[leader]->is_leader(leader_term), "a leader without a quorum still leads");
+    group->enable_node((leader + 1) % num_nodes);
+    group->enable_node((leader + 2) % num_nodes);
+    group->check_exact_one_leader();
+    delete group;
+}
+
+TEST_CASE(part1, transfer_leadership, "Leadership transfer hands over within a round trip")
+{
+    int num_nodes = 3;
+    list_raft_group *group = new list_raft_group(num_nodes);
+    for (int i = 0; i < num_nodes; i++)
+        group->nodes[i]->set_lease_read(true); // voters must not wait out the lease of the leader handing over
+    int leader = group->check_exact_one_leader();
+    group->append_new_command(101, num_nodes);
+
+    for (int round = 0; round < 3; round++) {
+        int target = (leader + 1) % num_nodes;
+        int term, index;
+        ASSERT(!group->nodes[target]->transfer_leadership(leader), "a follower transfers the leadership");
+        auto start = std::chrono::steady_clock::now();
+        ASSERT(group->nodes[leader]->transfer_leadership(target), "leader " << leader << " cannot hand over to " << target);
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+        ASSERT(elapsed.count() < 200, "the transfer took " << elapsed.count() << "ms");
+        ASSERT(!group->nodes[leader]->new_command(list_command(102), term, index), "the old leader takes commands");
+        ASSERT(group->check_exact_one_leader() == target, "node " << target << " did not take over");
+        group->append_new_command(200 + round, num_nodes);
+        leader = target;
+    }
+
+    // a target that cannot be reached never takes over, the leader keeps leading
+    int target = (leader + 1) % num_nodes;
+    group->disable_node(target);
+    ASSERT(!group->nodes[leader]->transfer_leadership(target), "handed over to an unreachable node");
+    ASSERT(group->check_exact_one_leader() == leader, "the leader gave up");
+    group->append_new_command(300, num_nodes - 1);
+    group->enable_node(target);
+    delete group;
+}
+
 TEST_CASE(part2, basic_agree, "Basic Agreement")
 {
     int num_nodes = 3;
@@ -227,6 +296,79 @@ TEST_CASE(part2, concurrent_start, "Concurrent starts")
     delete group;
 }
 
+TEST_CASE(part2, batch_commands, "A batch of commands takes consecutive indexes")
+{
+    int num_nodes = 3;
+    list_raft_group *group = new list_raft_group(num_nodes);
+    int leader = group->check_exact_one_leader();
+
+    std::vector<list_command> batch;
+    for (int i = 0; i < 10; i++)
+        batch.push_back(list_command(200 + i));
+    int term, first_index, last_index;
+    ASSERT(group->nodes[leader]->new_commands(batch, term, first_index, last_index), "leader rejects the batch");
+    ASSERT(last_index == first_index + 9, "indexes " << first_index << ".." << last_index << " for 10 commands");
+    for (int i = 0; i < 10; i++) {
+        int res = group->wait_commit(first_index + i, num_nodes, term);
+        ASSERT(res == 200 + i, "wrong value " << res << " committed for index " << first_index + i);
+    }
+    ASSERT(!group->nodes[(leader + 1) % num_nodes]->new_commands(batch, term, first_index, last_index),
+           "a follower accepts a batch");
+
+    // concurrent clients share batches, each still gets the index of its own command
+    raft_batcher<list_state_machine, list_command> batcher(group->nodes[leader]);
+    int iters = 50;
+    std::vector<int> indices(iters, 0), terms(iters, 0);
+    std::vector<std::thread> clients;
+    for (int i = 0; i < iters; i++) {
+        clients.emplace_back([&, i]() {
+            if (!batcher.submit(list_command(300 + i), terms[i], indices[i]))
+                indices[i] = -1;
+        });
+    }
+    for (auto &th : clients)
+        th.join();
+    for (int i = 0; i < iters; i++) {
+        ASSERT(indices[i] > 0, "client " << i << " was rejected");
+        int res = group->wait_commit(indices[i], num_nodes, terms[i]);
+        if (res == -1)
+            break; // the leader moved on, the rest may be gone
+        ASSERT(res == 300 + i, "wrong value " << res << " committed for index " << indices[i]);
+    }
+    delete group;
+}
+
+TEST_CASE(part2, commit_callback, "Commit callbacks report applied and overwritten entries")
+{
+    int num_nodes = 3;
+    list_raft_group *group = new list_raft_group(num_nodes);
+    int leader = group->check_exact_one_leader();
+
+    int term, index;
+    std::promise<bool> applied;
+    ASSERT(group->nodes[leader]->new_command(list_command(101), term, index,
+                                             [&](bool ok) { applied.set_value(ok); }), "leader rejects the command");
+    std::future<bool> result = applied.get_future();
+    ASSERT(result.wait_for(std::chrono::milliseconds(2500)) == std::future_status::ready, "no callback");
+    ASSERT(result.get(), "an applied entry is reported lost");
+    ASSERT(group->wait_commit(index, num_nodes, term) == 101, "wrong value committed");
+
+    // a partitioned leader accepts an entry that the others overwrite
+    group->disable_node(leader);
+    std::promise<bool> lost;
+    ASSERT(group->nodes[leader]->new_command(list_command(102), term, index,
+                                             [&](bool ok) { lost.set_value(ok); }), "old leader rejects the command");
+    group->append_new_command(103, num_nodes - 1);
+    group->append_new_command(104, num_nodes - 1);
+    group->enable_node(leader);
+    group->append_new_command(105, num_nodes);
+
+    result = lost.get_future();
+    ASSERT(result.wait_for(std::chrono::milliseconds(2500)) == std::future_status::ready, "no callback");
+    ASSERT(!result.get(), "an overwritten entry is reported applied");
+    delete group;
+}
+
 TEST_CASE(part2, rejoin, "Rejoin of partitioned leader")
 {
     int num_nodes = 3;
@@ -332,6 +474,37 @@ TEST_CASE(part2, backup, "Leader backs up quickly over incorrect follower logs")
     delete group;
 }
 
+TEST_CASE(part2, fast_backup, "Leader jumps over a far behind follower log with conflict hints")
+{
+    int num_nodes = 3;
+    list_raft_group *group = new list_raft_group(num_nodes);
+    int value = 0;
+
+    group->append_new_command(value++, num_nodes);
+
+    // one follower misses lots of committed entries
+    int leader1 = group->check_exact_one_leader();
+    int lagging = (leader1 + 1) % num_nodes;
+    int other = (leader1 + 2) % num_nodes;
+    group->disable_node(lagging);
+    for (int i = 0; i < 300; i++)
+        group->append_new_command(value++, num_nodes - 1);
+
+    // the other follower leads now, knowing nothing about the lagging one
+    group->disable_node(leader1);
+    group->enable_node(lagging);
+    int leader2 = group->check_exact_one_leader();
+    ASSERT(leader2 == other, "node " << leader2 << " lacks committed entries but leads");
+
+    group->append_new_command(value++, num_nodes - 1);
+    int count = group->clients[leader2][lagging]->count();
+    ASSERT(count < 50, "too many RPCs (" << count << ") to back up 300 entries");
+
+    group->enable_node(leader1);
+    group->append_new_command(value++, num_nodes);
+    delete group;
+}
+
 TEST_CASE(part2, rpc_count, "RPC counts aren't too high")
 {
     int num_nodes = 3;
@@ -593,6 +766,171 @@ TEST_CASE(part3, unreliable_figure_8, "Raft paper Figure 8 under unreliable netw
     delete group;
 }
 
+TEST_CASE(part3, wal_group_commit, "Write-ahead log group commit and recovery")
+{
+    const char *dir = "raft_temp_wal";
+    remove_directory(dir);
+    ASSERT(mkdir(dir, 0777) >= 0, "cannot create dir " << std::string(dir));
+    raft_storage_options opt;
+    opt.segment_size = 256; // roll over every few entries
+    {
+        raft_storage<list_command> storage(dir, opt);
+        for (int i = 1; i <= 100; i++) {
+            log_entry<list_command> ent;
+            ent.term = 1;
+            ent.cmd = list_command(i);
+            ASSERT(storage.append(i, ent), "append fails");
+        }
+        ASSERT(storage.wait_durable(100), "log is not durable");
+        raft_storage_stats st = storage.stats();
+        ASSERT(st.entries == 100, "flushed " << st.entries << " entries, expect 100");
+        ASSERT(st.batches >= 1 && st.batches <= 100, "unexpected batch count " << st.batches);
+
+        // cut a suffix that spans several segments and rewrite it in a new term
+        ASSERT(storage.truncate_suffix(41), "truncate fails");
+        for (int i = 41; i <= 60; i++) {
+            log_entry<list_command> ent;
+            ent.term = 2;
+            ent.cmd = list_command(1000 + i);
+            ASSERT(storage.append(i, ent), "append fails");
+        }
+        ASSERT(storage.persist_meta(2, 1), "persist meta fails");
+    }
+    {
+        raft_storage<list_command> storage(dir, opt);
+        int term = -1, vote_for = -1, last_included_index = 0;
+        std::vector<log_entry<list_command>> logs(1);
+        snapshot_reader snapshot;
+        storage.recover_snapshot(last_included_index, logs, snapshot);
+        ASSERT(!snapshot.is_open() && last_included_index == 0, "found a snapshot that was never saved");
+        storage.recovery(term, vote_for, logs);
+        ASSERT(term == 2 && vote_for == 1, "wrong meta " << term << ", " << vote_for);
+        ASSERT(logs.size() == 61, "recovered " << logs.size() - 1 << " entries, expect 60");
+        for (int i = 1; i <= 60; i++) {
+            int expect = i <= 40 ? i : 1000 + i;
+            ASSERT(logs[i].cmd.value == expect, "wrong value at " << i << ": " << logs[i].cmd.value);
+            ASSERT(logs[i].term == (i <= 40 ? 1 : 2), "wrong term at " << i);
+        }
+    }
+    remove_directory(dir);
+}
+
+TEST_CASE(part3, wal_overwrite, "A wait for durability fails once the entries were overwritten")
+{
+    const char *dir = "raft_temp_wal";
+    remove_directory(dir);
+    ASSERT(mkdir(dir, 0777) >= 0, "cannot create dir " << std::string(dir));
+    raft_storage_options opt;
+    opt.max_batch_delay_us = 200000; // the first batch is still pending when the overwrite comes
+    {
+        raft_storage<list_command> storage(dir, opt);
+        std::vector<log_entry<list_command>> entries(10);
+        for (int i = 0; i < 10; i++) {
+            entries[i].term = 1;
+            entries[i].cmd = list_command(i + 1);
+        }
+        ASSERT(storage.append(1, entries, 0), "append fails");
+
+        // an AppendEntries of term 1 waits for its entries, a newer leader replaces 6..10 meanwhile
+        long long cuts = storage.cut_count();
+        bool stale_durable = true;
+        std::thread waiter([&]() { stale_durable = storage.wait_durable(10, cuts); });
+        mssleep(20);
+        for (int i = 5; i < 10; i++) {
+            entries[i].term = 2;
+            entries[i].cmd = list_command(100 + i);
+        }
+        ASSERT(storage.append(6, entries, 5), "append fails");
+        waiter.join();
+        ASSERT(!stale_durable, "the overwritten entries were reported durable");
+        ASSERT(storage.wait_durable(10, storage.cut_count()), "the new entries are not durable");
+    }
+    remove_directory(dir);
+}
+
+TEST_CASE(part4, ring_log, "Ring log compaction, truncation and shared entries")
+{
+    raft_log<list_command> log;
+    ASSERT(log.size() == 1 && log[0].term == -1, "a new log holds only the dummy entry");
+    for (int i = 1; i <= 100; i++) { // wraps around and grows the ring several times
+        std::shared_ptr<log_entry<list_command>> ent = std::make_shared<log_entry<list_command>>();
+        ent->term = i / 10;
+        ent->cmd = list_command(i);
+        log.push_back(ent);
+    }
+    ASSERT(log.size() == 101, "log size " << log.size() << ", expect 101");
+
+    // entries handed out stay alive after the log drops them
+    log_entry_ptr<list_command> kept = log.at(30);
+    log.compact(40, log[40].term);
+    ASSERT(log.size() == 61 && log[0].term == 4, "wrong log after compaction");
+    ASSERT(kept->cmd.value == 30 && kept.use_count() == 1, "compacted entry is not released to its holder");
+    for (int i = 1; i <= 60; i++)
+        ASSERT(log[i].cmd.value == 40 + i, "wrong value at " << i << ": " << log[i].cmd.value);
+
+    for (int i = 101; i <= 200; i++) {
+        std::shared_ptr<log_entry<list_command>> ent = std::make_shared<log_entry<list_command>>();
+        ent->term = 20;
+        ent->cmd = list_command(i);
+        log.push_back(ent);
+    }
+    log.resize(71);
+    ASSERT(log.size() == 71 && log.back().cmd.value == 110, "wrong log after truncation");
+    log.compact(70, log[70].term);
+    ASSERT(log.size() == 1 && log[0].term == 20, "compacting everything leaves the dummy only");
+    log.reset(30);
+    ASSERT(log.size() == 1 && log[0].term == 30, "reset keeps the snapshot term");
+}
+
+TEST_CASE(part4, snapshot_file, "Snapshot file blocks, checksums and streaming")
+{
+    const char *file = "raft_temp_snapshot.rft";
+    snapshot_writer writer;
+    ASSERT(writer.open(file, 7, 3, 16), "cannot create the snapshot file");
+    for (int i = 0; i < 100; i++)
+        ASSERT(writer.write_int(i), "write fails");
+    ASSERT(writer.finish(), "finish fails");
+
+    {
+        snapshot_reader reader;
+        ASSERT(reader.open(file), "cannot open the snapshot file");
+        ASSERT(reader.last_included_index() == 7 && reader.last_included_term() == 3, "wrong header");
+        ASSERT(reader.verify(), "a good file does not verify");
+        for (int i = 0; i < 100; i++) {
+            int value;
+            ASSERT(reader.read_int(value) && value == i, "wrong value at " << i);
+        }
+        ASSERT(reader.eof(), "payload longer than written");
+    }
+
+    // flip one payload byte in the middle, its block no longer matches the checksum
+    int fd = open(file, O_RDWR);
+    char byte;
+    off_t middle = sizeof(snapshot_header) + 5 * (8 + 16) + 8 + 3;
+    ASSERT(pread(fd, &byte, 1, middle) == 1, "cannot read the file");
+    byte ^= 1;
+    ASSERT(pwrite(fd, &byte, 1, middle) == 1, "cannot write the file");
+    close(fd);
+    {
+        snapshot_reader reader;
+        std::vector<char> data;
+        ASSERT(reader.open(file), "the header is intact");
+        ASSERT(!reader.verify(), "a corrupted block verifies");
+        ASSERT(!reader.read_all(data), "a corrupted block is read");
+    }
+
+    // a file without its end block is incomplete
+    byte ^= 1;
+    fd = open(file, O_RDWR);
+    ASSERT(pwrite(fd, &byte, 1, middle) == 1 && ftruncate(fd, lseek(fd, 0, SEEK_END) - 8) == 0, "cannot cut the file");
+    close(fd);
+    {
+        snapshot_reader reader;
+        ASSERT(reader.open(file) && !reader.verify(), "a file without its end verifies");
+    }
+    unlink(file);
+}
+
 TEST_CASE(part4, basic_snapshot, "Basic snapshot")
 {
     int num_nodes = 3;
@@ -615,6 +953,60 @@ TEST_CASE(part4, basic_snapshot, "Basic snapshot")
     delete group;   
 }
 
+TEST_CASE(part4, chunked_snapshot, "Snapshot sent in chunks to a lagging follower")
+{
+    int num_nodes = 3;
+    list_raft_group *group = new list_raft_group(num_nodes);
+    for (int i = 0; i < num_nodes; i++)
+        group->nodes[i]->set_snapshot_chunk_size(16);
+    int leader = group->check_exact_one_leader();
+    int killed_node = (leader + 1) % num_nodes;
+    group->disable_node(killed_node);
+    for (int i = 1 ; i < 100; i++)
+        group->append_new_command(100 + i, num_nodes - 1);
+    leader = group->check_exact_one_leader();
+    for (int i = 0; i < num_nodes; i++)
+        if (i != killed_node)
+            ASSERT(group->nodes[i]->save_snapshot(), "node " << i << " cannot save snapshot");
+    int chunks = (group->states[leader]->snapshot().size() + 15) / 16;
+
+    // a lossy network loses some chunks, the transfer resumes where the follower stopped
+    group->set_reliable(false);
+    int rpcs = 0;
+    for (int i = 0; i < num_nodes; i++)
+        rpcs -= group->clients[i][killed_node]->count();
+    group->enable_node(killed_node);
+    mssleep(3000);
+    group->set_reliable(true);
+    leader = group->check_exact_one_leader();
+    group->append_new_command(1024, num_nodes);
+    ASSERT(group->states[killed_node]->num_append_logs < 90, "the snapshot does not work");
+    for (int i = 0; i < num_nodes; i++)
+        rpcs += group->clients[i][killed_node]->count(); // a new leader may take over the transfer
+    ASSERT(rpcs >= chunks, "the snapshot of " << chunks << " chunks took only " << rpcs << " RPCs");
+    delete group;
+}
+
+TEST_CASE(part4, auto_snapshot, "Snapshot triggered by the log size")
+{
+    int num_nodes = 3;
+    list_raft_group *group = new list_raft_group(num_nodes);
+    for (int i = 0; i < num_nodes; i++)
+        group->nodes[i]->set_auto_snapshot(20, 0);
+    int leader = group->check_exact_one_leader();
+    int killed_node = (leader + 1) % num_nodes;
+    group->disable_node(killed_node);
+    for (int i = 1 ; i < 100; i++)
+        group->append_new_command(100 + i, num_nodes - 1);
+    // nobody calls save_snapshot, the killed node can only catch up through an automatic one
+    mssleep(1000);
+    group->enable_node(killed_node);
+    leader = group->check_exact_one_leader();
+    group->append_new_command(1024, num_nodes);
+    ASSERT(group->states[killed_node]->num_append_logs < 90, "no snapshot was taken automatically");
+    delete group;
+}
+
 TEST_CASE(part4, restore_snapshot, "Restore snapshot after failure")
 {
     int num_nodes = 3;
@@ -648,7 +1040,52 @@ TEST_CASE(part4, override_snapshot, "Overrive snapshot")
     group->restart(leader);
     group->append_new_command(1024, num_nodes);
     ASSERT(group->states[leader]->num_append_logs < 50, "the snapshot does not work");
-    delete group;   
+    delete group;
+}
+
+TEST_CASE(part4, membership_change, "Grow from 3 to 5 voters through learners, then remove the leader")
+{
+    int num_nodes = 5;
+    list_raft_group *group = new list_raft_group(num_nodes, "raft_temp", 3);
+    int leader = group->check_exact_one_leader();
+    ASSERT(leader < 3, "node " << leader << " is no voter yet");
+    for (int i = 1; i < 30; i++)
+        group->append_new_command(100 + i, 3);
+    ASSERT(group->states[3]->num_append_logs == 0 && group->states[4]->num_append_logs == 0,
+           "a node outside the configuration got entries");
+    ASSERT(group->nodes[leader]->save_snapshot(), "leader cannot save snapshot");
+
+    // the learners catch up through the snapshot, then vote
+    ASSERT(!group->nodes[leader]->promote_learner(3), "only a learner can be promoted");
+    ASSERT(group->nodes[leader]->add_learner(3), "cannot add learner 3");
+    ASSERT(group->nodes[leader]->add_learner(4), "cannot add learner 4");
+    group->append_new_command(200, num_nodes);
+    ASSERT(group->states[3]->num_append_logs < 20, "learner 3 did not start from the snapshot");
+    for (int node = 3; node < 5; node++) {
+        bool promoted = false;
+        for (int i = 0; i < 100 && !promoted; i++) {
+            promoted = group->nodes[leader]->promote_learner(node);
+            if (!promoted) mssleep(50);
+        }
+        ASSERT(promoted, "cannot promote learner " << node);
+    }
+
+    // with 5 voters, the leader and the new voters are a majority on their own
+    int disabled1 = (leader + 1) % 3, disabled2 = (leader + 2) % 3;
+    group->disable_node(disabled1);
+    group->disable_node(disabled2);
+    group->append_new_command(300, 3);
+    group->enable_node(disabled1);
+    group->enable_node(disabled2);
+    group->append_new_command(301, num_nodes);
+
+    // a leader removing itself steps down once the change commits, the others go on
+    ASSERT(group->nodes[leader]->remove_member(leader), "cannot remove the leader");
+    mssleep(1000);
+    int new_leader = group->check_exact_one_leader();
+    ASSERT(new_leader != leader, "the removed leader still leads");
+    group->append_new_command(400, num_nodes - 1);
+    delete group;
 }
 
 typedef raft_group<kv_state_machine, kv_command> kv_raft_group;
@@ -849,6 +1286,498 @@ TEST_CASE(part5, snapshot_kv, "Persist key-value snapshot")
     delete group;
 }
 
+TEST_CASE(part5, read_index, "Linearizable reads through ReadIndex without log entries")
+{
+    int num_nodes = 3;
+    kv_raft_group *group = new kv_raft_group(num_nodes);
+    int leader = group->check_exact_one_leader();
+    push_kv_commands(group, 10, 0);
+
+    long long entries = group->storages[leader]->stats().entries;
+    for (int i = 0; i < 10; i++) {
+        int index;
+        std::string value;
+        ASSERT(group->nodes[leader]->read_index(index), "leader cannot serve a read");
+        ASSERT(group->states[leader]->get("k" + std::to_string(i), value), "missing key k" << i);
+        ASSERT(value == "v" + std::to_string(i * 10), "wrong value " << value);
+    }
+    ASSERT(group->storages[leader]->stats().entries == entries, "reads went through the log");
+
+    int index;
+    ASSERT(!group->nodes[(leader + 1) % num_nodes]->read_index(index), "a follower serves a read");
+
+    // cut off from the others, the old leader can no longer prove it still leads
+    group->disable_node(leader);
+    ASSERT(!group->nodes[leader]->read_index(index), "a partitioned leader serves a read");
+    delete group;
+}
+
+TEST_CASE(part5, lease_read, "Lease reads need no heartbeat round while the lease holds")
+{
+    int num_nodes = 3;
+    kv_raft_group *group = new kv_raft_group(num_nodes);
+    for (int i = 0; i < num_nodes; i++)
+        group->nodes[i]->set_lease_read(true);
+    int leader = group->check_exact_one_leader();
+    push_kv_commands(group, 10, 0);
+
+    // the pings keep the lease fresh, reads cost no RPC of their own
+    int rpcs = group->rpc_count(leader);
+    for (int i = 0; i < 100; i++) {
+        int index;
+        std::string value;
+        ASSERT(group->nodes[leader]->read_index(index), "leader cannot serve a read");
+        ASSERT(group->states[leader]->get("k" + std::to_string(i % 10), value), "missing key");
+    }
+    rpcs = group->rpc_count(leader) - rpcs;
+    ASSERT(rpcs < 20, "100 lease reads took " << rpcs << " RPCs");
+
+    // the lease of a partitioned leader runs out before the others elect a new one
+    group->disable_node(leader);
+    mssleep(300);
+    int index;
+    ASSERT(!group->nodes[leader]->read_index(index), "a partitioned leader serves a read");
+    int new_leader = group->check_exact_one_leader();
+    ASSERT(new_leader != leader, "no new leader");
+    put_kv_pair(group, 10, true);
+    delete group;
+}
+
+TEST_CASE(part5, follower_read, "Followers serve reads no staler than the reader's last write")
+{
+    int num_nodes = 3;
+    kv_raft_group *group = new kv_raft_group(num_nodes);
+    int leader = group->check_exact_one_leader();
+    int term, index;
+    kv_command put(kv_command::CMD_PUT, "k", "v1");
+    ASSERT(group->nodes[leader]->new_command(put, term, index), "Leader should not change");
+
+    // the index of the write is the read-your-writes token
+    for (int i = 0; i < num_nodes; i++) {
+        int applied;
+        std::string value;
+        ASSERT(group->nodes[i]->read_applied(index, [&](kv_state_machine &state) { state.get("k", value); },
+                                             applied, std::chrono::milliseconds(2500)), "node " << i << " cannot read");
+        ASSERT(applied >= index, "read at " << applied << " before the write at " << index);
+        ASSERT(value == "v1", "wrong value " << value);
+    }
+
+    // a cut off follower cannot catch up with newer writes, but still serves older tokens
+    int follower = (leader + 1) % num_nodes;
+    group->disable_node(follower);
+    int old_index = index;
+    kv_command update(kv_command::CMD_PUT, "k", "v2");
+    ASSERT(group->nodes[leader]->new_command(update, term, index), "Leader should not change");
+    int applied;
+    std::string value;
+    auto read = [&](kv_state_machine &state) { state.get("k", value); };
+    ASSERT(!group->nodes[follower]->read_applied(index, read, applied, std::chrono::milliseconds(500)),
+           "a stale follower serves a newer token");
+    ASSERT(group->nodes[follower]->read_applied(old_index, read, applied, std::chrono::milliseconds(500)),
+           "a follower cannot serve an old token");
+    ASSERT(value == "v1", "wrong value " << value);
+
+    group->enable_node(follower);
+    ASSERT(group->nodes[follower]->read_applied(index, read, applied, std::chrono::milliseconds(2500)),
+           "the follower does not catch up");
+    ASSERT(value == "v2", "wrong value " << value);
+    delete group;
+}
+
+TEST_CASE(part5, batch_apply, "Apply a batch of key-value commands in order")
+{
+    kv_state_machine state;
+    std::vector<kv_command> batch;
+    batch.push_back(kv_command(kv_command::CMD_PUT, "k", "v1"));
+    batch.push_back(kv_command(kv_command::CMD_GET, "k", ""));
+    batch.push_back(kv_command(kv_command::CMD_PUT, "k", "v2"));
+    batch.push_back(kv_command(kv_command::CMD_DEL, "k", ""));
+    batch.push_back(kv_command(kv_command::CMD_GET, "k", ""));
+
+    std::vector<raft_command*> cmds;
+    for (auto &cmd : batch)
+        cmds.push_back(&cmd);
+    state.apply_logs(cmds);
+
+    for (auto &cmd : batch)
+        ASSERT(cmd.res->done, "command in the batch is not applied");
+    ASSERT(batch[0].res->succ && batch[0].res->value == "v1", "first put should insert");
+    ASSERT(batch[1].res->succ && batch[1].res->value == "v1", "get should see the earlier put in the batch");
+    ASSERT(!batch[2].res->succ && batch[2].res->value == "v1", "second put should replace v1");
+    ASSERT(batch[3].res->succ && batch[3].res->value == "v2", "del should remove v2");
+    ASSERT(!batch[4].res->succ, "get after del should miss");
+
+    // the snapshot reflects the whole batch
+    kv_state_machine restored;
+    restored.apply_snapshot(state.snapshot());
+    kv_command get(kv_command::CMD_GET, "k", "");
+    restored.apply_log(get);
+    ASSERT(!get.res->succ, "deleted key survives the snapshot");
+}
+
+TEST_CASE(part5, command_encoding, "One compact encoding for the log and the RPCs")
+{
+    kv_command put(kv_command::CMD_PUT, "key", std::string(300, 'v'));
+    // one byte each for the type and the key length, two for the value length
+    ASSERT(put.size() == 4 + 3 + 300, "put takes " << put.size() << " bytes");
+    std::vector<char> buf(put.size());
+    put.serialize(buf.data(), buf.size());
+
+    marshall m;
+    m << put;
+    ASSERT(m.get_content() == std::string(buf.begin(), buf.end()), "the RPC encodes differently from the log");
+    unmarshall u(m.get_content());
+    kv_command from_rpc, from_log;
+    u >> from_rpc;
+    from_log.deserialize(buf.data(), buf.size());
+    ASSERT(u.okdone(), "the RPC decoder left bytes over");
+    for (kv_command *cmd : {&from_rpc, &from_log})
+        ASSERT(cmd->cmd_tp == kv_command::CMD_PUT && cmd->key == "key" && cmd->value == put.value, "decoded wrong");
+
+    kv_command none;
+    std::vector<char> empty;
+    none.deserialize(empty.data(), 0);
+    ASSERT(none.cmd_tp == kv_command::CMD_NONE, "an empty command is a no-op");
+    from_log.deserialize(buf.data(), buf.size() - 1);
+    ASSERT(from_log.cmd_tp == kv_command::CMD_NONE && from_log.key.empty(), "a truncated command decoded");
+    for (int cut : {1, 4}) {
+        unmarshall truncated(m.get_content().substr(0, cut));
+        kv_command from_truncated;
+        truncated >> from_truncated;
+        ASSERT(!truncated.ok() && from_truncated.cmd_tp == kv_command::CMD_NONE, "a truncated RPC decoded");
+    }
+    std::string unknown = m.get_content();
+    unknown[0] = 0x3f;
+    from_log.deserialize(unknown.data(), unknown.size());
+    ASSERT(from_log.cmd_tp == kv_command::CMD_NONE && from_log.key.empty(), "an unknown type decoded");
+    unmarshall bad_type(unknown);
+    kv_command from_bad_type;
+    bad_type >> from_bad_type;
+    ASSERT(!bad_type.ok() && from_bad_type.cmd_tp == kv_command::CMD_NONE, "an unknown type decoded");
+
+    // decoded commands carry no result, applying them still works
+    kv_state_machine state;
+    state.apply_log(from_rpc);
+    std::string value;
+    ASSERT(state.get("key", value) && value == put.value, "a decoded put did not apply");
+}
+
+TEST_CASE(part5, cow_snapshot, "A snapshot view keeps its version while new commands apply")
+{
+    kv_state_machine state;
+    kv_command put1(kv_command::CMD_PUT, "a", "1");
+    state.apply_log(put1);
+    auto view = state.snapshot_view();
+
+    kv_command put2(kv_command::CMD_PUT, "a", "2");
+    kv_command put3(kv_command::CMD_PUT, "b", "3");
+    state.apply_log(put2);
+    state.apply_log(put3);
+
+    const char *file = "raft_temp_cow.rft";
+    snapshot_writer writer;
+    ASSERT(writer.open(file, 1, 1) && view(writer) && writer.finish(), "cannot write the view");
+    kv_state_machine old_state;
+    snapshot_reader reader;
+    ASSERT(reader.open(file) && old_state.load_snapshot(reader), "cannot load the view");
+    unlink(file);
+    kv_command get_a(kv_command::CMD_GET, "a", ""), get_b(kv_command::CMD_GET, "b", "");
+    old_state.apply_log(get_a);
+    old_state.apply_log(get_b);
+    ASSERT(get_a.res->succ && get_a.res->value == "1", "the view sees a later put");
+    ASSERT(!get_b.res->succ, "the view sees a later insert");
+
+    kv_command get_new(kv_command::CMD_GET, "a", "");
+    state.apply_log(get_new);
+    ASSERT(get_new.res->succ && get_new.res->value == "2", "the live state lost a put");
+}
+
+TEST_CASE(part5, session_bound, "Retries are answered once, the least recent clients are forgotten first")
+{
+    kv_state_machine state;
+    kv_command first(kv_command::CMD_PUT, "a", "1");
+    first.client = 1;
+    first.seq = 1;
+    state.apply_log(first);
+    ASSERT(first.res->succ, "the first put replaced a key");
+    auto view = state.snapshot_view();
+
+    // a range delete of nothing, one write for each client
+    for (unsigned long long client = 2; client <= 10001; ++client) {
+        kv_command other(kv_command::CMD_DEL_RANGE, "x", "y");
+        other.client = client;
+        other.seq = 1;
+        state.apply_log(other);
+    }
+    kv_command recent(kv_command::CMD_PUT, "b", "2");
+    recent.client = 10001;
+    recent.seq = 1;
+    state.apply_log(recent);
+    ASSERT(!recent.res->succ && recent.res->value == "0", "a recent retry applied again");
+
+    kv_command late(kv_command::CMD_PUT, "a", "1");
+    late.client = 1;
+    late.seq = 1;
+    state.apply_log(late);
+    ASSERT(!late.res->succ, "the least recent client is still remembered");
+
+    // the view kept the sessions it was taken with
+    const char *file = "raft_temp_session.rft";
+    snapshot_writer writer;
+    ASSERT(writer.open(file, 1, 1) && view(writer) && writer.finish(), "cannot write the view");
+    kv_state_machine old_state;
+    snapshot_reader reader;
+    ASSERT(reader.open(file) && old_state.load_snapshot(reader), "cannot load the view");
+    unlink(file);
+    kv_command retry(kv_command::CMD_PUT, "a", "1");
+    retry.client = 1;
+    retry.seq = 1;
+    old_state.apply_log(retry);
+    ASSERT(retry.res->succ, "the view lost a session");
+}
+
+TEST_CASE(part5, ordered_scan, "Prefix scans, range deletes and snapshots in key order")
+{
+    kv_state_machine state;
+    std::map<std::string, std::string> expected;
+    // enough keys for a few levels of nodes, in a scrambled order
+    for (int i = 0; i < 3000; i++) {
+        int n = (i * 7919) % 3000;
+        std::string key = (n % 3 ? "user/" : "item/") + std::to_string(100000 + n);
+        kv_command put(kv_command::CMD_PUT, key, std::to_string(n));
+        state.apply_log(put);
+        expected[key] = std::to_string(n);
+    }
+    auto view = state.snapshot_view();
+
+    kv_command scan(kv_command::CMD_SCAN, "item/", kv_command::prefix_end("item/"));
+    state.apply_log(scan);
+    ASSERT(scan.res->succ && scan.res->key == "", "the scan did not finish");
+    ASSERT(scan.res->entries.size() == 1000, scan.res->entries.size() << " keys with the prefix");
+    auto it = expected.begin();
+    for (auto &entry : scan.res->entries) {
+        ASSERT(entry.first == it->first && entry.second == it->second, "scan out of order at " << entry.first);
+        ++it;
+    }
+
+    kv_command del(kv_command::CMD_DEL_RANGE, "user/101000", "user/102000");
+    state.apply_log(del);
+    ASSERT(del.res->succ && del.res->value == "667", del.res->value << " keys deleted");
+    std::vector<std::pair<std::string, std::string>> users;
+    state.scan("user/", "", users);
+    ASSERT(users.size() == 2000 - 667, users.size() << " keys left");
+    for (size_t i = 1; i < users.size(); i++)
+        ASSERT(users[i - 1].first < users[i].first, "scan out of order");
+    std::string value;
+    ASSERT(!state.get("user/101001", value) && state.get("user/102002", value), "wrong keys deleted");
+
+    // the view predates the delete, and the snapshot comes out sorted
+    const char *file = "raft_temp_scan.rft";
+    snapshot_writer writer;
+    ASSERT(writer.open(file, 1, 1) && view(writer) && writer.finish(), "cannot write the view");
+    kv_state_machine old_state;
+    snapshot_reader reader;
+    ASSERT(reader.open(file) && old_state.load_snapshot(reader), "cannot load the view");
+    unlink(file);
+    std::vector<std::pair<std::string, std::string>> all;
+    old_state.scan("", "", all);
+    ASSERT(all.size() == expected.size(), "the view lost the deleted keys");
+    it = expected.begin();
+    for (auto &entry : all) {
+        ASSERT(entry.first == it->first && entry.second == it->second, "snapshot out of order at " << entry.first);
+        ++it;
+    }
+    ASSERT(state.snapshot() != old_state.snapshot(), "the delete leaked into the view");
+}
+
+TEST_CASE(part6, multi_raft, "Groups on shared hosts elect, commit and share the heartbeat RPCs")
+{
+    typedef raft<list_state_machine, list_command> list_raft;
+    int num_nodes = 3, num_groups = 8;
+    std::vector<rpcs*> servers = create_random_rpc_servers(num_nodes);
+    std::vector<std::vector<rpcc*>> clients(num_nodes);
+    std::vector<raft_host*> hosts(num_nodes);
+    for (int i = 0; i < num_nodes; i++) {
+        clients[i] = create_rpc_clients(servers);
+        hosts[i] = new raft_host(servers[i], clients[i], i);
+    }
+    remove_directory("raft_temp");
+    ASSERT(mkdir("raft_temp", 0777) >= 0, "cannot create dir raft_temp");
+    std::vector<std::vector<list_raft*>> nodes(num_groups, std::vector<list_raft*>(num_nodes));
+    std::vector<std::vector<list_state_machine*>> states(num_groups, std::vector<list_state_machine*>(num_nodes));
+    std::vector<std::vector<raft_storage<list_command>*>> storages(num_groups,
+                                                                   std::vector<raft_storage<list_command>*>(num_nodes));
+    for (int g = 0; g < num_groups; g++) {
+        for (int i = 0; i < num_nodes; i++) {
+            std::string dir = "raft_temp/raft_storage_" + std::to_string(g) + "_" + std::to_string(i);
+            ASSERT(mkdir(dir.c_str(), 0777) >= 0, "cannot create dir " << dir);
+            storages[g][i] = new raft_storage<list_command>(dir);
+            states[g][i] = new list_state_machine();
+            nodes[g][i] = new list_raft(hosts[i], g, storages[g][i], states[g][i]);
+        }
+    }
+    for (int g = 0; g < num_groups; g++)
+        for (int i = 0; i < num_nodes; i++)
+            nodes[g][i]->start();
+
+    // every group elects its own leader and commits on its own
+    for (int g = 0; g < num_groups; g++) {
+        int leader = -1, term, index;
+        for (int t = 0; t < 100 && leader < 0; t++) {
+            for (int i = 0; i < num_nodes; i++)
+                if (nodes[g][i]->is_leader(term)) leader = i;
+            if (leader < 0) mssleep(50);
+        }
+        ASSERT(leader >= 0, "group " << g << " has no leader");
+        ASSERT(nodes[g][leader]->new_command(list_command(1000 + g), term, index), "group " << g << " lost its leader");
+        for (int i = 0; i < num_nodes; i++) {
+            ASSERT(nodes[g][i]->wait_for_applied(index, std::chrono::milliseconds(2000)),
+                   "group " << g << " did not apply " << index << " on node " << i);
+            std::lock_guard<std::mutex> lock(states[g][i]->mtx);
+            ASSERT(states[g][i]->store[index] == 1000 + g, "group " << g << " applied another command");
+        }
+    }
+
+    // idle, a pair of nodes exchanges one heartbeat RPC per beat for all the groups
+    int rpcs = 0;
+    for (int i = 0; i < num_nodes; i++)
+        for (int j = 0; j < num_nodes; j++)
+            rpcs -= clients[i][j]->count();
+    mssleep(1500);
+    for (int i = 0; i < num_nodes; i++)
+        for (int j = 0; j < num_nodes; j++)
+            rpcs += clients[i][j]->count();
+    int separate = num_groups * (num_nodes - 1) * 1500 / 150;
+    ASSERT(rpcs < separate / 2, rpcs << " RPCs for the heartbeats, " << separate << " without sharing");
+
+    for (int g = 0; g < num_groups; g++)
+        for (int i = 0; i < num_nodes; i++)
+            nodes[g][i]->stop();
+    for (int i = 0; i < num_nodes; i++) {
+        delete hosts[i];
+        for (int j = 0; j < num_nodes; j++) {
+            clients[i][j]->cancel();
+            delete clients[i][j];
+        }
+        delete servers[i];
+    }
+    for (int g = 0; g < num_groups; g++) {
+        for (int i = 0; i < num_nodes; i++) {
+            delete nodes[g][i];
+            delete states[g][i];
+            delete storages[g][i];
+        }
+    }
+}
+
+TEST_CASE(part6, sharded_kv, "Ranges split and merge online, clients follow with NotMyRange")
+{
+    int num_nodes = 3;
+    std::vector<rpcs*> servers;
+    std::vector<std::vector<rpcc*>> clients(num_nodes);
+    std::vector<raft_host*> hosts(num_nodes);
+    auto start_hosts = [&]() {
+        servers = create_random_rpc_servers(num_nodes);
+        for (int i = 0; i < num_nodes; i++) {
+            clients[i] = create_rpc_clients(servers);
+            hosts[i] = new raft_host(servers[i], clients[i], i);
+        }
+    };
+    auto stop_hosts = [&]() {
+        for (int i = 0; i < num_nodes; i++) {
+            delete hosts[i];
+            for (int j = 0; j < num_nodes; j++) {
+                clients[i][j]->cancel();
+                delete clients[i][j];
+            }
+            delete servers[i];
+        }
+    };
+    start_hosts();
+    remove_directory("raft_temp");
+    ASSERT(mkdir("raft_temp", 0777) >= 0, "cannot create dir raft_temp");
+    raft_kv *kv = new raft_kv(hosts, "raft_temp");
+    kv_client writer(kv), reader(kv);
+
+    auto key = [](int i) { return "key" + std::to_string(100 + i); };
+    for (int i = 0; i < 40; i++)
+        ASSERT(writer.put(key(i), "value" + std::to_string(i)), "put " << key(i) << " failed");
+
+    // a write tried again, e.g. after a timeout, applies once, also where its key moved meanwhile
+    kv_command first(kv_command::CMD_PUT, key(45), "first");
+    first.client = 7;
+    first.seq = 1;
+    ASSERT(kv->execute(0, first, std::chrono::milliseconds(1000)) && first.res->succ, "put " << key(45) << " failed");
+
+    // the reader's table still has one range
+    ASSERT(kv->split(key(20)), "split failed");
+    ASSERT(!kv->split(key(20)), "split twice at the same key");
+    kv_route_table table = kv->route_table();
+    ASSERT(table.routes.size() == 2, table.routes.size() << " ranges after a split");
+    const kv_route *upper = table.find(key(30));
+    ASSERT(upper && upper->range.lo == key(20) && upper != table.find(key(10)), "wrong routes after the split");
+    for (int i = 0; i < num_nodes; i++) {
+        kv_state_machine *state = kv->state(upper->group, i);
+        for (int t = 0; t < 100 && state->range().vacant; t++)
+            mssleep(20);
+        ASSERT(state->range().lo == key(20), "node " << i << " serves the wrong range");
+        kv_state_machine *lower = kv->state(table.find(key(10))->group, i);
+        ASSERT(lower->range().hi == key(20), "node " << i << " kept the upper keys");
+        for (int t = 0; t < 100 && lower->handoffs() > 0; t++)
+            mssleep(20);
+        ASSERT(lower->handoffs() == 0, "node " << i << " kept the piece after the handoff");
+    }
+    std::string value;
+    for (int i = 0; i < 40; i++) {
+        ASSERT(reader.get(key(i), value) && value == "value" + std::to_string(i), "lost " << key(i) << " in the split");
+    }
+    ASSERT(reader.refreshes() > 0, "the stale table was not refused");
+    ASSERT(writer.put(key(45), "second"), "put " << key(45) << " failed");
+    kv_command again(kv_command::CMD_PUT, key(45), "first");
+    again.client = 7;
+    again.seq = 1;
+    ASSERT(kv->execute(upper->group, again, std::chrono::milliseconds(1000)) && again.res->succ,
+           "the retried put got another result");
+    ASSERT(reader.get(key(45), value) && value == "second", "the retried put was applied twice");
+    ASSERT(writer.del(key(35)) && !reader.get(key(35), value), "delete on the new range failed");
+    std::vector<std::pair<std::string, std::string>> entries;
+    ASSERT(reader.scan(key(15), key(25), entries) && entries.size() == 10, "scan across the ranges got "
+           << entries.size() << " keys");
+    ASSERT(entries.front().first == key(15) && entries.back().first == key(24), "scan across the ranges out of order");
+
+    ASSERT(kv->merge(key(20)), "merge failed");
+    ASSERT(kv->route_table().routes.size() == 1, "the ranges were not merged");
+    for (int i = 0; i < 40; i++) {
+        bool found = reader.get(key(i), value);
+        ASSERT(i == 35 ? !found : found && value == "value" + std::to_string(i), "lost " << key(i) << " in the merge");
+    }
+
+    // big ranges split at their median, small ones merge back
+    ASSERT(kv->balance(200, 0, 0) == 1, "the range over the byte threshold did not split");
+    ASSERT(kv->route_table().routes.size() == 2, "balance did not split");
+    ASSERT(kv->balance(0, 0, 1 << 20) == 1 && kv->route_table().routes.size() == 1, "cold ranges did not merge");
+    ASSERT(reader.get(key(0), value) && value == "value0", "lost a key while balancing");
+
+    // the routes and the groups come back from the dir
+    ASSERT(kv->split(key(10)), "split failed");
+    table = kv->route_table();
+    delete kv;
+    stop_hosts();
+    start_hosts();
+    kv = new raft_kv(hosts, "raft_temp");
+    kv_route_table recovered = kv->route_table();
+    ASSERT(recovered.version == table.version && recovered.routes.size() == 2 &&
+           recovered.find(key(10))->group == table.find(key(10))->group, "the routes were not recovered");
+    kv_client restarted(kv);
+    for (int i = 0; i < 40; i++) {
+        bool found = restarted.get(key(i), value);
+        ASSERT(i == 35 ? !found : found && value == "value" + std::to_string(i), "lost " << key(i) << " in a restart");
+    }
+
+    delete kv;
+    stop_hosts();
+}
+
 int main(int argc, char** argv) {
     unit_test_suite::instance()->run(argc, argv);
     return 0;
@@ -127,7 +127,8 @@ class raft_group {
 public:
     // typedef raft<list_state_machine, list_command> raft<state_machine, command>;
 
-    raft_group(int num, const char *storage_dir = "raft_temp");
+    // only the first `voters` nodes vote at first, the others wait to be added, 0 means all of them
+    raft_group(int num, const char *storage_dir = "raft_temp", int voters = 0);
 
     ~raft_group();
 
@@ -160,11 +161,14 @@ public:
     std::vector<std::vector<rpcc*>> clients;
     std::vector<raft_storage<command>*> storages;
     std::vector<state_machine*> states;
+    std::vector<int> initial_voters;
 };
 
 template<typename state_machine, typename command>
-raft_group<state_machine, command>::raft_group(int num, const char* storage_dir) {
+raft_group<state_machine, command>::raft_group(int num, const char* storage_dir, int voters) {
     nodes.resize(num, nullptr);
+    for (int i = 0; i < voters; i++)
+        initial_voters.push_back(i);
     servers = create_random_rpc_servers(num);
     clients.resize(num);
     states.resize(num);
@@ -180,6 +184,7 @@ raft_group<state_machine, command>::raft_group(int num, const char* storage_dir)
         state_machine *state = new state_machine();
         auto client = create_rpc_clients(servers);
         raft<state_machine, command>* node = new raft<state_machine, command>(servers[i], client, i, storage, state);
+        node->set_initial_config(initial_voters);
         nodes[i] = node;
         clients[i] = client;
         states[i] = state;
@@ -430,6 +435,7 @@ int raft_group<state_machine, command>::restart(int node) {
     clients[node] = create_rpc_clients(servers);
     
     nodes[node] = new raft<state_machine, command>(servers[node], clients[node], node, storage, states[node]);
+    nodes[node]->set_initial_config(initial_voters);
     // disable_node(node);
     nodes[node]->start();
     return 0;
@@ -157,6 +157,7 @@ class unmarshall {
 		}
 
 		bool ok() { return _ok; }
+		void fail() { _ok = false; } // for operator>> overloads which check more than the size
 		char *cstr() { return _buf;}
 		bool okdone();
 		unsigned int rawbyte();